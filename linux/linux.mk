@@ -63,4 +63,5 @@ INCLUDES += -I$(LIBOBS_INCLUDES)
 INCLUDES += -I$(FFMPEG_INCLUDES)
 
 LDD_LIBS += -lobs
+LDD_LIBS += -lavformat
 LDD_FLAG += -shared
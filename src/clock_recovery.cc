@@ -0,0 +1,150 @@
+/*
+Copyright (C) 2022 DEV47APPS, github.com/dev47apps
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include "plugin.h"
+#include "clock_recovery.h"
+
+#define BUCKET_US    1000000.0
+#define MAX_DRIFT    0.0005    // 500 ppm, far beyond any real crystal
+#define MAX_JUMP_US  1000000.0 // anything further off is a new timeline
+
+void ClockRecovery::Reset(void) {
+    pts0 = 0;
+    host0 = 0;
+    count = 0;
+    next = 0;
+    bucket_valid = false;
+    bucket_start = 0;
+    bucket_x = bucket_y = 0;
+    a = b = envelope = 0;
+    jitter = 0;
+    for (int i = 0; i < STREAMS; i++)
+        last_residual[i] = 0;
+}
+
+// Least squares line through the per-second fastest arrivals
+void ClockRecovery::Fit(void) {
+    double xs[WINDOW + 1], ys[WINDOW + 1];
+    double mx = 0, my = 0, sxx = 0, sxy = 0;
+    int n = 0;
+
+    for (int i = 0; i < count; i++) {
+        xs[n] = buckets[i].x;
+        ys[n] = buckets[i].y;
+        n++;
+    }
+    if (bucket_valid) {
+        xs[n] = bucket_x;
+        ys[n] = bucket_y;
+        n++;
+    }
+    if (n == 0)
+        return;
+
+    for (int i = 0; i < n; i++) {
+        mx += xs[i];
+        my += ys[i];
+    }
+    mx /= n;
+    my /= n;
+
+    for (int i = 0; i < n; i++) {
+        sxx += (xs[i] - mx) * (xs[i] - mx);
+        sxy += (xs[i] - mx) * (ys[i] - my);
+    }
+
+    b = (n > 1 && sxx > 0) ? sxy / sxx : 0;
+    if (b > MAX_DRIFT) b = MAX_DRIFT;
+    if (b < -MAX_DRIFT) b = -MAX_DRIFT;
+    a = my - b * mx;
+
+    envelope = 0;
+    for (int i = 0; i < n; i++) {
+        double r = ys[i] - (a + b * xs[i]);
+        if (i == 0 || r < envelope) envelope = r;
+    }
+}
+
+void ClockRecovery::Update(int stream, uint64_t pts, uint64_t host_ns) {
+    std::lock_guard<std::mutex> guard(lock);
+    double x, y, r;
+
+    if (host0 == 0) {
+        pts0 = pts;
+        host0 = host_ns;
+    }
+
+    x = (double) (int64_t) (pts - pts0);
+    y = (double) (int64_t) (host_ns - host0) / 1000.0 - x;
+    r = y - (a + b * x + envelope);
+
+    if (fabs(r) > MAX_JUMP_US && (count > 0 || bucket_valid)) {
+        ilog("clock: pts jumped by %.0f ms, starting over", r / 1000.0);
+        Reset();
+        pts0 = pts;
+        host0 = host_ns;
+        x = y = r = 0;
+    }
+
+    // RFC 3550 style, on how far each arrival lands above the line
+    if (stream >= 0 && stream < STREAMS) {
+        jitter += (fabs(r - last_residual[stream]) - jitter) / 16.0;
+        last_residual[stream] = r;
+    }
+
+    if (bucket_valid && x + y - bucket_start >= BUCKET_US) {
+        buckets[next].x = bucket_x;
+        buckets[next].y = bucket_y;
+        next = (next + 1) % WINDOW;
+        if (count < WINDOW) count++;
+        bucket_valid = false;
+    }
+
+    if (!bucket_valid) {
+        bucket_valid = true;
+        bucket_start = x + y;
+        bucket_x = x;
+        bucket_y = y;
+    }
+    else if (y < bucket_y) {
+        bucket_x = x;
+        bucket_y = y;
+    }
+
+    Fit();
+}
+
+uint64_t ClockRecovery::Map(uint64_t pts) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (host0 == 0)
+        return 0;
+
+    double x = (double) (int64_t) (pts - pts0);
+    double us = x + a + b * x + envelope;
+    return host0 + (uint64_t) (int64_t) (us * 1000.0);
+}
+
+double ClockRecovery::Drift(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    return b * 1e6;
+}
+
+double ClockRecovery::Jitter(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    return jitter / 1000.0;
+}
@@ -0,0 +1,46 @@
+// Copyright (C) 2022 DEV47APPS, github.com/dev47apps
+#pragma once
+#include <stdint.h>
+#include <mutex>
+
+// Maps phone pts (microseconds) onto the host monotonic clock (os_gettime_ns).
+//
+// Each packet arrives at pts + offset + drift * pts + delay, where delay is
+// the encoder, network and scheduling time and is never negative. The
+// fastest arrival in every second is kept, a least squares line through the
+// recent ones follows offset and drift, and the line is then lowered onto
+// the fastest arrival so delay spikes do not push timestamps later.
+// Audio and video feed the same clock so both land on one timeline.
+struct ClockRecovery {
+    static const int WINDOW = 64;       // seconds of history
+    static const int STREAMS = 2;
+
+    std::mutex lock;
+    uint64_t pts0;
+    uint64_t host0;
+    int count;
+    int next;
+    struct { double x, y; } buckets[WINDOW];
+    bool bucket_valid;
+    double bucket_start;
+    double bucket_x, bucket_y;
+    double a, b, envelope;
+    double jitter;
+    double last_residual[STREAMS];
+
+    ClockRecovery() { Reset(); }
+
+    void Reset(void);
+
+    // Add an arrival: the packet's pts and the host time its header came in
+    void Update(int stream, uint64_t pts, uint64_t host_ns);
+
+    // Host time for pts, 0 until Update() was called
+    uint64_t Map(uint64_t pts);
+
+    double Drift(void);   // ppm
+    double Jitter(void);  // ms
+
+private:
+    void Fit(void);
+};
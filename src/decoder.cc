@@ -0,0 +1,355 @@
+/*
+Copyright (C) 2022 DEV47APPS, github.com/dev47apps
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <string.h>
+#include <util/platform.h>
+#include "plugin.h"
+#include "decoder.h"
+
+#define DEFAULT_LIMIT (512 * 1024 * 1024)
+#define POOL_IDLE_NS  (10 * UINT64_C(1000000000))
+#define ERROR_WINDOW_NS (10 * UINT64_C(1000000000))
+#define MAX_FLUSHES   3
+#define MAX_RESTARTS  2
+
+static std::atomic<size_t> budget_limit(DEFAULT_LIMIT);
+static std::atomic<size_t> budget_used(0);
+static std::atomic<size_t> budget_peak(0);
+
+void packet_budget_set_limit(size_t bytes) {
+    ilog("packet memory limit: %llu MB", (unsigned long long) (bytes >> 20));
+    budget_limit = bytes;
+}
+
+size_t packet_budget_limit(void) {
+    return budget_limit.load(std::memory_order_relaxed);
+}
+
+size_t packet_budget_used(void) {
+    return budget_used.load(std::memory_order_relaxed);
+}
+
+size_t packet_budget_peak(void) {
+    return budget_peak.load(std::memory_order_relaxed);
+}
+
+bool packet_budget_exceeded(void) {
+    return packet_budget_used() >= packet_budget_limit();
+}
+
+bool h264_is_keyframe(const uint8_t *data, size_t len) {
+    for (size_t i = 0; i + 3 < len; i++) {
+        // 00 00 01 start code, the 4 byte form ends the same way
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            if ((data[i + 3] & 0x1f) == 5)
+                return true;
+            i += 2;
+        }
+    }
+    return false;
+}
+
+static inline bool start_code(const uint8_t *p) {
+    return p[0] == 0 && p[1] == 0 && p[2] == 1;
+}
+
+size_t h264_parameter_sets(const uint8_t *data, size_t len, uint8_t *out, size_t size) {
+    size_t used = 0;
+    size_t i = 0;
+
+    while (i + 3 < len) {
+        if (!start_code(data + i)) {
+            i++;
+            continue;
+        }
+
+        // This NAL runs up to the next start code, the 4 byte form included
+        size_t start = (i > 0 && data[i - 1] == 0) ? i - 1 : i;
+        int type = data[i + 3] & 0x1f;
+        size_t next = i + 3;
+        while (next + 2 < len && !start_code(data + next))
+            next++;
+
+        size_t end = next + 2 < len ? next : len;
+        if (end < len && data[end - 1] == 0)
+            end--;
+
+        if (type == 7 || type == 8) {
+            if (used + end - start > size)
+                return 0;
+
+            memcpy(out + used, data + start, end - start);
+            used += end - start;
+        }
+        else if (type == 1 || type == 5) {
+            // Parameter sets come before the slices
+            break;
+        }
+        i = next;
+    }
+    return used;
+}
+
+// https://wiki.multimedia.cx/index.php/MPEG-4_Audio
+bool aac_config_parse(const uint8_t *config, int *sample_rate, int *channels) {
+    static const int aac_frequencies[] = {96000,88200,64000,48000,44100,32000,24000,22050,16000,12000,11025,8000};
+    int sr_idx = ((config[0] << 1) | (config[1] >> 7)) & 0x1F;
+    if (sr_idx >= (int) ARRAY_LEN(aac_frequencies))
+        return false;
+
+    *sample_rate = aac_frequencies[sr_idx];
+    *channels = (config[1] >> 3) & 0xF;
+    return true;
+}
+
+static inline void atomic_max(std::atomic<size_t>& peak, size_t value) {
+    size_t prev = peak.load(std::memory_order_relaxed);
+    while (value > prev && !peak.compare_exchange_weak(prev, value, std::memory_order_relaxed))
+        ;
+}
+
+void Decoder::account(size_t old_size, size_t new_size) {
+    if (new_size > old_size) {
+        size_t delta = new_size - old_size;
+        mem_used += delta;
+        atomic_max(budget_peak, budget_used.fetch_add(delta) + delta);
+        if (counters)
+            atomic_max(counters->mem_peak, counters->mem_used.fetch_add(delta) + delta);
+    }
+    else if (new_size < old_size) {
+        size_t delta = old_size - new_size;
+        mem_used -= delta;
+        budget_used.fetch_sub(delta);
+        if (counters)
+            counters->mem_used.fetch_sub(delta);
+    }
+}
+
+void packet_unref(const DataPacket *packet) {
+    DataPacket *p = const_cast<DataPacket*>(packet);
+    if (p->refs.fetch_sub(1) != 1)
+        return;
+
+    // Keep the home alive, the packet may be deleted below
+    std::shared_ptr<PacketHome> home = p->home;
+    std::lock_guard<std::mutex> guard(home->lock);
+    if (home->decoder) {
+        home->decoder->recieveQueue.add_item(p);
+        home->decoder->lent--;
+        return;
+    }
+
+    // The decoder is gone, the last tap frees it
+    budget_used.fetch_sub(p->size);
+    delete p;
+}
+
+PacketTap::PacketTap(int streams, size_t limit) : streams(streams), limit(limit),
+    queued(0), video_gap(true), closed(false), dropped(0)
+{
+}
+
+PacketTap::~PacketTap(void) {
+    Clear();
+}
+
+void PacketTap::Clear(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    while (!queue.empty()) {
+        packet_unref(queue.front().packet);
+        queue.pop_front();
+    }
+    queued = 0;
+}
+
+size_t PacketTap::Push(const TapPacket &tp) {
+    size_t now_queued;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!(streams & tp.stream) || closed)
+            return queued;
+
+        if (tp.stream == TAP_VIDEO) {
+            // A gap in the video is only safe to leave at a keyframe
+            if (video_gap && !tp.key) {
+                dropped++;
+                return queued;
+            }
+            video_gap = false;
+        }
+
+        if (queued + tp.packet->used > limit && !tp.config) {
+            if (tp.stream == TAP_VIDEO)
+                video_gap = true;
+            dropped++;
+            return queued;
+        }
+
+        queued += tp.packet->used;
+        queue.push_back(tp);
+        packet_ref(tp.packet);
+        now_queued = queued;
+    }
+    cv.notify_one();
+    return now_queued;
+}
+
+bool PacketTap::Next(TapPacket *out, uint32_t timeout_ms) {
+    std::unique_lock<std::mutex> guard(lock);
+    auto ready = [&] { return closed || !queue.empty(); };
+
+    if (timeout_ms == 0)
+        cv.wait(guard, ready);
+    else if (!cv.wait_for(guard, std::chrono::milliseconds(timeout_ms), ready))
+        return false;
+
+    if (queue.empty())
+        return false;
+
+    *out = queue.front();
+    queue.pop_front();
+    queued -= out->packet->used;
+    return true;
+}
+
+void PacketTap::Close(void) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+    }
+    cv.notify_all();
+}
+
+void PacketTap::Reset(void) {
+    Clear();
+    std::lock_guard<std::mutex> guard(lock);
+    video_gap = true;
+    closed = false;
+    dropped = 0;
+}
+
+Decoder::~Decoder(void) {
+    DataPacket* packet;
+    home->lock.lock();
+    home->decoder = NULL;
+    home->lock.unlock();
+
+    while ((packet = recieveQueue.next_item()) != NULL) {
+        account(packet->size, 0);
+        delete packet;
+        alloc_count --;
+    }
+    while ((packet = decodeQueue.next_item()) != NULL){
+        if (packet->refs.fetch_sub(1) == 1) {
+            account(packet->size, 0);
+            delete packet;
+            alloc_count --;
+        }
+    }
+
+    if (mem_used && counters) {
+        // Still held by taps, they release the global budget on the way out
+        counters->mem_used.fetch_sub(mem_used);
+    }
+    if (alloc_count)
+    ilog("~decoder alloc_count=%lu lent=%lld", alloc_count, (long long) lent.load());
+}
+
+// Free up to count packets from the pool
+void Decoder::trim(size_t count) {
+    DataPacket* packet;
+    size_t freed = 0;
+
+    while (count-- && (packet = recieveQueue.next_item()) != NULL) {
+        freed += packet->size;
+        account(packet->size, 0);
+        delete packet;
+        alloc_count --;
+    }
+
+    if (freed) {
+        dlog("@decoder trim: freed %llu KB, alloc_count=%lu", (unsigned long long) (freed >> 10), alloc_count);
+    }
+}
+
+bool Decoder::recover(void) {
+    const uint64_t now = os_gettime_ns();
+    if (now - error_time > ERROR_WINDOW_NS)
+        errors = 0;
+
+    error_time = now;
+    errors++;
+
+    if (errors <= MAX_FLUSHES && flush()) {
+        ilog("decoder: flushed, waiting for a keyframe (%d)", errors);
+        if (counters) counters->decoder_recoveries++;
+        return true;
+    }
+
+    if (errors <= MAX_FLUSHES + MAX_RESTARTS) {
+        std::lock_guard<std::mutex> lock(setup_lock);
+        if (restart()) {
+            ilog("decoder: restarted (%d)", errors);
+            if (counters) counters->decoder_restarts++;
+            return true;
+        }
+    }
+
+    elog("decoder: giving up after %d errors", errors);
+    return false;
+}
+
+DataPacket* Decoder::pull_empty_packet(size_t size) {
+    const uint64_t now = os_gettime_ns();
+    size_t available = recieveQueue.items.size();
+
+    if (available > 1 && packet_budget_exceeded()) {
+        // Keep one to reuse, give the rest back
+        trim(available - 1);
+    }
+    else if (now - trim_time >= POOL_IDLE_NS) {
+        // Packets that were never needed during the last window
+        if (low_water != SIZE_MAX && low_water > 0)
+            trim(low_water);
+
+        low_water = SIZE_MAX;
+        trim_time = now;
+    }
+
+    DataPacket* packet = recieveQueue.next_item();
+    if (!packet) {
+        packet = new DataPacket(size);
+        packet->home = home;
+        dlog("@decoder alloc: size=%ld", size);
+        alloc_count ++;
+        account(0, packet->size);
+    } else {
+        size_t old_size = packet->size;
+        packet->resize(size);
+        account(old_size, packet->size);
+    }
+
+    available = recieveQueue.items.size();
+    if (available < low_water)
+        low_water = available;
+
+    packet->used = 0;
+    packet->refs = 1;
+    return packet;
+}
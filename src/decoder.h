@@ -2,8 +2,15 @@
 #ifndef __DECODER_H__
 #define __DECODER_H__
 
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
 #include <vector>
 #include <mutex>
+#include <util/bmem.h>
+#include "stats.h"
 
 template<typename T>
 struct Queue {
@@ -28,13 +35,32 @@ struct Queue {
     }
 };
 
+struct Decoder;
+
+// Where a packet goes back to. Outlives the decoder while taps hold packets.
+struct PacketHome {
+    std::mutex lock;
+    Decoder *decoder;
+};
+
+// A received packet. Its contents don't change once it was read off the
+// socket, so packet taps can share it with the decoder instead of copying.
+// The one exception is ts_queued, stamped when the packet goes to the
+// decoder after taps may have it; taps don't read it.
+// It goes back to the decoder's pool when the last reference is gone.
 struct DataPacket {
     uint8_t *data;
     size_t size;
     size_t used;
     uint64_t pts;
+    std::atomic<int> refs;
+    std::shared_ptr<PacketHome> home;
+
+    // Pipeline timestamps (os_gettime_ns), for latency stats
+    uint64_t ts_header;
+    uint64_t ts_queued;
 
-    DataPacket(size_t new_size) {
+    DataPacket(size_t new_size) : refs(0) {
         size = 0;
         data = 0;
         resize(new_size);
@@ -52,56 +78,168 @@ struct DataPacket {
     }
 };
 
+// Extra reference for a packet tap, give it back with packet_unref()
+static inline const DataPacket* packet_ref(const DataPacket *packet) {
+    const_cast<DataPacket*>(packet)->refs++;
+    return packet;
+}
+
+void packet_unref(const DataPacket *packet);
+
+#define TAP_VIDEO (1 << 0)
+#define TAP_AUDIO (1 << 1)
+
+// One packet as seen by a tap. The tap owns a reference to the packet.
+struct TapPacket {
+    int stream;         // TAP_VIDEO or TAP_AUDIO
+    bool key;           // safe to start decoding at
+    bool config;        // audio: the packet is the AudioSpecificConfig
+    const char *codec;  // "h264", "mjpeg" or "aac"
+    const DataPacket *packet;
+};
+
+// A consumer of the packets a source receives, e.g. a recorder or a relay.
+// The receive threads hand it references instead of copies and never wait
+// on it: once more than limit bytes are queued, packets are dropped, video
+// up to the next keyframe. Register with the droidcam_tap_add proc handler.
+struct PacketTap {
+    PacketTap(int streams, size_t limit);
+    ~PacketTap(void);
+
+    // Wait for the next packet, timeout_ms 0 waits until there is one.
+    // Returns false on timeout or once closed and empty. Give the packet
+    // back with packet_unref() when done.
+    bool Next(TapPacket *out, uint32_t timeout_ms);
+
+    // Receive side, takes its own reference if the packet is kept.
+    // Returns the bytes queued after it.
+    size_t Push(const TapPacket &tp);
+
+    // No more packets, Next() returns what's left then false
+    void Close(void);
+    // Open again, dropping anything queued
+    void Reset(void);
+
+    inline uint64_t Dropped(void) { return dropped.load(); }
+
+    const int streams;
+    const size_t limit;
+
+private:
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<TapPacket> queue;
+    size_t queued;
+    bool video_gap;
+    bool closed;
+    std::atomic<uint64_t> dropped;
+
+    void Clear(void);
+};
+
+// Process-wide accounting of the memory held by DataPacket pools.
+// Going over the limit makes decoders drop frames and give memory back.
+void packet_budget_set_limit(size_t bytes);
+size_t packet_budget_limit(void);
+size_t packet_budget_used(void);
+size_t packet_budget_peak(void);
+bool packet_budget_exceeded(void);
+
+// Whether an Annex B H.264 access unit holds an IDR slice
+bool h264_is_keyframe(const uint8_t *data, size_t len);
+
+// Copy the SPS and PPS NAL units, start codes included, out of an access unit.
+// Returns the number of bytes copied, 0 if there are none or they don't fit.
+size_t h264_parameter_sets(const uint8_t *data, size_t len, uint8_t *out, size_t size);
+
+// Sample rate and channel count from the 2 byte AAC AudioSpecificConfig
+bool aac_config_parse(const uint8_t *config, int *sample_rate, int *channels);
+
 struct Decoder {
     Queue<DataPacket*> recieveQueue;
     Queue<DataPacket*> decodeQueue;
+    std::shared_ptr<PacketHome> home;
+    std::atomic<int64_t> lent;  // done with here, but still held by taps
     size_t alloc_count;
+    size_t mem_used;
     volatile bool ready;
     volatile bool failed;
-
-    Decoder(void) {
+    // Held while the codec is set up, by the receive thread on the first
+    // packet and by the decode thread around restart()
+    std::mutex setup_lock;
+    SourceCounters* counters;
+
+    // Free packets that sat unused, tracked over POOL_IDLE_NS windows
+    uint64_t trim_time;
+    size_t low_water;
+
+    // Recent decode errors, see recover()
+    uint64_t error_time;
+    int errors;
+
+    Decoder(void) : home(std::make_shared<PacketHome>()) {
+        home->decoder = this;
+        lent = 0;
         alloc_count = 0;
+        mem_used = 0;
+        counters = NULL;
         ready = false;
         failed = false;
+        trim_time = 0;
+        low_water = SIZE_MAX;
+        error_time = 0;
+        errors = 0;
     }
 
-    virtual ~Decoder(void) {
-        DataPacket* packet;
-        while ((packet = recieveQueue.next_item()) != NULL) {
-            delete packet;
-            alloc_count --;
-        }
-        while ((packet = decodeQueue.next_item()) != NULL){
-            delete packet;
-            alloc_count --;
-        }
-        if (alloc_count)
-        ilog("~decoder alloc_count=%lu", alloc_count);
-    }
+    virtual ~Decoder(void);
 
     inline DataPacket* pull_ready_packet(void) {
         return decodeQueue.next_item();
     }
 
-    DataPacket* pull_empty_packet(size_t size) {
-        DataPacket* packet = recieveQueue.next_item();
-        if (!packet) {
-            packet = new DataPacket(size);
-            dlog("@decoder alloc: size=%ld", size);
-            alloc_count ++;
-        } else {
-            packet->resize(size);
-        }
-        packet->used = 0;
-        return packet;
+    DataPacket* pull_empty_packet(size_t size);
+    void trim(size_t count);
+    void account(size_t old_size, size_t new_size);
+
+    // Over the memory budget with nothing left to reuse
+    inline bool over_budget(void) {
+        return recieveQueue.items.size() == 0 && packet_budget_exceeded();
     }
 
+    // Called after frames were dropped, decoders that depend on previous
+    // frames should wait for the next keyframe
+    virtual void skip_to_keyframe(void) {}
+
+    // Called by the decode thread after decode_video() failed.
+    // Flushes and carries on from the next keyframe, starts the decoder over
+    // when errors keep coming, and returns false once that didn't help either.
+    bool recover(void);
+
+    // Drop decoder state and wait for a keyframe
+    virtual bool flush(void) { return false; }
+    // Tear down and set up the decoder again, on the decode thread with
+    // setup_lock held. `ready` has to stay set throughout, the receive
+    // thread would take a decoder that isn't ready for a new one.
+    virtual bool restart(void) { return false; }
+
+    // Drop the pipeline's reference, the packet is reused once taps are done with it too
     inline void push_empty_packet(DataPacket* packet) {
-        recieveQueue.add_item(packet);
+        lent++;
+        if (packet->refs.fetch_sub(1) == 1) {
+            lent--;
+            recieveQueue.add_item(packet);
+        }
+    }
+
+    // All packets are back, or only held by taps
+    inline bool idle(void) {
+        return (int64_t) recieveQueue.items.size() + lent >= (int64_t) alloc_count;
     }
 
     virtual void push_ready_packet(DataPacket*) = 0;
     virtual bool decode_video(struct obs_source_frame2*, DataPacket*, bool *got_output) = 0;
+    // Call again with a NULL packet until got_output is false,
+    // one packet can hold more than one frame
     virtual bool decode_audio(struct obs_source_audio*, DataPacket*, bool *got_output) = 0;
 };
 
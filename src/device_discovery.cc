@@ -29,6 +29,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "command.h"
 #include "device_discovery.h"
 #include "plugin_properties.h"
+#include "usbmux.h"
 
 bool process_check_success(process_t proc, const char *name) {
     if (proc == PROCESS_NONE) {
@@ -90,12 +91,82 @@ process_print_error(enum process_result err, const char *const argv[]) {
     }
 }
 
+#define MAX_LOOKUPS 16
+#define MAX_MODELS 64
+
+struct model_entry {
+    std::string model;
+    uint64_t used;
+};
+
+// Wireless ADB serials change port on every pairing,
+// the least recently used names make room for new ones
+static std::mutex models_lock;
+static std::unordered_map<std::string, model_entry> models;
+static uint64_t models_used;
+static uint64_t models_seq;
+
+bool device_model_get(const char* serial, char* model, size_t size) {
+    std::lock_guard<std::mutex> lock(models_lock);
+    auto it = models.find(serial);
+    if (it == models.end())
+        return false;
+
+    it->second.used = ++models_used;
+    snprintf(model, size, "%s", it->second.model.c_str());
+    return true;
+}
+
+void device_model_put(const char* serial, const char* model) {
+    if (serial[0] == 0 || model[0] == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(models_lock);
+    auto it = models.find(serial);
+    if (it == models.end() && models.size() >= MAX_MODELS) {
+        auto oldest = models.begin();
+        for (auto i = models.begin(); i != models.end(); i++)
+            if (i->second.used < oldest->second.used) oldest = i;
+        models.erase(oldest);
+    }
+
+    model_entry &entry = models[serial];
+    entry.used = ++models_used;
+    if (entry.model != model) {
+        entry.model = model;
+        models_seq++;
+    }
+}
+
+uint64_t device_models(DeviceModels &out) {
+    std::lock_guard<std::mutex> lock(models_lock);
+    out.clear();
+    for (auto &it : models)
+        out.emplace_back(it.first, it.second.model);
+    return models_seq;
+}
+
 void *reload_thread(void *data) {
-    ((DeviceDiscovery*) data) -> Clear();
-    ((DeviceDiscovery*) data) -> DoReload();
+    DeviceDiscovery *discovery = (DeviceDiscovery*) data;
+    discovery->Prepare();
+    discovery->Rebuild();
     return 0;
 }
 
+// Build and publish a new generation.
+// Also called directly by the mDNS browser when its cache changes.
+void DeviceDiscovery::Rebuild(void) {
+    std::lock_guard<std::mutex> lock(update_lock);
+    pending = std::make_shared<DeviceList>();
+    DoReload();
+
+    for (const DeviceRef &dev : pending->devices)
+        if (dev->model[0] == 0)
+            device_model_get(dev->serial, dev->model, sizeof(Device::model));
+
+    Publish();
+}
+
 void DeviceDiscovery::Reload(void) {
     join();
 
@@ -107,56 +178,176 @@ void DeviceDiscovery::Reload(void) {
     rthr = 1;
 }
 
-void DeviceDiscovery::Clear(void) {
-    for (int i = 0; i < DEVICES_LIMIT; i++) {
-        if(deviceList[i]) delete deviceList[i];
-        deviceList[i] = NULL;
-    }
+void DeviceDiscovery::Publish(void) {
+    if (!pending)
+        return;
+
+    pending->generation = ++generation;
+    std::atomic_store(&devices, DeviceListRef(pending));
+    dlog("device list generation %llu: %lu devices",
+        (unsigned long long) pending->generation, pending->devices.size());
+    pending.reset();
 }
 
-Device* DeviceDiscovery::NextDevice(void) {
-    if (iter < DEVICES_LIMIT && deviceList[iter]) {
-        Device* dev = deviceList[iter++];
-        return dev;
+struct ModelLookup {
+    DeviceDiscovery *discovery;
+    DeviceRef dev;
+    pthread_t thr;
+    std::atomic<bool> done;
+};
+
+void *model_thread(void *data) {
+    ModelLookup *lookup = (ModelLookup*) data;
+    DeviceDiscovery *discovery = lookup->discovery;
+    const char *serial = lookup->dev->serial;
+    char model[sizeof(Device::model)] = {0};
+
+    if (discovery->LookupModel(lookup->dev.get(), model, sizeof(model))) {
+        dlog("model: %s", model);
+        device_model_put(serial, model);
+        discovery->SetModel(serial, model);
+        if (discovery->models_changed)
+            discovery->models_changed(discovery->models_data);
     }
 
+    lookup->done = true;
     return 0;
 }
 
-Device* DeviceDiscovery::GetDevice(const char* serial, size_t length) {
-    for (int i = 0; i < DEVICES_LIMIT; i++) {
-        if (deviceList[i] == NULL)
+// Called with lookup_lock held
+void DeviceDiscovery::ReapModels(bool wait) {
+    for (auto it = lookups.begin(); it != lookups.end();) {
+        ModelLookup *lookup = *it;
+        if (!wait && !lookup->done) {
+            ++it;
+            continue;
+        }
+
+        pthread_join(lookup->thr, NULL);
+        delete lookup;
+        it = lookups.erase(it);
+    }
+}
+
+void DeviceDiscovery::ResolveModels(void) {
+    DeviceListRef list = Devices();
+    std::lock_guard<std::mutex> lock(lookup_lock);
+    ReapModels(false);
+
+    for (const DeviceRef &dev : list->devices) {
+        if (dev->model[0] != 0)
+            continue;
+
+        if (lookups.size() >= MAX_LOOKUPS)
             break;
 
-        if (strncmp(deviceList[i]->serial, serial, length) == 0) {
-            iter = i;
-            return deviceList[i];
+        bool busy = false;
+        for (ModelLookup *lookup : lookups)
+            if (strcmp(lookup->dev->serial, dev->serial) == 0) { busy = true; break; }
+
+        if (busy)
+            continue;
+
+        ModelLookup *lookup = new ModelLookup;
+        lookup->discovery = this;
+        lookup->dev = dev;
+        lookup->done = false;
+        if (pthread_create(&lookup->thr, NULL, model_thread, lookup) != 0) {
+            elog("Error creating model lookup thread");
+            delete lookup;
+            break;
         }
+        lookups.push_back(lookup);
     }
-    return NULL;
+}
+
+void DeviceDiscovery::WaitModels(void) {
+    std::lock_guard<std::mutex> lock(lookup_lock);
+    ReapModels(true);
+}
+
+// Copy on write, readers keep the device they already have
+void DeviceDiscovery::SetModel(const char* serial, const char* model) {
+    std::lock_guard<std::mutex> lock(update_lock);
+    DeviceListRef list = Devices();
+    DeviceRef dev = list->Find(serial, sizeof(Device::serial));
+    if (!dev || strcmp(dev->model, model) == 0)
+        return;
+
+    DeviceRef copy = std::make_shared<Device>(*dev);
+    snprintf(copy->model, sizeof(Device::model), "%s", model);
+
+    pending = std::make_shared<DeviceList>(*list);
+    pending->devices[dev->index] = copy;
+    Publish();
 }
 
 Device* DeviceDiscovery::AddDevice(const char* serial, size_t length) {
-    if (GetDevice(serial, length)) {
-        elog("warn: duplicate device");
+    if (!pending) {
+        elog("warn: AddDevice outside of reload");
         return NULL;
     }
 
-    for (int i = 0; i < DEVICES_LIMIT; i++) {
-        if (deviceList[i] == NULL) {
-            deviceList[i] = new Device();
-            memcpy(deviceList[i]->serial, serial, length);
-            return deviceList[i];
-        }
+    return pending->Add(serial, length);
+}
+
+Device* DeviceDiscovery::PendingDevice(const char* serial, size_t length) {
+    if (!pending)
+        return NULL;
+
+    return pending->Find(serial, length).get();
+}
+
+DeviceRef DeviceList::Find(const char* serial, size_t length) const {
+    auto it = index.find(serial_hash(serial, length));
+    if (it == index.end())
+        return NULL;
+
+    DeviceRef dev = devices[it->second];
+    if (strncmp(dev->serial, serial, length) != 0)
+        return NULL;
+
+    return dev;
+}
+
+Device* DeviceList::Add(const char* serial, size_t length) {
+    if (length > sizeof(Device::serial) - 1)
+        length = sizeof(Device::serial) - 1;
+
+    uint64_t hash = serial_hash(serial, length);
+    if (index.find(hash) != index.end()) {
+        elog("warn: duplicate device");
+        return NULL;
     }
 
-    elog("warn: device list full");
-    return NULL;
+    DeviceRef dev = std::make_shared<Device>();
+    memcpy(dev->serial, serial, strnlen(serial, length));
+    dev->index = (int) devices.size();
+
+    index[hash] = devices.size();
+    devices.push_back(dev);
+    return dev.get();
 }
 
 // adb commands
 static const char *adb_exe = NULL;
 
+// The adb server keeps forwards until it restarts or the device goes away,
+// for every source and across OBS restarts. One `forward --list` seeds the
+// table, after that it only changes through here, and reconnecting over a
+// forward we already have doesn't run adb at all.
+#define FORWARD_TRIES 10
+
+struct adb_forward {
+    char serial[sizeof(Device::serial)];
+    int local_port;
+    int remote_port;
+};
+
+static std::mutex forwards_lock;
+static std::vector<adb_forward> forwards;
+static bool forwards_listed;
+
 process_t
 adb_execute(const char *serial, const char *const adb_cmd[], size_t len, char *output, size_t out_size) {
     const char *cmd[32];
@@ -257,6 +448,8 @@ AdbMgr::AdbMgr() {
 }
 
 AdbMgr::~AdbMgr() {
+    // Lookups call back into this object
+    WaitModels();
 
 #ifndef TEST
     if (adb_exe_local)
@@ -292,6 +485,7 @@ void AdbMgr::DoReload(void) {
 
     size_t len;
     char *n, *sep;
+    bool complete = true;
     char *p = strtok_r(buf, "\n", &n);
     do {
         dlog("adb> %s", p);
@@ -314,7 +508,10 @@ void AdbMgr::DoReload(void) {
         sep = strchr(p, ' ');
         if (!sep) {
             sep = strchr(p, '\t');
-            if (!sep) break;
+            if (!sep) {
+                complete = false;
+                break;
+            }
         }
         len = sep - p;
         if (len <= 0) continue;
@@ -323,6 +520,7 @@ void AdbMgr::DoReload(void) {
 
         Device *dev = AddDevice(p, len);
         if (!dev) {
+            complete = false;
             break;
         }
 
@@ -340,25 +538,45 @@ void AdbMgr::DoReload(void) {
         memcpy(dev->state, p, len);
 
     } while ((p = strtok_r(NULL, "\n", &n)) != NULL);
-    return;
+
+    // adb drops the forwards of devices that went away,
+    // those we didn't get to in the list may still be there
+    if (!complete)
+        return;
+
+    std::lock_guard<std::mutex> lock(forwards_lock);
+    for (auto it = forwards.begin(); it != forwards.end();) {
+        if (PendingDevice(it->serial, sizeof(it->serial))) {
+            ++it;
+            continue;
+        }
+
+        dlog("adb fwd: %s is gone", it->serial);
+        it = forwards.erase(it);
+    }
 }
 
-void AdbMgr::GetModel(Device *dev) {
+bool AdbMgr::LookupModel(const Device *dev, char *model, size_t size) {
     char buf[1024] = {0};
     process_t proc;
+
+    if (disabled || DeviceOffline(dev))
+        return false;
+
     const char *ro[] = {"shell", "getprop", "ro.product.model"};
     proc = adb_execute(dev->serial, ro, ARRAY_LEN(ro), buf, sizeof(buf));
-    if (process_check_success(proc, "adb get model")) {
-        char *p = buf;
-        char *end = buf + sizeof(Device::model) - strlen(suffix) - 6 - 8;
-        while (p < end && (isalnum(*p) || *p == ' ' || *p == '-' || *p == '_')) p++;
-        snprintf(dev->model, sizeof(Device::model), "%.*s [%s] (%.*s)",
-            (int) (p - buf), buf, suffix, (int) sizeof(Device::serial)/2, dev->serial);
-        dlog("model: %s", dev->model);
-    }
+    if (!process_check_success(proc, "adb get model"))
+        return false;
+
+    char *p = buf;
+    char *end = buf + size - strlen(suffix) - 6 - 8;
+    while (p < end && (isalnum(*p) || *p == ' ' || *p == '-' || *p == '_')) p++;
+    snprintf(model, size, "%.*s [%s] (%.*s)",
+        (int) (p - buf), buf, suffix, (int) sizeof(Device::serial)/2, dev->serial);
+    return true;
 }
 
-bool AdbMgr::AddForward(Device *dev, int local_port, int remote_port) {
+bool AdbMgr::AddForward(const Device *dev, int local_port, int remote_port) {
     char local[32];
     char remote[32];
 
@@ -368,21 +586,106 @@ bool AdbMgr::AddForward(Device *dev, int local_port, int remote_port) {
     snprintf(local, 32, "tcp:%d", local_port);
     snprintf(remote, 32, "tcp:%d", remote_port);
 
+    // Fail rather than take over a port some other device has
     const char *serial = dev->serial;
-    const char *const cmd[] = {"forward", local, remote};
+    const char *const cmd[] = {"forward", "--no-rebind", local, remote};
     process_t proc = adb_execute(serial, cmd, ARRAY_LEN(cmd), NULL, 0);
     return process_check_success(proc, "adb fwd");
 }
 
-void AdbMgr::ClearForwards(Device *dev) {
+// Called with forwards_lock held
+static void forwards_list(void) {
+    char buf[4096] = {0};
+    const char *cmd[] = {"forward", "--list"};
+    process_t proc = adb_execute(NULL, cmd, ARRAY_LEN(cmd), buf, sizeof(buf));
+    if (!process_check_success(proc, "adb fwd list"))
+        return;
+
+    forwards.clear();
+    char *n;
+    for (char *p = strtok_r(buf, "\r\n", &n); p; p = strtok_r(NULL, "\r\n", &n)) {
+        // eg. 00a3a5185d8ac3b1 tcp:4747 tcp:4747
+        adb_forward fwd;
+        if (sscanf(p, "%79s tcp:%d tcp:%d", fwd.serial, &fwd.local_port, &fwd.remote_port) != 3)
+            continue;
+
+        dlog("adb fwd: %s %d -> %d", fwd.serial, fwd.local_port, fwd.remote_port);
+        forwards.push_back(fwd);
+    }
+    forwards_listed = true;
+}
+
+int AdbMgr::Forward(const Device *dev, int remote_port) {
+    if (disabled) // adb.exe was not found
+        return 0;
+
+    std::lock_guard<std::mutex> lock(forwards_lock);
+    if (!forwards_listed)
+        forwards_list();
+
+    for (const adb_forward &fwd : forwards)
+        if (fwd.remote_port == remote_port && strcmp(fwd.serial, dev->serial) == 0)
+            return fwd.local_port;
+
+    // Lowest port no other device has, skipping ones the system refuses
+    int tries = 0;
+    for (int port = remote_port; port < 65536 && tries < FORWARD_TRIES; port++) {
+        bool taken = false;
+        for (const adb_forward &fwd : forwards)
+            if (fwd.local_port == port) { taken = true; break; }
+
+        if (taken)
+            continue;
+
+        tries++;
+        dlog("ADB: mapping %d -> %d", port, remote_port);
+        if (AddForward(dev, port, remote_port)) {
+            adb_forward fwd;
+            snprintf(fwd.serial, sizeof(fwd.serial), "%s", dev->serial);
+            fwd.local_port = port;
+            fwd.remote_port = remote_port;
+            forwards.push_back(fwd);
+            return port;
+        }
+    }
+
+    elog("adb fwd: no local port for %s", dev->serial);
+    return 0;
+}
+
+bool AdbMgr::Forwarded(const char *serial, int local_port, int remote_port) {
+    if (disabled) // adb.exe was not found
+        return false;
+
+    std::lock_guard<std::mutex> lock(forwards_lock);
+    if (!forwards_listed)
+        forwards_list();
+
+    for (const adb_forward &fwd : forwards)
+        if (fwd.local_port == local_port)
+            return fwd.remote_port == remote_port && strcmp(fwd.serial, serial) == 0;
+
+    return false;
+}
+
+void AdbMgr::RemoveForward(const Device *dev, int local_port) {
+    char local[32];
+
     if (disabled) // adb.exe was not found
         return;
 
-    const char *serial = dev->serial;
-    const char *const cmd[] = {"forward", "--remove-all"};
-    process_t proc = adb_execute(serial, cmd, ARRAY_LEN(cmd), NULL, 0);
-    process_check_success(proc, "adb fwd clear");
-    return;
+    std::lock_guard<std::mutex> lock(forwards_lock);
+    for (auto it = forwards.begin(); it != forwards.end(); ++it) {
+        if (it->local_port == local_port) {
+            forwards.erase(it);
+            break;
+        }
+    }
+
+    snprintf(local, 32, "tcp:%d", local_port);
+    const char *const cmd[] = {"forward", "--remove", local};
+    process_t proc = adb_execute(dev->serial, cmd, ARRAY_LEN(cmd), NULL, 0);
+    process_check_success(proc, "adb fwd remove");
 }
 
 // MARK: USBMUX
@@ -390,7 +693,9 @@ void AdbMgr::ClearForwards(Device *dev) {
 USBMux::USBMux() : iproxy(this) {
     hModuleUsbmux = NULL;
     hModuleIDevice = NULL;
-    usbmuxd_device_list = NULL;
+#ifndef __APPLE__
+    listener = NULL;
+#endif
 
 #ifdef TEST
 #elif defined(_WIN32)
@@ -425,10 +730,6 @@ USBMux::USBMux() : iproxy(this) {
     lockdownd_get_device_name = (lockdownd_get_device_name_t) GetProcAddress(hModuleIDevice, "lockdownd_get_device_name");
 
     usbmuxd_set_debug_level  = (libusbmuxd_set_debug_level_t) GetProcAddress(hModuleUsbmux, "libusbmuxd_set_debug_level");
-    usbmuxd_get_device_list  = (usbmuxd_get_device_list_t   ) GetProcAddress(hModuleUsbmux, "usbmuxd_get_device_list");
-    usbmuxd_device_list_free = (usbmuxd_device_list_free_t  ) GetProcAddress(hModuleUsbmux, "usbmuxd_device_list_free");
-    usbmuxd_connect          = (usbmuxd_connect_t           ) GetProcAddress(hModuleUsbmux, "usbmuxd_connect");
-    usbmuxd_disconnect       = (usbmuxd_disconnect_t        ) GetProcAddress(hModuleUsbmux, "usbmuxd_disconnect");
 
     #ifdef DEBUG
     usbmuxd_set_debug_level(9);
@@ -484,14 +785,20 @@ USBMux::USBMux() : iproxy(this) {
 }
 
 USBMux::~USBMux() {
+    Cancel();
 #ifdef __APPLE__
+    WaitReload();
     delete mdns;
 
 #else // _WIN32 || _Linux
 
-    if (usbmuxd_device_list) {
-        usbmuxd_device_list_free(&usbmuxd_device_list);
-    }
+    // The reload thread may still be in Prepare(), and the listener
+    // calls back into Rebuild() and starts lookups, all have to be done first
+    WaitReload();
+    if (listener)
+        listener->Stop();
+    WaitModels();
+    delete listener;
 
 #ifdef TEST
 #elif defined(_WIN32)
@@ -522,19 +829,20 @@ USBMux::~USBMux() {
 #endif // __APPLE__
 }
 
-void USBMux::GetModel(Device* dev) {
+bool USBMux::LookupModel(const Device* dev, char* model, size_t size) {
 #ifdef __APPLE__
-    return;
+    // Names come with the mDNS records
+    return false;
 
 #else // _WIN32 || _Linux
     if (!hModuleUsbmux)
-        return;
+        return false;
 
     idevice_t device = NULL;
-    char *udid = dev->serial;
+    const char *udid = dev->serial;
     if (idevice_new(&device, udid) != IDEVICE_E_SUCCESS) {
         elog("Unable to get idevice_t for %s", udid);
-        return;
+        return false;
     }
 
     lockdownd_client_t lockdown = NULL;
@@ -542,115 +850,144 @@ void USBMux::GetModel(Device* dev) {
     if (lerr != LOCKDOWN_E_SUCCESS) {
         idevice_free(device);
         elog("Could not connect lockdown, error code %d\n", lerr);
-        return;
+        return false;
     }
 
     char* name = NULL;
+    bool found = false;
     lerr = lockdownd_get_device_name(lockdown, &name);
     if (name) {
         // XXX: skip the serial with iPhones
         #if 0
-        int max = (int)(sizeof(Device::model) - strlen(suffix) - 6 - 8);
-        snprintf(dev->model, sizeof(Device::model), "%.*s [%s] (%.*s)",
+        int max = (int)(size - strlen(suffix) - 6 - 8);
+        snprintf(model, size, "%.*s [%s] (%.*s)",
             max, name, suffix, (int) sizeof(Device::serial)/2, dev->serial);
         #else
-        int max = (int)(sizeof(Device::model) - strlen(suffix) - 4);
-        snprintf(dev->model, sizeof(Device::model), "%.*s [%s]",
+        int max = (int)(size - strlen(suffix) - 4);
+        snprintf(model, size, "%.*s [%s]",
             max, name, suffix);
         #endif
         free(name);
+        found = true;
     }
     else {
         elog("Could not get device name, lockdown error %d\n", lerr);
     }
     lockdownd_client_free(lockdown);
     idevice_free(device);
+    return found;
 #endif // __APPLE__
 }
 
+static void usbmux_changed(void *data) {
+    ((USBMux*) data)->Changed();
+}
+
+// Show the change right away and look up the name of a phone that just came
+void USBMux::Changed(void) {
+    Rebuild();
+    if (cancelled)
+        return;
+
+    ResolveModels();
+    if (models_changed)
+        models_changed(models_data);
+}
+
+void USBMux::Prepare(void) {
+#ifndef __APPLE__
+    if (!listener) {
+        UsbmuxListener *l = new UsbmuxListener(usbmux_changed, this);
+        l->Start();
+
+        std::lock_guard<std::mutex> lock(listener_lock);
+        listener = l;
+    }
+
+    // Right after starting, give the daemon a moment to list what's attached
+    if (!listener->WaitReady(1500, &cancelled) && !cancelled)
+        elog("Could not get iOS device list, is usbmuxd running?");
+#endif
+}
+
+void USBMux::Wake(void) {
+#ifdef __APPLE__
+    mdns->Cancel();
+#else
+    std::lock_guard<std::mutex> lock(listener_lock);
+    if (listener)
+        listener->Wake();
+#endif
+}
+
 void USBMux::DoReload(void) {
 #ifdef __APPLE__
     reload_thread(mdns);
 
     int i = 0;
-    Device *idev;
-    mdns->ResetIter();
-    while ((idev = mdns->NextDevice()) != NULL) {
+    DeviceListRef list = mdns->Devices();
+    for (auto idev : list->devices) {
         // Edit the serial to avoid clashes with the same device
         // being available over the default (wifi) interface
+        char serial[sizeof(Device::serial)];
         const char* text = "_usb";
         const size_t max = sizeof(Device::serial) - strlen(text) - 2;
-        idev->serial[max] = 0;
-        strcat(idev->serial, text);
+        memcpy(serial, idev->serial, sizeof(Device::serial));
+        serial[max] = 0;
+        strcat(serial, text);
 
         // Add device to the local (USBMux) list
-        Device *dev = AddDevice(idev->serial, sizeof(Device::serial));
+        Device *dev = AddDevice(serial, sizeof(Device::serial));
         if (!dev) {
             break;
         }
 
         memcpy(dev->model, idev->model, sizeof(Device::model));
         memcpy(dev->address, idev->address, sizeof(Device::address));
+        dev->port = idev->port;
+        i++;
     }
 
     ilog("Apple USB: found %d devices", i);
     return;
 
 #else // _WIN32 || _Linux
-    if (!hModuleUsbmux)
+    if (!listener)
         return;
 
-    if (usbmuxd_device_list)
-        usbmuxd_device_list_free(&usbmuxd_device_list);
-
-    int deviceCount = usbmuxd_get_device_list(&usbmuxd_device_list);
-    ilog("USBMux: found %d devices", deviceCount);
+    std::vector<UsbmuxDevice> list = listener->Devices();
+    ilog("USBMux: found %d devices", (int) list.size());
 
-    if (deviceCount < 0) {
-        elog("Could not get iOS device list, is usbmuxd running?");
-        return;
-    }
-
-    for (int i = 0; i < deviceCount; i++) {
-        usbmuxd_device_info_t *idev = &usbmuxd_device_list[i];
-        if (idev == NULL || idev->handle == 0) {
-            continue;
-        }
-
-        assert(sizeof(usbmuxd_device_info_t::udid) < sizeof(Device::serial));
-        Device *dev = AddDevice(idev->udid, sizeof(usbmuxd_device_info_t::udid));
+    for (auto &idev : list) {
+        assert(sizeof(UsbmuxDevice::udid) < sizeof(Device::serial));
+        Device *dev = AddDevice(idev.udid, sizeof(UsbmuxDevice::udid));
         if (!dev) {
             break;
         }
 
-        dev->handle = (int) idev->handle;
+        dev->handle = idev.id;
     }
 
 #endif // __APPLE__
 }
 
-socket_t USBMux::Connect(Device* dev, int port, int* iproxy_port) {
+socket_t USBMux::Connect(DeviceRef dev, int port, int* iproxy_port, const struct net_cancel *cancel) {
     dlog("USBMUX Connect: handle=%d, port=%d", dev->handle, port);
 
 #ifdef __APPLE__
-    return net_connect(dev->address, port);
+    return net_connect(dev->address, NULL, dev->port ? dev->port : port, cancel);
 
 #else
-    if (!hModuleUsbmux)
+    socket_t sock = usbmux_connect(dev->handle, (uint16_t) port, cancel);
+    if (sock == INVALID_SOCKET)
         return INVALID_SOCKET;
 
-    int rc = usbmuxd_connect((uint32_t) dev->handle, (short) port);
-    if (rc <= 0) {
-        elog("usbmuxd_connect failed: %d", rc);
-        return INVALID_SOCKET;
-    }
-
-    set_nonblock(rc, 0);
-    set_recv_timeout(rc, 5);
+    set_nonblock(sock, 0);
+    set_recv_timeout(sock, 5);
 
     *iproxy_port = iproxy.Start(dev, port);
 
-    return rc;
+    return sock;
 
 #endif // __APPLE__
 }
@@ -1,12 +1,12 @@
 // Copyright (C) 2021 DEV47APPS, github.com/dev47apps
 #pragma once
 #include <util/threading.h>
-
-#ifdef TEST
-#define DEVICES_LIMIT 8
-#else
-#define DEVICES_LIMIT 32
-#endif
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
 
 struct Device {
     char serial[80];
@@ -14,8 +14,12 @@ struct Device {
     char state[32];
     char address[64];
     int handle;
+    int index;
+    int port;
     Device(){
         handle = 0;
+        index = 0;
+        port = 0;
         memset(state, 0, sizeof(state));
         memset(model, 0, sizeof(model));
         memset(serial, 0, sizeof(serial));
@@ -24,18 +28,78 @@ struct Device {
     ~Device(){}
 };
 
+typedef std::shared_ptr<Device> DeviceRef;
+
+// FNV-1a over the serial, up to the first NUL or `length` bytes
+static inline uint64_t serial_hash(const char* serial, size_t length) {
+    uint64_t hash = UINT64_C(14695981039346656037);
+    for (size_t i = 0; i < length && serial[i]; i++) {
+        hash ^= (uint8_t) serial[i];
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+// An immutable device list snapshot.
+// Readers grab a reference via DeviceDiscovery::Devices() and can keep using it
+// (and any Device in it) while a reload publishes a newer generation.
+struct DeviceList {
+    uint64_t generation;
+    std::vector<DeviceRef> devices;
+    std::unordered_map<uint64_t, size_t> index;
+
+    DeviceList() : generation(0) {}
+    DeviceRef Find(const char* serial, size_t length) const;
+    Device* Add(const char* serial, size_t length);
+};
+
+typedef std::shared_ptr<const DeviceList> DeviceListRef;
+
+// Device labels by serial, shared by all managers and kept across reloads.
+// model_cache.cc saves them in config.json so they survive restarts too.
+bool device_model_get(const char* serial, char* model, size_t size);
+void device_model_put(const char* serial, const char* model);
+
+// Copy of the labels, returns a counter that moves on every change
+typedef std::vector<std::pair<std::string, std::string>> DeviceModels;
+uint64_t device_models(DeviceModels &out);
+
+struct ModelLookup;
+
 class DeviceDiscovery {
 protected:
-    int iter;
     const char* suffix = "";
-    Device* deviceList[DEVICES_LIMIT];
     virtual void DoReload(void) = 0;
 
+    // Runs on the reload thread before the update lock is taken,
+    // for slow work that does not touch the pending list
+    virtual void Prepare(void) {}
+
+    // Ask the device for its label, runs on a lookup thread
+    virtual bool LookupModel(const Device* dev, char* model, size_t size) {
+        return false;
+    }
+
+    // Set by Cancel(), waits in Prepare() check it along with what they wait for
+    std::atomic<bool> cancelled;
+
+    // Wake up a wait in Prepare() after cancelled was set
+    virtual void Wake(void) {}
+
 private:
     int rthr;
     pthread_t pthr;
+    std::mutex update_lock;
+    std::atomic<uint64_t> generation;
+    DeviceListRef devices;
+    std::shared_ptr<DeviceList> pending;
     friend void *reload_thread(void *data);
 
+    std::mutex lookup_lock;
+    std::vector<ModelLookup*> lookups;
+    friend void *model_thread(void *data);
+    void ReapModels(bool wait);
+
     inline void join(void) {
         if (rthr) {
             pthread_join(pthr, NULL);
@@ -44,54 +108,114 @@ private:
     }
 
 public:
-    inline int Iter(void) { return iter; }
-    void ResetIter(void) {
-        join();
-        iter = 0;
-    }
+    inline void WaitReload(void) { join(); }
 
-    DeviceDiscovery() {
-        for (int i = 0; i < DEVICES_LIMIT; i++) {
-            deviceList[i] = NULL;
-        }
-        iter = 0;
+    DeviceDiscovery() : cancelled(false), generation(0), devices(std::make_shared<DeviceList>()) {
         rthr = 0;
     };
 
     virtual ~DeviceDiscovery() {
         join();
-        Clear();
+        WaitModels();
     };
 
     void Reload(void);
-    void Clear(void);
-    Device* NextDevice(void);
+    void Rebuild(void);
+    void Publish(void);
+
+    // The owner is going away: a reload still runs, but no longer waits
+    // for devices to show up, so WaitReload() and the destructor return quickly
+    inline void Cancel(void) {
+        cancelled = true;
+        Wake();
+    }
+
+    // Look up the labels of unnamed devices in the background, one thread
+    // each, and publish a new generation as each one comes in.
+    // models_changed() is called from the lookup thread after that.
+    void ResolveModels(void);
+    void WaitModels(void);
+    void SetModel(const char* serial, const char* model);
+    void (*models_changed)(void *data) = NULL;
+    void *models_data = NULL;
+
+    // Blocking lookup straight into dev, for the tests
+    inline void GetModel(Device* dev) {
+        if (LookupModel(dev, dev->model, sizeof(Device::model)))
+            device_model_put(dev->serial, dev->model);
+    }
+
+    inline DeviceListRef Devices(void) {
+        return std::atomic_load(&devices);
+    }
+
+    inline DeviceRef GetDevice(const char* serial, size_t length = sizeof(Device::serial)) {
+        return Devices()->Find(serial, length);
+    }
+
+    // Build the next generation, only valid from within DoReload()
     Device* AddDevice(const char* serial, size_t length);
-    Device* GetDevice(const char* serial, size_t length = sizeof(Device::serial));
+    Device* PendingDevice(const char* serial, size_t length);
 };
 
+#ifdef TEST
+// A bad network for the test relay, changed from the test thread while
+// connections run. Each direction is a link with its own latency and rate:
+// chunks keep their order, jitter only spreads them out. A stall holds all
+// traffic until it ends; a reset cuts every connection with an RST.
+struct Impairment {
+    std::atomic<int> latency_ms;
+    std::atomic<int> jitter_ms;
+    std::atomic<int> rate_kbps;           // 0 for no limit
+    std::atomic<uint64_t> stall_until;    // ns
+    std::atomic<int> resets;              // bumped by Reset()
+    std::atomic<uint32_t> seed;           // jitter is repeatable for a seed
+
+    Impairment() : latency_ms(0), jitter_ms(0), rate_kbps(0),
+        stall_until(0), resets(0), seed(47) {}
+
+    void Stall(int ms);
+    void Reset(void);
+
+    // Apply "latency=80 jitter=20 rate=4000 stall=500 reset seed=1",
+    // any subset in any order. False on a key it doesn't know.
+    bool Set(const char* script);
+};
+#endif
+
 struct Proxy {
     DeviceDiscovery* discovery_mgr;
-    volatile Device *proxy_device;
+    DeviceRef proxy_device;
     volatile socket_t proxy_sock;
+#ifdef TEST
+    Impairment* impair;     // NULL for a clean link
+    char remote_host[64];   // plain TCP to a mock phone instead of usbmux
+#endif
 
     int port_local;
     int port_remote;
     int thread_active;
+    struct net_cancel cancel;   // wakes the relay thread to stop
 
     pthread_t pthr;
     friend void *proxy_run(void *data);
 
     Proxy(DeviceDiscovery*);
     ~Proxy();
-    int Start(Device*, int remote_port);
+    int Start(DeviceRef, int remote_port);
 };
 
 // MARK: WiFi MDNS
+struct MDNSBrowser;
 struct MDNS : DeviceDiscovery {
     int networkPrefix = 0;
     const char* suffix = "WIFI";
+    MDNSBrowser* browser = NULL;
+    std::mutex browser_lock;    // for Wake(), browser is set on the reload thread
+    ~MDNS();
+    void Prepare();
     void DoReload();
+    void Wake();
 };
 
 
@@ -105,10 +229,20 @@ struct AdbMgr : DeviceDiscovery {
     ~AdbMgr();
     void DoReload();
 
-    bool AddForward(Device* dev, int local_port, int remote_port);
-    void ClearForwards(Device* dev);
-    void GetModel(Device* dev);
-    bool DeviceOffline(Device *dev) {
+    bool AddForward(const Device* dev, int local_port, int remote_port);
+
+    // Local port forwarded to remote_port on the device, reusing the
+    // forward when there is one. 0 when adb couldn't make one.
+    int Forward(const Device* dev, int remote_port);
+
+    // Connecting through local_port failed, the next Forward() makes a new one
+    void RemoveForward(const Device* dev, int local_port);
+
+    // Whether local_port still goes to remote_port on this device, e.g. for a
+    // port remembered from an earlier run. Only asks adb for the first list.
+    bool Forwarded(const char* serial, int local_port, int remote_port);
+    bool LookupModel(const Device* dev, char* model, size_t size);
+    bool DeviceOffline(const Device *dev) {
         return memcmp(dev->state, "device", 6) != 0;
     }
 };
@@ -121,6 +255,11 @@ struct AdbMgr : DeviceDiscovery {
 #include <libimobiledevice/lockdown.h>
 #endif
 
+struct UsbmuxListener;
+
+// Devices come from our own usbmuxd client (see usbmux.h), which follows
+// attach and detach events as they happen. libimobiledevice is only used
+// for the device names.
 struct USBMux : DeviceDiscovery {
     const char* suffix = "USB";
 
@@ -136,10 +275,6 @@ struct USBMux : DeviceDiscovery {
     lockdownd_get_device_name_t  lockdownd_get_device_name;
 
     libusbmuxd_set_debug_level_t usbmuxd_set_debug_level;
-    usbmuxd_get_device_list_t    usbmuxd_get_device_list;
-    usbmuxd_device_list_free_t   usbmuxd_device_list_free;
-    usbmuxd_connect_t            usbmuxd_connect;
-    usbmuxd_disconnect_t         usbmuxd_disconnect;
 
     HMODULE hModuleIDevice;
     HMODULE hModuleUsbmux;
@@ -150,15 +285,20 @@ struct USBMux : DeviceDiscovery {
 
 #ifdef __APPLE__
     MDNS* mdns;
-    void* usbmuxd_device_list;
 #else
-    usbmuxd_device_info_t* usbmuxd_device_list;
+    UsbmuxListener* listener;
+    std::mutex listener_lock;   // for Wake(), listener is set on the reload thread
 #endif
     Proxy iproxy;
 
     USBMux();
     ~USBMux();
+    void Prepare();
     void DoReload();
-    void GetModel(Device* dev);
-    socket_t Connect(Device* dev, int port, int* iproxy_port);
+    void Wake();
+
+    // A phone came or went, called from the listener thread
+    void Changed(void);
+    bool LookupModel(const Device* dev, char* model, size_t size);
+    socket_t Connect(DeviceRef dev, int port, int* iproxy_port, const struct net_cancel *cancel = NULL);
 };
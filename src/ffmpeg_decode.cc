@@ -106,23 +106,19 @@ int FFMpegDecoder::init(uint8_t* header, enum AVCodecID id, bool use_hw)
 	decoder->opaque = this;
 
 	if (id == AV_CODEC_ID_AAC) {
-		// https://wiki.multimedia.cx/index.php/MPEG-4_Audio
-		static int aac_frequencies[] = {96000,88200,64000,48000,44100,32000,24000,22050,16000,12000,11025,8000};
+		int sample_rate, channels;
 		if (!header) {
 			elog("missing AAC header required to init decoder");
 			return -1;
 		}
 
-		int sr_idx = ((header[0] << 1) | (header[1] >> 7)) & 0x1F;
-		if (sr_idx < 0 || sr_idx >= (int)ARRAY_LEN(aac_frequencies)) {
-			elog("failed to parse AAC header, sr_idx=%d [0x%2x 0x%2x]", sr_idx, header[0], header[1]);
+		if (!aac_config_parse(header, &sample_rate, &channels)) {
+			elog("failed to parse AAC header [0x%2x 0x%2x]", header[0], header[1]);
 			return -1;
 		}
 
-		decoder->sample_rate = aac_frequencies[sr_idx];
+		decoder->sample_rate = sample_rate;
 		decoder->profile = FF_PROFILE_AAC_LOW;
-
-		const int channels = (header[1] >> 3) & 0xF;
 		#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(59, 24, 100)
 		decoder->channels = channels;
 		switch (decoder->channels) {
@@ -176,6 +172,11 @@ int FFMpegDecoder::init(uint8_t* header, enum AVCodecID id, bool use_hw)
 }
 
 FFMpegDecoder::~FFMpegDecoder(void)
+{
+	close();
+}
+
+void FFMpegDecoder::close(void)
 {
 	if (frame_hw)
 		av_frame_free(&frame_hw);
@@ -193,6 +194,35 @@ FFMpegDecoder::~FFMpegDecoder(void)
 		avcodec_free_context(&decoder);
 }
 
+bool FFMpegDecoder::flush(void)
+{
+	if (!decoder || codec->id != AV_CODEC_ID_H264)
+		return false;
+
+	avcodec_flush_buffers(decoder);
+	wait_keyframe = true;
+	reinject = params_len > 0;
+	return true;
+}
+
+// Start over in software, in case the hardware decoder is what keeps failing
+bool FFMpegDecoder::restart(void)
+{
+	if (!decoder || codec->id != AV_CODEC_ID_H264)
+		return false;
+
+	// Stays ready, see Decoder::restart()
+	close();
+	hw = false;
+	hw_pix_fmt = AV_PIX_FMT_NONE;
+	if (init(NULL, AV_CODEC_ID_H264, false) < 0)
+		return false;
+
+	wait_keyframe = true;
+	reinject = params_len > 0;
+	return true;
+}
+
 // TODO:
 // add AV_PIX_FMT_YUVJ420P to obs-ffmpeg-formats.h
 // add convert_color_space to obs-ffmpeg-formats.h
@@ -310,20 +340,32 @@ DataPacket* FFMpegDecoder::pull_empty_packet(size_t size)
 	return packet;
 }
 
+void FFMpegDecoder::count_discard(void)
+{
+	if (!counters)
+		return;
+
+	if (codec->id == AV_CODEC_ID_AAC)
+		counters->audio_dropped++;
+	else
+		counters->discard_catchup++;
+}
+
 void FFMpegDecoder::push_ready_packet(DataPacket* packet)
 {
 	if (catchup) {
 		if (decodeQueue.items.size() > 0){
-			recieveQueue.add_item(packet);
+			count_discard();
+			push_empty_packet(packet);
 			return;
 		}
 
-		// Discard P/B frames and continue on anything higher
+		// Discard everything up to the next IDR
 		if (codec->id == AV_CODEC_ID_H264) {
-			int nalType = packet->data[2] == 1 ? (packet->data[3] & 0x1f) : (packet->data[4] & 0x1f);
-			if (nalType < 5) {
+			if (!h264_is_keyframe(packet->data, packet->used)) {
 				dlog("discard non-keyframe");
-				recieveQueue.add_item(packet);
+				count_discard();
+				push_empty_packet(packet);
 				return;
 			}
 		}
@@ -351,6 +393,37 @@ bool FFMpegDecoder::decode_video(struct obs_source_frame2* obs_frame, DataPacket
 	AVFrame *out_frame;
 	*got_output = false;
 
+	// Parameter sets lead the access unit they arrive with
+	if (data_packet->used > 4 && codec->id == AV_CODEC_ID_H264) {
+		const uint8_t *p = data_packet->data;
+		int nal = p[2] == 1 ? p[3] & 0x1f : p[4] & 0x1f;
+		if (nal == 7) {
+			size_t len = h264_parameter_sets(p, data_packet->used, params,
+				sizeof(params) - AV_INPUT_BUFFER_PADDING_SIZE);
+			if (len) {
+				memset(params + len, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+				params_len = len;
+			}
+		}
+	}
+
+	if (wait_keyframe) {
+		if (!h264_is_keyframe(data_packet->data, data_packet->used)) {
+			if (counters) counters->discard_failed++;
+			return true;
+		}
+
+		dlog("decoder: resuming at keyframe");
+		wait_keyframe = false;
+		if (reinject) {
+			reinject = false;
+			packet->data = params;
+			packet->size = (int) params_len;
+			packet->pts = AV_NOPTS_VALUE;
+			avcodec_send_packet(decoder, packet);
+		}
+	}
+
 	packet->data = data_packet->data;
 	packet->size = data_packet->used;
 	packet->pts = (data_packet->pts == NO_PTS) ? AV_NOPTS_VALUE : data_packet->pts;
@@ -444,17 +517,21 @@ bool FFMpegDecoder::decode_audio(struct obs_source_audio* obs_frame, DataPacket*
 	int ret;
 	*got_output = false;
 
-	packet->data = data_packet->data;
-	packet->size = data_packet->used;
-	packet->pts = (data_packet->pts == NO_PTS) ? AV_NOPTS_VALUE : data_packet->pts;
+	// A NULL packet collects the next frame left over from the last one
+	if (data_packet) {
+		packet->data = data_packet->data;
+		packet->size = data_packet->used;
+		packet->pts = (data_packet->pts == NO_PTS) ? AV_NOPTS_VALUE : data_packet->pts;
 
-	ret = avcodec_send_packet(decoder, packet);
-	if (ret == 0) {
-		ret = avcodec_receive_frame(decoder, frame);
-		if (ret == 0) goto GOT_FRAME;
+		ret = avcodec_send_packet(decoder, packet);
+		if (ret != 0)
+			return ret == AVERROR(EAGAIN);
 	}
 
-	return ret == AVERROR(EAGAIN);
+	ret = avcodec_receive_frame(decoder, frame);
+	if (ret == 0) goto GOT_FRAME;
+
+	return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
 
 GOT_FRAME:
 	for (size_t i = 0; i < MAX_AV_PLANES; i++)
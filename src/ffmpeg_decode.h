@@ -55,6 +55,12 @@ struct FFMpegDecoder : Decoder {
 	bool catchup;
 	bool b_frame_check;
 
+	// Error recovery: parameter sets seen last, sent again after a flush
+	bool wait_keyframe;
+	bool reinject;
+	size_t params_len;
+	uint8_t params[1024 + AV_INPUT_BUFFER_PADDING_SIZE];
+
 	FFMpegDecoder(void) {
 		decoder = NULL;
 		packet = NULL;
@@ -65,6 +71,9 @@ struct FFMpegDecoder : Decoder {
 		hw = false;
 		catchup = false;
 		b_frame_check = false;
+		wait_keyframe = false;
+		reinject = false;
+		params_len = 0;
 	}
 
 	~FFMpegDecoder(void);
@@ -76,5 +85,12 @@ struct FFMpegDecoder : Decoder {
 
 	DataPacket* pull_empty_packet(size_t size);
 	void push_ready_packet(DataPacket*);
+	void count_discard(void);
+	void skip_to_keyframe(void) { catchup = true; }
+	bool flush(void);
+	bool restart(void);
+
+private:
+	void close(void);
 };
 #endif
@@ -0,0 +1,316 @@
+/*
+Copyright (C) 2022 DEV47APPS, github.com/dev47apps
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <util/platform.h>
+#include "plugin.h"
+#include "http.h"
+
+#ifdef _WIN32
+  #define strncasecmp _strnicmp
+#else
+# include <strings.h>
+# include <sys/select.h>
+#endif
+
+static const char* find_crlf(const char* p, const char* end) {
+    for (; p + 1 < end; p++) {
+        if (p[0] == '\r' && p[1] == '\n')
+            return p;
+    }
+    return NULL;
+}
+
+// Match "name:" at the start of a header line, returns the value or NULL
+static const char* header_value(const char* line, const char* eol, const char* name) {
+    size_t n = strlen(name);
+    if ((size_t)(eol - line) <= n || line[n] != ':' || strncasecmp(line, name, n) != 0)
+        return NULL;
+
+    line += n + 1;
+    while (line < eol && (*line == ' ' || *line == '\t'))
+        line++;
+    return line;
+}
+
+static bool value_contains(const char* value, const char* eol, const char* token) {
+    size_t n = strlen(token);
+    for (; value + n <= eol; value++) {
+        if (strncasecmp(value, token, n) == 0)
+            return true;
+    }
+    return false;
+}
+
+static void body_append(struct http_response* resp, const char* data, size_t size) {
+    const size_t max = sizeof(resp->body) - 1;
+    size_t at = resp->body_len < max ? resp->body_len : max;
+    size_t n = size < (max - at) ? size : (max - at);
+
+    memcpy(&resp->body[at], data, n);
+    resp->body[at + n] = 0;
+    resp->body_len += size;
+}
+
+void HttpClient::Attach(socket_t s) {
+    Close();
+    sock = s;
+    set_nonblock(sock, 1);
+}
+
+void HttpClient::Close(void) {
+    if (sock != INVALID_SOCKET) {
+        net_close(sock);
+        sock = INVALID_SOCKET;
+    }
+    pending = 0;
+    received = 0;
+    len = 0;
+}
+
+bool HttpClient::Send(const char* method, const char* path) {
+    char req[512];
+    if (sock == INVALID_SOCKET)
+        return false;
+
+    int n = snprintf(req, sizeof(req), "%s %s HTTP/1.1\r\nHost: droidcam\r\n%s\r\n", method, path,
+        strcmp(method, "GET") == 0 ? "" : "Content-Length: 0\r\n");
+
+    if (n <= 0 || n >= (int) sizeof(req))
+        return false;
+
+    if (net_send_all(sock, req, n) <= 0) {
+        elog("http: send failed");
+        return false;
+    }
+
+    pending++;
+    return true;
+}
+
+// Try to parse one complete response from the receive buffer.
+// eof: the peer closed the connection, so a body without a length is complete.
+int HttpClient::Parse(struct http_response* resp, bool eof) {
+    const char* end = buf + len;
+    const char* headers_end = NULL;
+    const char* p;
+    size_t pos, consumed;
+    int minor = 0, status = 0;
+    long content_length = -1;
+    bool chunked = false;
+    bool keep_alive;
+
+    for (p = buf; p + 3 < end; p++) {
+        if (memcmp(p, "\r\n\r\n", 4) == 0) {
+            headers_end = p + 4;
+            break;
+        }
+    }
+
+    if (!headers_end)
+        goto need_more;
+
+    {
+        // the buffer is not NUL terminated
+        char line[64];
+        size_t n = find_crlf(buf, headers_end) - buf;
+        if (n >= sizeof(line)) n = sizeof(line) - 1;
+        memcpy(line, buf, n);
+        line[n] = 0;
+        if (sscanf(line, "HTTP/1.%d %d", &minor, &status) != 2)
+            status = 0;
+    }
+
+    if (status == 0) {
+        elog("http: bad status line");
+        return HTTP_ERROR;
+    }
+
+    keep_alive = minor >= 1;
+    p = find_crlf(buf, headers_end) + 2;
+    while (p < headers_end - 2) {
+        const char* eol = find_crlf(p, headers_end);
+        const char* value;
+
+        if ((value = header_value(p, eol, "Content-Length")) != NULL) {
+            content_length = strtol(value, NULL, 10);
+        }
+        else if ((value = header_value(p, eol, "Transfer-Encoding")) != NULL) {
+            chunked = value_contains(value, eol, "chunked");
+        }
+        else if ((value = header_value(p, eol, "Connection")) != NULL) {
+            if (value_contains(value, eol, "close")) keep_alive = false;
+            if (value_contains(value, eol, "keep-alive")) keep_alive = true;
+        }
+        p = eol + 2;
+    }
+
+    if (content_length > (long) sizeof(buf)) {
+        elog("http: response too large");
+        return HTTP_ERROR;
+    }
+
+    resp->body_len = 0;
+    resp->body[0] = 0;
+    pos = headers_end - buf;
+
+    if (status / 100 == 1 || status == 204 || status == 304) {
+        consumed = pos;
+    }
+    else if (chunked) {
+        for (;;) {
+            const char* eol = find_crlf(buf + pos, end);
+            if (!eol)
+                goto need_more;
+
+            size_t size = strtoul(buf + pos, NULL, 16);
+            pos = eol + 2 - buf;
+
+            if (size == 0) {
+                // Optional trailers, terminated by an empty line
+                for (;;) {
+                    eol = find_crlf(buf + pos, end);
+                    if (!eol)
+                        goto need_more;
+
+                    bool empty = (eol == buf + pos);
+                    pos = eol + 2 - buf;
+                    if (empty) break;
+                }
+                break;
+            }
+
+            if (size > sizeof(buf)) {
+                elog("http: chunk too large");
+                return HTTP_ERROR;
+            }
+
+            if (len < pos + size + 2)
+                goto need_more;
+
+            body_append(resp, buf + pos, size);
+            pos += size + 2;
+        }
+        consumed = pos;
+    }
+    else if (content_length >= 0) {
+        if (len < pos + (size_t) content_length)
+            goto need_more;
+
+        body_append(resp, buf + pos, content_length);
+        consumed = pos + content_length;
+    }
+    else {
+        // No length, the body runs until the connection closes
+        if (!eof)
+            goto need_more;
+
+        body_append(resp, buf + pos, len - pos);
+        consumed = len;
+        keep_alive = false;
+    }
+
+    resp->status = status;
+    resp->keep_alive = keep_alive && !eof;
+
+    memmove(buf, buf + consumed, len - consumed);
+    len -= consumed;
+    return HTTP_OK;
+
+need_more:
+    if (len == sizeof(buf)) {
+        elog("http: response too large");
+        return HTTP_ERROR;
+    }
+
+    return eof ? HTTP_CLOSED : HTTP_TIMEOUT;
+}
+
+int HttpClient::Recv(struct http_response* resp, int timeout_ms) {
+    const uint64_t deadline = os_gettime_ns() / 1000000 + timeout_ms;
+
+    if (sock == INVALID_SOCKET)
+        return HTTP_ERROR;
+
+    for (;;) {
+        int rc = Parse(resp, false);
+        if (rc == HTTP_OK) {
+            pending--;
+            received++;
+            return rc;
+        }
+
+        if (rc != HTTP_TIMEOUT)
+            return rc;
+
+        uint64_t now = os_gettime_ns() / 1000000;
+        if (now >= deadline)
+            return HTTP_TIMEOUT;
+
+        struct timeval timeout;
+        timeout.tv_sec = (long) ((deadline - now) / 1000);
+        timeout.tv_usec = (long) ((deadline - now) % 1000) * 1000;
+
+        fd_set set;
+        socket_t maxfd = sock;
+        FD_ZERO(&set);
+        FD_SET(sock, &set);
+        if (cancel && cancel->rd != INVALID_SOCKET) {
+            FD_SET(cancel->rd, &set);
+            if (cancel->rd > maxfd) maxfd = cancel->rd;
+        }
+
+        rc = select((int) maxfd + 1, &set, NULL, NULL, &timeout);
+        if (rc < 0) {
+            WSAErrno();
+            if (errno == EINTR && !net_cancelled(cancel)) continue;
+            elog("http: select failed: %s", strerror(errno));
+            return HTTP_ERROR;
+        }
+
+        if (net_cancelled(cancel))
+            return HTTP_ERROR;
+
+        if (rc == 0)
+            return HTTP_TIMEOUT;
+
+        ssize_t r = net_recv(sock, buf + len, sizeof(buf) - len);
+        if (r == 0) {
+            rc = Parse(resp, true);
+            if (rc == HTTP_OK) {
+                pending--;
+                received++;
+            }
+            return rc;
+        }
+
+        if (r < 0) {
+            WSAErrno();
+            #if _WIN32
+            if (errno == WSAEWOULDBLOCK) continue;
+            #else
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+            #endif
+            return HTTP_ERROR;
+        }
+
+        len += r;
+    }
+}
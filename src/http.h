@@ -0,0 +1,48 @@
+// Copyright (C) 2022 DEV47APPS, github.com/dev47apps
+#pragma once
+#include <stddef.h>
+#include "net.h"
+
+#define HTTP_OK       1
+#define HTTP_TIMEOUT  0
+#define HTTP_ERROR   -1
+#define HTTP_CLOSED  -2
+
+struct http_response {
+    int status;
+    bool keep_alive;
+    size_t body_len;
+    char body[1024]; // NUL terminated, truncated if larger
+};
+
+// Minimal HTTP/1.1 client over one keep-alive connection.
+// Requests can be pipelined, responses come back in the same order.
+struct HttpClient {
+    socket_t sock;
+    int pending;
+    int received;   // responses on this connection
+    size_t len;
+    char buf[4096];
+    const struct net_cancel *cancel; // cuts Recv() short, optional
+
+    HttpClient() : sock(INVALID_SOCKET), pending(0), received(0), len(0), cancel(NULL) {}
+    ~HttpClient() { Close(); }
+
+    void Attach(socket_t s);
+    void Close(void);
+    inline bool Connected(void) { return sock != INVALID_SOCKET; }
+
+    bool Send(const char* method, const char* path);
+
+    // Wait up to timeout_ms for the next response.
+    // Returns HTTP_OK with resp filled in, or one of HTTP_TIMEOUT, HTTP_ERROR, HTTP_CLOSED.
+    // A fired cancel token counts as HTTP_ERROR.
+    int Recv(struct http_response* resp, int timeout_ms);
+
+    int Parse(struct http_response* resp, bool eof);
+
+    // Recv() got HTTP_CLOSED on a connection that served responses before,
+    // and no byte of the next one came: the peer dropped an idle keep-alive
+    // connection rather than refusing the request
+    inline bool Stale(int rc) { return rc == HTTP_CLOSED && received > 0 && len == 0; }
+};
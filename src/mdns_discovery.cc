@@ -37,7 +37,96 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "plugin_properties.h"
 #include <util/platform.h>
 
-// Callback handling parsing answers to queries sent
+#include <condition_variable>
+#include <string>
+
+#define MS_FACTOR 1000000
+#define QUERY_INTERVAL_MIN 1000
+#define QUERY_INTERVAL_MAX (3600 * 1000)
+#define CACHE_LIMIT 256
+
+static inline uint64_t now_ms(void) {
+    return os_gettime_ns() / MS_FACTOR;
+}
+
+static inline bool name_equals(const std::string& a, const std::string& b) {
+    return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+static inline bool name_endswith(const std::string& name, const char* suffix, size_t length) {
+    return name.size() >= length
+        && strncasecmp(name.data() + name.size() - length, suffix, length) == 0;
+}
+
+// A cached resource record.
+// PTR: name=service, value=instance
+// SRV: name=instance, value=target host, port
+// TXT: name=instance, value="key=value" (one per key)
+// A/AAAA: name=host, value=address
+struct MDNSRecord {
+    uint16_t rtype;
+    uint16_t port;
+    uint32_t ttl;
+    uint64_t updated;
+    uint64_t expires;
+    bool refreshed;
+    std::string name;
+    std::string value;
+    char from[INET6_ADDRSTRLEN];
+};
+
+// Long running mDNS listener, shared by every MDNS manager with the same networkPrefix.
+// Joins the multicast group on MDNS_PORT and caches answers until their TTL runs out,
+// so the device list can be rebuilt at any time without going to the network.
+struct MDNSBrowser {
+    int networkPrefix;
+    int refs;
+    pthread_t pthr;
+    volatile bool running;
+
+    socket_t sock;
+    socket_t wake_sock;
+    struct sockaddr_in wake_addr;
+    bool passive;
+    char sock_bindIP[64];
+
+    std::atomic<int> kick;
+    uint64_t next_query;
+    uint64_t query_interval;
+
+    // records of interest were seen in the packet being parsed
+    bool packet_relevant;
+    bool changed;
+    std::mutex cache_lock;
+    std::condition_variable cache_cv;
+    std::vector<MDNSRecord> cache;
+
+    std::mutex subs_lock;
+    std::vector<MDNS*> subs;
+
+    MDNSBrowser(int prefix) : networkPrefix(prefix), refs(1), running(false),
+        sock(INVALID_SOCKET), wake_sock(INVALID_SOCKET), passive(false),
+        kick(0), next_query(0), query_interval(QUERY_INTERVAL_MIN),
+        packet_relevant(false), changed(false)
+    {
+        memset(sock_bindIP, 0, sizeof(sock_bindIP));
+    }
+
+    bool Start(void);
+    void Stop(void);
+    void Wake(void);
+    void Kick(void) { kick = 1; Wake(); }
+
+    void Open(void);
+    void Close(void);
+    void Query(uint64_t now);
+    uint64_t Expire(uint64_t now);
+    bool HasServices(void);
+    void Insert(MDNSRecord& rec, bool flush);
+    void Notify(void);
+};
+
+// Callback handling parsing answers, both to our queries and unsolicited announcements
 static int
 query_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry_type,
                uint16_t query_id, uint16_t rtype, uint16_t rclass, uint32_t ttl, const void* data,
@@ -47,162 +136,144 @@ query_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry
     (void)sizeof(sock);
     (void)sizeof(query_id);
     (void)sizeof(name_length);
-    (void)sizeof(ttl);
 
-    MDNS *mdnsMgr = (MDNS *)user_data;
+    MDNSBrowser *browser = (MDNSBrowser *)user_data;
+    const char* service_name = DROIDCAM_SERVICE_NAME;
+    const size_t service_len = sizeof(DROIDCAM_SERVICE_NAME) - 1;
     char entrybuffer[256];
+    char namebuffer[256];
 
-#ifdef DEBUG
-    const char *entry_name, *record_name;
-    switch (rtype) {
-        case MDNS_RECORDTYPE_PTR:
-            record_name = "PTR";
-            break;
-        case MDNS_RECORDTYPE_SRV:
-            record_name = "SRV";
-            break;
-        case MDNS_RECORDTYPE_A:
-            record_name = "A";
-            break;
-        case MDNS_RECORDTYPE_AAAA:
-            record_name = "AAAA";
-            break;
-        default:
-            record_name = "ANY";
-    }
-
-    switch (entry_type) {
-        case MDNS_ENTRYTYPE_QUESTION:
-            entry_name = "QUESTION";
-            break;
-        case MDNS_ENTRYTYPE_ANSWER:
-            entry_name = "ANSWER";
-            break;
-        case MDNS_ENTRYTYPE_AUTHORITY:
-            entry_name = "AUTHORITY";
-            break;
-        default:
-            entry_name = "ADDITIONAL";
-    }
-#endif
+    if (entry_type == MDNS_ENTRYTYPE_QUESTION)
+        return 0;
 
-    void *in_addr;
+    void *in_addr = NULL;
     char addrbuffer[INET6_ADDRSTRLEN] = {0};
 
     switch (from->sa_family) {
         case AF_INET: {
             struct sockaddr_in* sa = (struct sockaddr_in*) from;
+            if (browser->networkPrefix && (int)(sa->sin_addr.s_addr & 0xffff) != browser->networkPrefix)
+                return 0;
+
             in_addr = &(sa->sin_addr);
             break;
         }
         case AF_INET6: {
             struct sockaddr_in6* sa = (struct sockaddr_in6*) from;
+            if (browser->networkPrefix)
+                return 0;
+
             in_addr = &(sa->sin6_addr);
             break;
         }
+        default:
+            return 0;
     }
 
-    mdns_string_t fromaddrstr;
-    fromaddrstr.str = inet_ntop(from->sa_family, in_addr, addrbuffer, (socklen_t)addrlen);
-    if (fromaddrstr.str) {
-        fromaddrstr.length = strnlen(fromaddrstr.str, sizeof(addrbuffer));
-    } else {
+    if (!inet_ntop(from->sa_family, in_addr, addrbuffer, (socklen_t)sizeof(addrbuffer))) {
         elog("mDNS: error parsing fromaddress: %s", strerror(errno));
         return 0;
     }
 
-    dlog("mDNS: reply from %.*s entry=%s record=%s", MDNS_STRING_FORMAT(fromaddrstr), entry_name, record_name);
+    mdns_string_t entry = mdns_string_extract(data, size, &name_offset, namebuffer, sizeof(namebuffer));
 
-    if (entry_type == MDNS_ENTRYTYPE_ANSWER) {
-        mdns_string_t record = mdns_record_parse_ptr(data, size, record_offset, record_length, entrybuffer, sizeof(Device::serial)-1);
-        dlog("mDNS: ANSWER record=%.*s", MDNS_STRING_FORMAT(record));
+    MDNSRecord rec;
+    rec.rtype = rtype;
+    rec.port = 0;
+    rec.ttl = ttl;
+    rec.name.assign(MDNS_STRING_ARGS(entry));
+    memcpy(rec.from, addrbuffer, sizeof(rec.from));
 
-        Device *dev = mdnsMgr->AddDevice(MDNS_STRING_ARGS(record));
-        if (dev) {
-            ilog("added new device with serial '%.*s'", MDNS_STRING_FORMAT(record));
-            dev->handle = query_id;
-            MDNS_STRING_LIMIT(fromaddrstr, sizeof(Device::address)-1);
-            memcpy(dev->model, MDNS_STRING_ARGS(fromaddrstr));
-            memcpy(dev->address, MDNS_STRING_ARGS(fromaddrstr));
-        } else {
-            elog("error adding device");
-        }
-
-        return 0;
-    }
+    bool flush = (rclass & MDNS_CACHE_FLUSH) != 0;
+    bool service = name_equals(rec.name, std::string(service_name, service_len));
+    bool instance = !service && name_endswith(rec.name, service_name, service_len);
 
+    if (rtype == MDNS_RECORDTYPE_PTR) {
+        if (!service)
+            return 0;
 
-    if (entry_type != MDNS_ENTRYTYPE_ADDITIONAL) {
-        return 0;
-    }
+        mdns_string_t record = mdns_record_parse_ptr(data, size, record_offset, record_length,
+            entrybuffer, sizeof(Device::serial)-1);
+        dlog("mDNS: PTR %.*s from %s ttl=%u", MDNS_STRING_FORMAT(record), addrbuffer, ttl);
 
-    mdns_string_t entry = mdns_string_extract(data, size, &name_offset, entrybuffer, sizeof(Device::serial)-1);
-    Device *dev = mdnsMgr->GetDevice(MDNS_STRING_ARGS(entry));
-    if (dev == NULL) {
-        elog("device '%.*s' not found", MDNS_STRING_FORMAT(entry));
+        rec.value.assign(MDNS_STRING_ARGS(record));
+        browser->packet_relevant = true;
+        // PTR records are shared, the cache-flush bit does not apply
+        browser->Insert(rec, false);
         return 0;
     }
-    // if (dev->handle != query_id) {
-    //     dlog("device '%.*s' query_id mis-match", MDNS_STRING_FORMAT(entry));
-    //     return 0;
-    // }
 
-    // ADDITIONAL section
     if (rtype == MDNS_RECORDTYPE_SRV) {
-        char srvbuf[256];
-        mdns_record_srv_t srv = mdns_record_parse_srv(data, size, record_offset, record_length, srvbuf, sizeof(srvbuf));
-        (void) srv;
-        // dlog("mDNS: SRV %.*s port=%d", MDNS_STRING_FORMAT(srv.name), srv.port);
-        // Any way to also auto-discover port via USB (?) and remove the manual port input
+        if (!instance)
+            return 0;
+
+        mdns_record_srv_t srv = mdns_record_parse_srv(data, size, record_offset, record_length,
+            entrybuffer, sizeof(entrybuffer));
+        dlog("mDNS: SRV %.*s port=%d", MDNS_STRING_FORMAT(srv.name), srv.port);
+
+        rec.value.assign(MDNS_STRING_ARGS(srv.name));
+        rec.port = srv.port;
+        browser->packet_relevant = true;
+        browser->Insert(rec, flush);
         return 0;
     }
 
     if (rtype == MDNS_RECORDTYPE_TXT) {
-        mdns_record_txt_t txtbuf[512];
-        ssize_t parsed = mdns_record_parse_txt(data, size, record_offset, record_length, txtbuf, ARRAY_LEN(txtbuf));
+        if (!instance)
+            return 0;
 
-        for (ssize_t t = 0; t < parsed; t++) {
-            if (txtbuf[t].value.length == 0) {
-                dlog("mDNS: TXT %.*s", MDNS_STRING_FORMAT(txtbuf[t].key));
-                continue;
-            }
+        mdns_record_txt_t txtbuf[32];
+        size_t parsed = mdns_record_parse_txt(data, size, record_offset, record_length, txtbuf, ARRAY_LEN(txtbuf));
 
+        browser->packet_relevant = true;
+        for (size_t t = 0; t < parsed; t++) {
             dlog("mDNS: TXT %.*s = %.*s", MDNS_STRING_FORMAT(txtbuf[t].key), MDNS_STRING_FORMAT(txtbuf[t].value));
+            rec.value.assign(MDNS_STRING_ARGS(txtbuf[t].key));
+            rec.value.append("=");
+            rec.value.append(MDNS_STRING_ARGS(txtbuf[t].value));
+            browser->Insert(rec, flush);
+        }
+        return 0;
+    }
 
-            // DroidCam TXT records
-            const char* name = "name";
-
-            // name, aka device label. example result: 'Pixel 4a (WiFi)'
-            if (strncmp(name, MDNS_STRING_ARGS(txtbuf[t].key)) == 0) {
-                MDNS_STRING_LIMIT(txtbuf[t].value, sizeof(Device::model) - strlen(mdnsMgr->suffix) - 6 - 16);
-
-                dlog("using model='%.*s' for '%.*s'", MDNS_STRING_FORMAT(txtbuf[t].value), MDNS_STRING_FORMAT(entry));
-                snprintf(dev->model, sizeof(Device::model), "%.*s [%s] (%.*s)",
-                    MDNS_STRING_FORMAT(txtbuf[t].value), mdnsMgr->suffix, MDNS_STRING_FORMAT(fromaddrstr));
+    // Only keep addresses announced along with, or targeted by, a DroidCam service
+    if (rtype == MDNS_RECORDTYPE_A || rtype == MDNS_RECORDTYPE_AAAA) {
+        if (!browser->packet_relevant) {
+            bool targeted = false;
+            std::lock_guard<std::mutex> lock(browser->cache_lock);
+            for (auto &srv : browser->cache) {
+                if (srv.rtype == MDNS_RECORDTYPE_SRV && name_equals(srv.value, rec.name)) {
+                    targeted = true;
+                    break;
+                }
             }
+            if (!targeted)
+                return 0;
         }
 
-        return 0;
-    }
+        char ipbuffer[INET6_ADDRSTRLEN] = {0};
+        if (rtype == MDNS_RECORDTYPE_A) {
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            mdns_record_parse_a(data, size, record_offset, record_length, &addr);
+            inet_ntop(AF_INET, &addr.sin_addr, ipbuffer, sizeof(ipbuffer));
+        } else {
+            struct sockaddr_in6 addr;
+            memset(&addr, 0, sizeof(addr));
+            mdns_record_parse_aaaa(data, size, record_offset, record_length, &addr);
+            inet_ntop(AF_INET6, &addr.sin6_addr, ipbuffer, sizeof(ipbuffer));
+        }
 
-    // Use query_id to grab these instead of fromaddrstr for each device
-    /*if (rtype == MDNS_RECORDTYPE_A) {
-        struct sockaddr_in addr;
-        mdns_record_parse_a(data, size, record_offset, record_length, &addr);
-        return 0;
+        dlog("mDNS: %s %s = %s", rtype == MDNS_RECORDTYPE_A ? "A" : "AAAA", rec.name.c_str(), ipbuffer);
+        rec.value.assign(ipbuffer);
+        browser->Insert(rec, flush);
     }
 
-    if (rtype == MDNS_RECORDTYPE_AAAA) {
-        struct sockaddr_in6 addr;
-        mdns_record_parse_aaaa(data, size, record_offset, record_length, &addr);
-        return 0;
-    }*/
-
     return 0;
 }
 
 static
-int find_sockaddr(int network_mask) {
+int find_sockaddr(int network_mask, int port) {
 #ifdef __APPLE__
     struct ifaddrs* ifaddr = 0;
     struct ifaddrs* ifa = 0;
@@ -214,119 +285,526 @@ int find_sockaddr(int network_mask) {
         if (!ifa->ifa_addr)
             continue;
         if (ifa->ifa_addr->sa_family == AF_INET) {
-            struct sockaddr_in* saddr = (struct sockaddr_in*)ifa->ifa_addr;
-            if ((saddr->sin_addr.s_addr & 0xffff) == network_mask) {
-                dlog("found ifaddr: %x (mask %x)", saddr->sin_addr.s_addr, network_mask);
-                return mdns_socket_open_ipv4(saddr);
+            struct sockaddr_in saddr;
+            memcpy(&saddr, ifa->ifa_addr, sizeof(saddr));
+            if ((saddr.sin_addr.s_addr & 0xffff) == network_mask) {
+                dlog("found ifaddr: %x (mask %x)", saddr.sin_addr.s_addr, network_mask);
+                freeifaddrs(ifaddr);
+                saddr.sin_port = htons(port);
+                return mdns_socket_open_ipv4(&saddr);
             }
         }
     }
+    freeifaddrs(ifaddr);
 #endif
+    (void) port;
     errno = ENXIO;
     return INVALID_SOCKET;
 }
 
-#define PARALLEL 3
 extern const char* bindIP;
 
-void MDNS::DoReload(void) {
+static socket_t open_socket(int networkPrefix, const char* bind_ip, int port) {
+    if (networkPrefix)
+        return find_sockaddr(networkPrefix, port);
+
+    struct sockaddr_storage ss;
+    struct sockaddr* saddr = NULL;
+    if (bind_ip && bind_ip[0] && net_sock_addr(bind_ip, &ss))
+        saddr = (struct sockaddr*) &ss;
+
+    if (saddr && saddr->sa_family == AF_INET6) {
+        struct sockaddr_in6 sin6;
+        memcpy(&sin6, saddr, sizeof(sin6));
+        sin6.sin6_port = htons(port);
+        return mdns_socket_open_ipv6(&sin6);
+    }
+
+    struct sockaddr_in sin;
+    if (saddr && saddr->sa_family == AF_INET) {
+        memcpy(&sin, saddr, sizeof(sin));
+    } else {
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = INADDR_ANY;
+#ifdef __APPLE__
+        sin.sin_len = sizeof(sin);
+#endif
+    }
+    sin.sin_port = htons(port);
+    return mdns_socket_open_ipv4(&sin);
+}
+
+void MDNSBrowser::Open(void) {
+    const char* bind_ip = bindIP;
+    if (bind_ip) {
+        strncpy(sock_bindIP, bind_ip, sizeof(sock_bindIP) - 1);
+        dlog("mDNS: bindIP=%s", sock_bindIP);
+    } else {
+        sock_bindIP[0] = 0;
+    }
+
+    // Listening on the mDNS port lets us see announcements and answers to other hosts' queries.
+    // If another responder has it exclusively, fall back to one-shot queries from an ephemeral port.
+    sock = open_socket(networkPrefix, sock_bindIP, MDNS_PORT);
+    passive = (sock >= 0);
+    if (!passive) {
+        dlog("mDNS: could not listen on port %d (%s), using one-shot queries", MDNS_PORT, strerror(errno));
+        sock = open_socket(networkPrefix, sock_bindIP, 0);
+    }
+
+    if (sock < 0) {
+        elog("mDNS: socket(): %s", strerror(errno));
+        sock = INVALID_SOCKET;
+        return;
+    }
+
+    dlog("mDNS: browsing via socket %d (%s)", (int) sock, passive ? "passive" : "one-shot");
+}
+
+void MDNSBrowser::Close(void) {
+    if (sock != INVALID_SOCKET) {
+        mdns_socket_close(sock);
+        sock = INVALID_SOCKET;
+    }
+}
+
+void MDNSBrowser::Query(uint64_t now) {
     const char* service_name = DROIDCAM_SERVICE_NAME;
     const mdns_record_type_t record = MDNS_RECORDTYPE_ANY;
-    fd_set set;
-    socket_t maxfd = 0;
-    size_t capacity = 2048;
-    void* buffer = malloc(capacity * PARALLEL);
+    char buffer[256];
 
-    struct sockaddr* saddr = NULL;
+    if (sock == INVALID_SOCKET)
+        Open();
 
-    struct query {
-        socket_t sock;
-        void* buffer;
-        int query_id;
-    } socks[PARALLEL];
+    if (sock != INVALID_SOCKET) {
+        dlog("mDNS: query %s ANY, next in %llu ms", service_name, (unsigned long long) query_interval);
+        if (mdns_query_send(sock, record, service_name, strlen(service_name), buffer, sizeof(buffer), 0) < 0) {
+            elog("Failed to send mDNS query: %s", strerror(errno));
+        }
+    }
 
-    FD_ZERO(&set);
-    memset(&socks, 0, sizeof(struct query) * PARALLEL);
+    // RFC 6762 5.2: the interval between queries should at least double
+    next_query = now + query_interval;
+    query_interval *= 2;
+    if (query_interval > QUERY_INTERVAL_MAX)
+        query_interval = QUERY_INTERVAL_MAX;
+}
+
+// Drop expired records, returns the next time something needs attention
+uint64_t MDNSBrowser::Expire(uint64_t now) {
+    uint64_t next = next_query;
+    bool refresh = false;
+
+    std::lock_guard<std::mutex> lock(cache_lock);
+    auto i = std::begin(cache);
+    while (i != std::end(cache)) {
+        if (i->expires <= now) {
+            dlog("mDNS: expired %s %s", i->name.c_str(), i->value.c_str());
+            i = cache.erase(i);
+            changed = true;
+            continue;
+        }
 
-    if (bindIP && bindIP[0]) {
-        dlog("mDNS: bindIP=%s", bindIP);
-        saddr = net_sock_addr(bindIP);
+        if (i->expires < next)
+            next = i->expires;
+
+        // RFC 6762 5.2: re-query a service at 80% of its lifetime so it does not drop out
+        if (i->rtype == MDNS_RECORDTYPE_PTR && !i->refreshed && i->ttl) {
+            uint64_t refresh_at = i->updated + i->ttl * 800;
+            if (refresh_at <= now) {
+                i->refreshed = true;
+                refresh = true;
+            } else if (refresh_at < next) {
+                next = refresh_at;
+            }
+        }
+        ++i;
+    }
+
+    if (refresh) {
+        next_query = now;
+        next = now;
     }
 
-    for (int i = 0; i < PARALLEL; i++) {
-        socket_t sock;
+    return next;
+}
 
-        if (networkPrefix)
-        {
-            sock = find_sockaddr(networkPrefix);
+bool MDNSBrowser::HasServices(void) {
+    for (auto &rec : cache) {
+        if (rec.rtype == MDNS_RECORDTYPE_PTR)
+            return true;
+    }
+    return false;
+}
+
+void MDNSBrowser::Insert(MDNSRecord& rec, bool flush) {
+    uint64_t now = now_ms();
+    rec.updated = now;
+    rec.expires = now + (rec.ttl ? rec.ttl * 1000ULL : 1000); // RFC 6762 10.1: goodbye packets linger for one second
+    rec.refreshed = false;
+
+    std::lock_guard<std::mutex> lock(cache_lock);
+    bool found = false;
+    for (auto &old : cache) {
+        if (old.rtype != rec.rtype || !name_equals(old.name, rec.name))
+            continue;
+
+        if (old.value == rec.value) {
+            if (strncmp(old.from, rec.from, sizeof(old.from)) != 0)
+                changed = true;
+
+            if (rec.ttl == 0 && old.ttl != 0)
+                changed = true;
+
+            old.port = rec.port;
+            old.ttl = rec.ttl;
+            old.updated = rec.updated;
+            old.expires = rec.expires;
+            old.refreshed = false;
+            memcpy(old.from, rec.from, sizeof(old.from));
+            found = true;
+            continue;
         }
-        else if (saddr && saddr->sa_family == AF_INET)
+
+        // RFC 6762 10.2: a cache-flush record replaces older ones of the same name and type
+        if (flush && old.updated + 1000 < now && old.expires > now + 1000)
+            old.expires = now + 1000;
+    }
+
+    if (found)
+        return;
+
+    if (cache.size() >= CACHE_LIMIT) {
+        elog("mDNS: cache full, dropping %s", rec.name.c_str());
+        return;
+    }
+
+    cache.push_back(rec);
+    changed = true;
+}
+
+void MDNSBrowser::Notify(void) {
+    {
+        std::lock_guard<std::mutex> lock(cache_lock);
+        if (!changed)
+            return;
+
+        changed = false;
+    }
+    cache_cv.notify_all();
+
+    std::lock_guard<std::mutex> lock(subs_lock);
+    for (auto mgr : subs) {
+        mgr->Rebuild();
+    }
+}
+
+void MDNSBrowser::Wake(void) {
+    char c = 0;
+    sendto(wake_sock, &c, 1, 0, (struct sockaddr*) &wake_addr, sizeof(wake_addr));
+}
+
+static void *browser_thread(void *data) {
+    MDNSBrowser *browser = (MDNSBrowser *)data;
+    const size_t capacity = 2048;
+    void* buffer = malloc(capacity);
+
+    while (browser->running) {
+        const char* bind_ip = bindIP;
+        if (browser->sock != INVALID_SOCKET
+            && strncmp(browser->sock_bindIP, bind_ip ? bind_ip : "", sizeof(browser->sock_bindIP)) != 0)
         {
-            sock = mdns_socket_open_ipv4((struct sockaddr_in*) saddr);
+            browser->Close();
+            browser->kick = 1;
         }
-        else if (saddr && saddr->sa_family == AF_INET6)
-        {
-            sock = mdns_socket_open_ipv6((struct sockaddr_in6*) saddr);
+
+        if (browser->kick.exchange(0)) {
+            browser->query_interval = QUERY_INTERVAL_MIN;
+            browser->next_query = 0;
         }
-        else
-        {
-            sock = mdns_socket_open_ipv4(NULL);
+
+        uint64_t now = now_ms();
+        if (now >= browser->next_query)
+            browser->Query(now);
+
+        uint64_t next = browser->Expire(now);
+        browser->Notify();
+
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(browser->wake_sock, &read_fds);
+        socket_t maxfd = browser->wake_sock;
+        if (browser->sock != INVALID_SOCKET) {
+            FD_SET(browser->sock, &read_fds);
+            if (browser->sock > maxfd) maxfd = browser->sock;
         }
 
-        if (sock < 0) {
-            elog("socket(): %s", strerror(errno));
+        // Sleep until the next query or expiry, or until woken up
+        uint64_t wait = next > now ? next - now : 0;
+        struct timeval timeout;
+        timeout.tv_sec = (long) (wait / 1000);
+        timeout.tv_usec = (long) (wait % 1000) * 1000;
+
+        int rc = select((int) maxfd + 1, &read_fds, NULL, NULL, &timeout);
+        if (rc <  0) {
+            WSAErrno();
+            if (errno == EINTR) continue;
+            elog("mDNS: select failed (%d): %s", errno, strerror(errno));
+            os_sleep_ms(QUERY_INTERVAL_MIN);
             continue;
         }
+        if (rc == 0) continue;
+
+        if (FD_ISSET(browser->wake_sock, &read_fds)) {
+            char c[8];
+            while (recv(browser->wake_sock, c, sizeof(c), 0) > 0);
+        }
+
+        if (browser->sock != INVALID_SOCKET && FD_ISSET(browser->sock, &read_fds)) {
+            browser->packet_relevant = false;
+            mdns_query_recv(browser->sock, buffer, capacity, query_callback, browser, 0);
+            browser->Notify();
+        }
+    }
 
-        FD_SET(sock, &set); if (sock > maxfd) maxfd = sock;
-        dlog("mDNS: query %s ANY via socket %d", service_name, sock);
+    browser->Close();
+    free(buffer);
+    return 0;
+}
+
+bool MDNSBrowser::Start(void) {
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    wake_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (wake_sock == INVALID_SOCKET) {
+        elog("mDNS: socket(): %s", strerror(errno));
+        return false;
+    }
+
+    if (bind(wake_sock, (struct sockaddr*) &sin, sizeof(sin)) < 0
+        || getsockname(wake_sock, (struct sockaddr*) &wake_addr, &len) < 0)
+    {
+        WSAErrno();
+        elog("mDNS: wake socket: %s", strerror(errno));
+        goto fail;
+    }
+
+    set_nonblock(wake_sock, 1);
+    running = true;
+    if (pthread_create(&pthr, NULL, browser_thread, this) != 0) {
+        elog("Error creating mDNS browser thread");
+        running = false;
+        goto fail;
+    }
+
+    return true;
+
+fail:
+    net_close(wake_sock);
+    wake_sock = INVALID_SOCKET;
+    return false;
+}
 
-        socks[i].sock = sock;
-        socks[i].buffer = (char*)buffer + i * capacity;
-        socks[i].query_id = mdns_query_send(sock, record, service_name, strlen(service_name),
-            socks[i].buffer, capacity, sock);
+void MDNSBrowser::Stop(void) {
+    running = false;
+    Wake();
+    pthread_join(pthr, NULL);
+    net_close(wake_sock);
 
-        if (socks[i].query_id < 0) {
-            elog("Failed to send mDNS query: %s\n", strerror(errno));
+    // wake up anyone still waiting on the cache
+    std::lock_guard<std::mutex> lock(cache_lock);
+    cache_cv.notify_all();
+}
+
+// MARK: Process-wide browsers
+
+static std::mutex browsers_lock;
+static std::vector<MDNSBrowser*> browsers;
+
+static MDNSBrowser* browser_acquire(int networkPrefix) {
+    std::lock_guard<std::mutex> lock(browsers_lock);
+    for (auto browser : browsers) {
+        if (browser->networkPrefix == networkPrefix) {
+            browser->refs++;
+            return browser;
         }
     }
 
-    if (maxfd)
+    MDNSBrowser* browser = new MDNSBrowser(networkPrefix);
+    if (!browser->Start()) {
+        delete browser;
+        return NULL;
+    }
+
+    browsers.push_back(browser);
+    return browser;
+}
+
+static void browser_release(MDNSBrowser* browser) {
     {
-        const int NS_MS_FACTOR = 1000000;
-        uint64_t time_end = 1750 + (os_gettime_ns() / NS_MS_FACTOR);
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 150000;
-
-        do {
-            fd_set read_fds = set;
-            int rc = select(maxfd+1, &read_fds, NULL, NULL, &timeout);
-            if (rc == 0) continue;
-            if (rc <  0) {
-                WSAErrno();
-                elog("mDNS: select failed (%d): %s", errno, strerror(errno));
+        std::lock_guard<std::mutex> lock(browsers_lock);
+        if (--browser->refs > 0)
+            return;
+
+        auto i = std::begin(browsers);
+        while (i != std::end(browsers)) {
+            if (*i == browser) {
+                browsers.erase(i);
                 break;
             }
+            ++i;
+        }
+    }
+
+    browser->Stop();
+    delete browser;
+}
 
-            for (int i = 0; i < PARALLEL; i++) {
-                auto sock = socks[i].sock;
-                auto buffer = socks[i].buffer;
-                auto query_id = socks[i].query_id;
-                if (query_id && FD_ISSET(sock, &read_fds)) {
-                    void* user_data = this;
-                    mdns_query_recv(sock, buffer, capacity, query_callback, user_data, query_id);
+// MARK: MDNS
+
+MDNS::~MDNS() {
+    Cancel();
+    WaitReload();
+    if (browser) {
+        {
+            std::lock_guard<std::mutex> lock(browser->subs_lock);
+            auto i = std::begin(browser->subs);
+            while (i != std::end(browser->subs)) {
+                if (*i == this) {
+                    browser->subs.erase(i);
+                    break;
                 }
+                ++i;
             }
-        } while ((os_gettime_ns() / NS_MS_FACTOR) < time_end);
+        }
+        browser_release(browser);
     }
+}
 
-    free(buffer);
-    for (int i = 0; i < PARALLEL; i++) {
-        auto sock = socks[i].sock;
-        if (sock > 0)
-            mdns_socket_close(sock);
+void MDNS::Prepare(void) {
+    if (!browser) {
+        MDNSBrowser *b = browser_acquire(networkPrefix);
+        if (!b)
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(b->subs_lock);
+            b->subs.push_back(this);
+        }
+        std::lock_guard<std::mutex> lock(browser_lock);
+        browser = b;
     }
 
-    return;
+    browser->Kick();
+
+    // Nothing cached yet, give phones a moment to answer
+    std::unique_lock<std::mutex> lock(browser->cache_lock);
+    browser->cache_cv.wait_for(lock, std::chrono::milliseconds(1750),
+        [this] { return cancelled || !browser->running || browser->HasServices(); });
+}
+
+void MDNS::Wake(void) {
+    std::lock_guard<std::mutex> lock(browser_lock);
+    if (!browser)
+        return;
+
+    // Other sources may be waiting on the same browser, they check again and go back to sleep
+    std::lock_guard<std::mutex> cache(browser->cache_lock);
+    browser->cache_cv.notify_all();
+}
+
+// Compare the network part of two addresses, assuming /24 for IPv4 and /64 for IPv6
+static bool same_network(const char* a, const char* b) {
+    unsigned char addr_a[16], addr_b[16];
+
+    if (inet_pton(AF_INET, a, addr_a) == 1 && inet_pton(AF_INET, b, addr_b) == 1)
+        return memcmp(addr_a, addr_b, 3) == 0;
+
+    if (inet_pton(AF_INET6, a, addr_a) == 1 && inet_pton(AF_INET6, b, addr_b) == 1)
+        return memcmp(addr_a, addr_b, 8) == 0;
+
+    return false;
+}
+
+// Pick the address to connect to from the A/AAAA records of the SRV target.
+// Prefer the bindIP network, then the address the answer came from, then anything routable.
+// Link-local IPv6 is skipped since there's no scope id to go with it.
+static const char* pick_address(const std::vector<MDNSRecord>& cache, const MDNSRecord& srv, const char* from) {
+    const char* bind_ip = bindIP;
+    const char* best = from;
+    int best_score = 0;
+
+    for (int rtype : {MDNS_RECORDTYPE_A, MDNS_RECORDTYPE_AAAA}) {
+        for (auto &rec : cache) {
+            if (rec.rtype != rtype || !name_equals(rec.name, srv.value))
+                continue;
+
+            if (rtype == MDNS_RECORDTYPE_AAAA && strncasecmp(rec.value.c_str(), "fe80:", 5) == 0)
+                continue;
+
+            int score = 1;
+            if (bind_ip && bind_ip[0] && same_network(rec.value.c_str(), bind_ip))
+                score = 3;
+            else if (rec.value == from)
+                score = 2;
+
+            if (score > best_score) {
+                best = rec.value.c_str();
+                best_score = score;
+            }
+        }
+    }
+
+    return best;
+}
+
+void MDNS::DoReload(void) {
+    if (!browser)
+        return;
+
+    std::lock_guard<std::mutex> lock(browser->cache_lock);
+    for (auto &ptr : browser->cache) {
+        if (ptr.rtype != MDNS_RECORDTYPE_PTR)
+            continue;
+
+        Device *dev = AddDevice(ptr.value.c_str(), ptr.value.size());
+        if (!dev) {
+            elog("error adding device");
+            continue;
+        }
+
+        const char* address = ptr.from;
+        for (auto &srv : browser->cache) {
+            if (srv.rtype != MDNS_RECORDTYPE_SRV || !name_equals(srv.name, ptr.value))
+                continue;
+
+            dev->port = srv.port;
+            address = pick_address(browser->cache, srv, ptr.from);
+            break;
+        }
+
+        dlog("mDNS: device '%s' at %s port %d", dev->serial, address, dev->port);
+        strncpy(dev->address, address, sizeof(Device::address)-1);
+        strncpy(dev->model, address, sizeof(Device::model)-1);
+
+        // DroidCam TXT records
+        // name, aka device label. example result: 'Pixel 4a (WiFi)'
+        for (auto &txt : browser->cache) {
+            if (txt.rtype != MDNS_RECORDTYPE_TXT || !name_equals(txt.name, ptr.value))
+                continue;
+
+            if (strncmp(txt.value.c_str(), "name=", 5) != 0 || txt.value.size() == 5)
+                continue;
+
+            int limit = (int) (sizeof(Device::model) - strlen(suffix) - 6 - 16);
+            snprintf(dev->model, sizeof(Device::model), "%.*s [%s] (%s)",
+                limit, txt.value.c_str() + 5, suffix, address);
+            break;
+        }
+    }
 }
@@ -48,7 +48,8 @@ bool MJpegDecoder::init(void) {
 void MJpegDecoder::push_ready_packet(DataPacket* packet) {
     if (decodeQueue.items.size() > 1) {
         dlog("discard frame");
-        recieveQueue.add_item(packet);
+        if (counters) counters->discard_overflow++;
+        push_empty_packet(packet);
     } else {
         decodeQueue.add_item(packet);
     }
@@ -0,0 +1,63 @@
+/*
+Copyright (C) 2023 DEV47APPS, github.com/dev47apps
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mutex>
+#include "net.h"
+#include "device_discovery.h"
+#include "model_cache.h"
+
+static std::mutex save_lock;
+static uint64_t saved_seq;
+
+void model_cache_load(obs_data_t *config) {
+    obs_data_t *names = obs_data_get_obj(config, "models");
+    if (!names)
+        return;
+
+    int count = 0;
+    for (obs_data_item_t *item = obs_data_first(names); item; obs_data_item_next(&item)) {
+        const char *model = obs_data_item_get_string(item);
+        if (model && model[0]) {
+            device_model_put(obs_data_item_get_name(item), model);
+            count++;
+        }
+    }
+
+    // What we just read is already on disk
+    DeviceModels list;
+    std::lock_guard<std::mutex> lock(save_lock);
+    saved_seq = device_models(list);
+
+    dlog("model cache: %d devices", count);
+    obs_data_release(names);
+}
+
+void model_cache_save(void) {
+    DeviceModels list;
+    std::lock_guard<std::mutex> lock(save_lock);
+    uint64_t seq = device_models(list);
+    if (seq == saved_seq)
+        return;
+
+    obs_data_t *names = obs_data_create();
+    for (auto &it : list)
+        obs_data_set_string(names, it.first.c_str(), it.second.c_str());
+
+    module_config_save("models", names);
+    obs_data_release(names);
+    saved_seq = seq;
+}
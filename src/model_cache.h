@@ -0,0 +1,13 @@
+// Copyright (C) 2023 DEV47APPS, github.com/dev47apps
+#pragma once
+#include "plugin.h"
+
+// Device labels from the ADB and iOS lookups, kept in config.json so a
+// refresh after a restart doesn't have to ask every phone again.
+// The names themselves live in device_discovery (device_model_get/put).
+
+// Read the "models" object of the module config, at module load
+void model_cache_load(obs_data_t *config);
+
+// Write the names out, config.json is only touched when one changed
+void model_cache_save(void);
@@ -17,6 +17,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <errno.h>
 #include <string.h>
+#include <mutex>
+#include <util/platform.h>
 #include "plugin.h"
 #include "plugin_properties.h"
 #include "net.h"
@@ -31,6 +33,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 # include <sys/socket.h>
 # include <netdb.h>
 # include <fcntl.h>
+# include <poll.h>
 # include <unistd.h>
 #endif
 
@@ -134,10 +137,69 @@ net_accept(socket_t sock) {
     return accept(sock, NULL, 0);
 }
 
-struct sockaddr*
-net_sock_addr(const char* host) {
-    struct addrinfo hints = {0}, *addr = 0, *addrs = 0;
+// RFC 8305 "Happy Eyeballs" style connect.
+// Resolved addresses are cached per host so reconnects skip getaddrinfo,
+// and connection attempts are staggered instead of waiting out each one in turn.
+#define CONNECT_TIMEOUT_MS 2000
+#define RECV_TIMEOUT_MS 5000
+#define CONNECTION_ATTEMPT_DELAY_MS 250
+#define ADDR_CACHE_TTL_MS (60 * 1000)
+#define ADDR_CACHE_SIZE 16
+#define MAX_CANDIDATES 8
+
+struct net_addr {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+};
+
+struct addr_cache_entry {
+    char host[256];
+    uint64_t expires;
+    int count;
+    struct net_addr addrs[MAX_CANDIDATES];
+};
+
+static std::mutex addr_cache_lock;
+static struct addr_cache_entry addr_cache[ADDR_CACHE_SIZE];
+
+static inline uint64_t now_ms(void) {
+    return os_gettime_ns() / 1000000;
+}
+
+static void
+addr_cache_forget(const char* host) {
+    std::lock_guard<std::mutex> lock(addr_cache_lock);
+    for (int i = 0; i < ADDR_CACHE_SIZE; i++) {
+        if (strncmp(addr_cache[i].host, host, sizeof(addr_cache[i].host)) == 0) {
+            addr_cache[i].host[0] = 0;
+            addr_cache[i].expires = 0;
+        }
+    }
+}
 
+// Resolve host into at most `max` addresses, alternating address families
+// starting with whichever getaddrinfo ranked first (RFC 8305 section 4).
+static int
+net_resolve(const char* host, struct net_addr* out, int max) {
+    uint64_t now = now_ms();
+    int count = 0;
+
+    if (max > MAX_CANDIDATES)
+        max = MAX_CANDIDATES;
+
+    {
+        std::lock_guard<std::mutex> lock(addr_cache_lock);
+        for (int i = 0; i < ADDR_CACHE_SIZE; i++) {
+            struct addr_cache_entry *entry = &addr_cache[i];
+            if (entry->expires > now && strncmp(entry->host, host, sizeof(entry->host)) == 0) {
+                count = entry->count < max ? entry->count : max;
+                memcpy(out, entry->addrs, count * sizeof(struct net_addr));
+                return count;
+            }
+        }
+    }
+
+    struct addrinfo hints = {0}, *addr = 0, *addrs = 0;
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_protocol = IPPROTO_TCP;
@@ -145,19 +207,70 @@ net_sock_addr(const char* host) {
     if (getaddrinfo(host, NULL, &hints, &addrs) != 0) {
         WSAErrno();
         elog("getaddrinfo failed (%d): %s", errno, strerror(errno));
-        return NULL;
+        return 0;
+    }
+
+    struct net_addr candidates[MAX_CANDIDATES];
+    int family = addrs->ai_family;
+    int total = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (addr = addrs; addr && total < MAX_CANDIDATES; addr = addr->ai_next) {
+            if ((pass == 0) != (addr->ai_family == family))
+                continue;
+
+            if (addr->ai_addrlen > sizeof(struct sockaddr_storage))
+                continue;
+
+            memcpy(&candidates[total].addr, addr->ai_addr, addr->ai_addrlen);
+            candidates[total].addrlen = (socklen_t) addr->ai_addrlen;
+            total++;
+        }
+    }
+    freeaddrinfo(addrs);
+
+    // Interleave: first family, other family, first family, ...
+    int primary = 0, secondary = 0;
+    while (secondary < total && candidates[secondary].addr.ss_family == family)
+        secondary++;
+
+    int split = secondary;
+    for (count = 0; count < total; count++) {
+        bool take_primary = (count % 2 == 0) ? primary < split : secondary >= total;
+        out[count] = take_primary ? candidates[primary++] : candidates[secondary++];
     }
 
-    addr = addrs;
+    std::lock_guard<std::mutex> lock(addr_cache_lock);
+    struct addr_cache_entry *slot = &addr_cache[0];
+    for (int i = 0; i < ADDR_CACHE_SIZE; i++) {
+        if (addr_cache[i].expires < slot->expires)
+            slot = &addr_cache[i];
+    }
 
-    return addr->ai_addr;
+    strncpy(slot->host, host, sizeof(slot->host) - 1);
+    slot->host[sizeof(slot->host) - 1] = 0;
+    slot->expires = now + ADDR_CACHE_TTL_MS;
+    slot->count = count;
+    memcpy(slot->addrs, out, count * sizeof(struct net_addr));
+
+    return count < max ? count : max;
 }
 
-socket_t
-net_connect(struct addrinfo *addr, struct sockaddr* bind_saddr, uint16_t port) {
-    struct sockaddr* ai_addr = addr->ai_addr;
+bool
+net_sock_addr(const char* host, struct sockaddr_storage* saddr) {
+    struct net_addr addr;
+    if (net_resolve(host, &addr, 1) < 1)
+        return false;
+
+    memcpy(saddr, &addr.addr, sizeof(struct sockaddr_storage));
+    return true;
+}
+
+// Start a non-blocking connect, returns the socket while the connection is in progress
+static socket_t
+net_connect_start(struct net_addr *addr, struct sockaddr_storage* bind_saddr, uint16_t port) {
+    struct sockaddr* ai_addr = (struct sockaddr*) &addr->addr;
     void *in_addr;
-    int rc;
 
     switch (ai_addr->sa_family) {
         case AF_INET: {
@@ -172,109 +285,187 @@ net_connect(struct addrinfo *addr, struct sockaddr* bind_saddr, uint16_t port) {
             sa->sin6_port = htons(port);
             break;
         }
+        default:
+            return INVALID_SOCKET;
     }
 
     #ifdef DEBUG
     char str[INET6_ADDRSTRLEN] = {0};
-    inet_ntop(addr->ai_family, in_addr, str, sizeof(str));
+    inet_ntop(ai_addr->sa_family, in_addr, str, sizeof(str));
     dlog("trying %s", str);
     #else
     (void) in_addr;
     #endif
 
-    socket_t sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    socket_t sock = socket(ai_addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
     if (sock == INVALID_SOCKET) {
         WSAErrno();
         elog("socket(): %s", strerror(errno));
         return INVALID_SOCKET;
     }
 
-    if (bind_saddr && bind_saddr->sa_family == ai_addr->sa_family) {
-        const size_t addrlen = (bind_saddr->sa_family == AF_INET)
+    if (bind_saddr && bind_saddr->ss_family == ai_addr->sa_family) {
+        const size_t addrlen = (bind_saddr->ss_family == AF_INET)
             ? sizeof(struct sockaddr_in)
             : sizeof(struct sockaddr_in6);
 
-        if (bind(sock, bind_saddr, addrlen) < 0) {
+        if (bind(sock, (struct sockaddr*) bind_saddr, addrlen) < 0) {
             WSAErrno();
             elog("bind failed: %s", strerror(errno));
         }
     }
 
-    struct timeval timeout;
-    timeout.tv_sec = 2;
-    timeout.tv_usec = 0;
-
-    fd_set set;
-    FD_ZERO(&set);
-    FD_SET(sock, &set);
-
     if (!set_nonblock(sock, 1)) {
         goto ERROR_OUT;
     }
 
-    connect(sock, addr->ai_addr, addr->ai_addrlen);
+    if (connect(sock, ai_addr, addr->addrlen) == 0)
+        return sock;
 
 #if _WIN32
     if (WSAGetLastError() != WSAEWOULDBLOCK)
         goto ERROR_OUT;
 #else
     if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINPROGRESS) {
-        WSAErrno();
         elog("connect(): %s", strerror(errno));
         goto ERROR_OUT;
     }
 #endif
 
-    rc = select(sock+1, NULL, &set, NULL, &timeout);
-    if (rc == 0)
-        goto ERROR_OUT;
+    return sock;
 
-    if (rc < 0) {
-        WSAErrno();
-        elog("connect failed: %s", strerror(errno));
-        goto ERROR_OUT;
+ERROR_OUT:
+    net_close(sock);
+    return INVALID_SOCKET;
+}
+
+socket_t
+net_connect(const char* host, const char* bindIP, uint16_t port, const struct net_cancel *cancel) {
+    struct net_addr addrs[MAX_CANDIDATES];
+    socket_t socks[MAX_CANDIDATES];
+    socket_t sock = INVALID_SOCKET;
+    int count, next = 0, pending = 0;
+    uint64_t now, next_attempt, deadline;
+
+    dlog("connect: %s port %d / bindIP=%s", host, port, bindIP);
+
+    struct sockaddr_storage bind_addr;
+    struct sockaddr_storage* bind_saddr = NULL;
+    if (bindIP && bindIP[0] && net_sock_addr(bindIP, &bind_addr)) {
+        bind_saddr = &bind_addr;
     }
 
-    if (!set_nonblock(sock, 0)) {
-    ERROR_OUT:
-        net_close(sock);
+    count = net_resolve(host, addrs, MAX_CANDIDATES);
+    if (count <= 0)
         return INVALID_SOCKET;
-    }
 
-    return sock;
-}
+    for (int i = 0; i < count; i++)
+        socks[i] = INVALID_SOCKET;
+
+    now = now_ms();
+    next_attempt = now;
+    deadline = now + CONNECT_TIMEOUT_MS;
+
+    while (sock == INVALID_SOCKET) {
+        now = now_ms();
+
+        // Start the next attempt once the delay has passed,
+        // or right away when nothing else is in flight
+        if (next < count && (now >= next_attempt || pending == 0)) {
+            socks[next] = net_connect_start(&addrs[next], bind_saddr, port);
+            if (socks[next] != INVALID_SOCKET) {
+                pending++;
+                deadline = now + CONNECT_TIMEOUT_MS;
+            }
+            next++;
+            next_attempt = now + CONNECTION_ATTEMPT_DELAY_MS;
+            continue;
+        }
 
-socket_t
-net_connect(const char* host, const char* bindIP, uint16_t port) {
-    dlog("connect: %s port %d / bindIP=%s", host, port, bindIP);
+        if (pending == 0 || now >= deadline || net_cancelled(cancel))
+            break;
+
+        fd_set rset, wset, eset;
+        socket_t maxfd = 0;
+        FD_ZERO(&rset);
+        FD_ZERO(&wset);
+        FD_ZERO(&eset);
+        if (cancel && cancel->rd != INVALID_SOCKET) {
+            FD_SET(cancel->rd, &rset);
+            maxfd = cancel->rd;
+        }
+        for (int i = 0; i < next; i++) {
+            if (socks[i] == INVALID_SOCKET)
+                continue;
 
-    struct sockaddr* bind_saddr = NULL;
-    if (bindIP && bindIP[0]) {
-        bind_saddr = net_sock_addr(bindIP);
+            FD_SET(socks[i], &wset);
+            FD_SET(socks[i], &eset);
+            if (socks[i] > maxfd) maxfd = socks[i];
+        }
+
+        uint64_t wake = (next < count && next_attempt < deadline) ? next_attempt : deadline;
+        uint64_t wait = wake > now ? wake - now : 0;
+        struct timeval timeout;
+        timeout.tv_sec = (long) (wait / 1000);
+        timeout.tv_usec = (long) (wait % 1000) * 1000;
+
+        int rc = select((int) maxfd + 1, &rset, &wset, &eset, &timeout);
+        if (rc < 0) {
+            WSAErrno();
+            elog("connect failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; rc > 0 && i < next; i++) {
+            if (socks[i] == INVALID_SOCKET)
+                continue;
+
+            if (!FD_ISSET(socks[i], &wset) && !FD_ISSET(socks[i], &eset))
+                continue;
+
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(socks[i], SOL_SOCKET, SO_ERROR, (char*) &err, &len) == 0
+                && err == 0 && FD_ISSET(socks[i], &wset))
+            {
+                sock = socks[i];
+                socks[i] = INVALID_SOCKET;
+                break;
+            }
+
+            dlog("connect failed: %s", strerror(err));
+            net_close(socks[i]);
+            socks[i] = INVALID_SOCKET;
+            pending--;
+
+            // Don't wait out the delay, try the next address now
+            next_attempt = now;
+        }
     }
 
-    struct addrinfo hints = {0}, *addr = 0, *addrs = 0;
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
+    for (int i = 0; i < next; i++) {
+        if (socks[i] != INVALID_SOCKET)
+            net_close(socks[i]);
+    }
 
-    if (getaddrinfo(host, NULL, &hints, &addrs) != 0) {
-        WSAErrno();
-        elog("getaddrinfo failed (%d): %s", errno, strerror(errno));
+    if (sock == INVALID_SOCKET) {
+        if (net_cancelled(cancel)) {
+            dlog("connect: cancelled");
+            return INVALID_SOCKET;
+        }
+
+        // Resolve again next time, the host may have moved
+        addr_cache_forget(host);
         return INVALID_SOCKET;
     }
 
-    addr = addrs;
-    do {
-        socket_t sock = net_connect(addr, bind_saddr, port);
-        if (sock != INVALID_SOCKET) {
-            set_recv_timeout(sock, 5);
-            return sock;
-        }
-    } while ((addr = addr->ai_next) != NULL);
+    if (!set_nonblock(sock, 0)) {
+        net_close(sock);
+        return INVALID_SOCKET;
+    }
 
-    freeaddrinfo(addrs);
-    return INVALID_SOCKET;
+    set_recv_timeout(sock, RECV_TIMEOUT_MS / 1000);
+    return sock;
 }
 
 ssize_t
@@ -292,6 +483,46 @@ net_recv_peek(socket_t sock) {
     return recv(sock, buf, 1, MSG_PEEK);
 }
 
+int
+net_wait_readable(const socket_t *socks, int count, int timeout_ms, const struct net_cancel *cancel) {
+    struct pollfd fds[9];
+    int i, nfds = count, ready = 0;
+
+    if (count <= 0 || count > 8)
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        fds[i].fd = socks[i];
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+    }
+
+    if (cancel && cancel->rd != INVALID_SOCKET) {
+        fds[nfds].fd = cancel->rd;
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+    }
+
+    if (poll(fds, nfds, timeout_ms) < 0) {
+        WSAErrno();
+        if (errno == EINTR && !net_cancelled(cancel))
+            return 0;
+
+        elog("poll(): %s", strerror(errno));
+        return -1;
+    }
+
+    if (net_cancelled(cancel))
+        return -1;
+
+    for (i = 0; i < count; i++)
+        if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            ready |= 1 << i;
+
+    return ready;
+}
+
 ssize_t
 net_recv_all(socket_t sock, void *buf, size_t len) {
 #if _WIN32
@@ -301,6 +532,32 @@ net_recv_all(socket_t sock, void *buf, size_t len) {
 #endif
 }
 
+ssize_t
+net_recv_all(socket_t sock, void *buf, size_t len, const struct net_cancel *cancel) {
+    char *ptr = (char*) buf;
+    size_t got = 0;
+
+    if (!cancel)
+        return net_recv_all(sock, buf, len);
+
+    while (got < len) {
+        int ready = net_wait_readable(&sock, 1, RECV_TIMEOUT_MS, cancel);
+        if (ready <= 0)
+            return -1;
+
+        ssize_t r = net_recv(sock, ptr + got, len - got);
+        if (r <= 0) {
+            WSAErrno();
+            if (r < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+                continue;
+            return got ? (ssize_t) got : r;
+        }
+        got += r;
+    }
+
+    return (ssize_t) got;
+}
+
 ssize_t
 net_send(socket_t sock, const void *buf, size_t len) {
 #if _WIN32
@@ -326,6 +583,13 @@ net_send_all(socket_t sock, const void *buf, size_t len) {
     return 1;
 }
 
+// Wake up whoever is blocked on sock, the owner still closes it
+void
+net_shutdown(socket_t sock)
+{
+    shutdown(sock, SHUT_RDWR);
+}
+
 void
 net_close(socket_t sock)
 {
@@ -337,6 +601,97 @@ net_close(socket_t sock)
 #endif
 }
 
+bool
+net_cancel_init(struct net_cancel *cancel) {
+    cancel->fired = false;
+#ifdef _WIN32
+    // No pipes in select/WSAPoll, pair up two loopback sockets instead
+    socket_t server = net_listen(localhost_ip, 0);
+    if (server == INVALID_SOCKET)
+        return false;
+
+    cancel->wr = net_connect(localhost_ip, (uint16_t) net_listen_port(server));
+    cancel->rd = INVALID_SOCKET;
+    if (cancel->wr != INVALID_SOCKET) {
+        const socket_t fds[1] = {server};
+        if (net_wait_readable(fds, 1, CONNECT_TIMEOUT_MS) > 0)
+            cancel->rd = net_accept(server);
+    }
+    net_close(server);
+
+    if (cancel->rd == INVALID_SOCKET) {
+        elog("cancel token: socket pair failed");
+        net_cancel_free(cancel);
+        return false;
+    }
+#else
+    int fds[2];
+    if (pipe(fds) < 0) {
+        elog("pipe(): %s", strerror(errno));
+        return false;
+    }
+    cancel->rd = fds[0];
+    cancel->wr = fds[1];
+    fcntl(cancel->rd, F_SETFD, FD_CLOEXEC);
+    fcntl(cancel->wr, F_SETFD, FD_CLOEXEC);
+#endif
+    return true;
+}
+
+void
+net_cancel_free(struct net_cancel *cancel) {
+#ifdef _WIN32
+    if (cancel->rd != INVALID_SOCKET) net_close(cancel->rd);
+    if (cancel->wr != INVALID_SOCKET) net_close(cancel->wr);
+#else
+    if (cancel->rd != INVALID_SOCKET) close(cancel->rd);
+    if (cancel->wr != INVALID_SOCKET) close(cancel->wr);
+#endif
+    cancel->rd = INVALID_SOCKET;
+    cancel->wr = INVALID_SOCKET;
+}
+
+void
+net_cancel_fire(struct net_cancel *cancel) {
+    if (cancel->fired.exchange(true))
+        return;
+
+    // Never read back, the read end stays readable from now on
+    const char c = 0;
+#ifdef _WIN32
+    if (cancel->wr != INVALID_SOCKET) send(cancel->wr, &c, 1, 0);
+#else
+    if (cancel->wr != INVALID_SOCKET && write(cancel->wr, &c, 1) < 0)
+        elog("cancel token: write(): %s", strerror(errno));
+#endif
+}
+
+bool
+net_cancel_sleep(const struct net_cancel *cancel, int ms) {
+    if (!cancel || cancel->rd == INVALID_SOCKET) {
+        if (net_cancelled(cancel))
+            return false;
+        os_sleep_ms(ms);
+        return !net_cancelled(cancel);
+    }
+
+    struct pollfd fd;
+    uint64_t deadline = now_ms() + ms;
+    fd.fd = cancel->rd;
+    fd.events = POLLIN;
+    for (;;) {
+        if (net_cancelled(cancel))
+            return false;
+
+        uint64_t now = now_ms();
+        if (now >= deadline)
+            return true;
+
+        fd.revents = 0;
+        poll(&fd, 1, (int) (deadline - now));
+    }
+}
+
 bool
 net_init(void) {
 #ifdef _WIN32
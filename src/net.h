@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <atomic>
 
 #ifdef _WIN32
   #include <winsock2.h>
@@ -19,16 +20,37 @@
   typedef int socket_t;
 #endif
 
+// Cancels blocking network waits. Once fired it stays fired, and every wait
+// that was handed the token returns early. The read end of a pipe (a loopback
+// socket pair on Windows) becomes readable on fire, so it can sit in the same
+// poll/select as the sockets being waited on.
+struct net_cancel {
+    socket_t rd;
+    socket_t wr;
+    std::atomic<bool> fired;
+    net_cancel() : rd(INVALID_SOCKET), wr(INVALID_SOCKET), fired(false) {}
+};
+
+bool net_cancel_init(struct net_cancel *cancel);
+void net_cancel_free(struct net_cancel *cancel);
+void net_cancel_fire(struct net_cancel *cancel);
+
+static inline bool
+net_cancelled(const struct net_cancel *cancel) {
+    return cancel && cancel->fired.load();
+}
+
+// Sleep up to ms, returns false if the token fired
+bool net_cancel_sleep(const struct net_cancel *cancel, int ms);
+
 bool net_init(void);
 void net_cleanup(void);
 void net_close(socket_t sock);
+void net_shutdown(socket_t sock);
 socket_t net_accept(socket_t sock);
 
 socket_t
-net_connect(struct addrinfo *addr, struct sockaddr* bind_saddr, uint16_t port);
-
-socket_t
-net_connect(const char* host, const char* bindIP, uint16_t port);
+net_connect(const char* host, const char* bindIP, uint16_t port, const struct net_cancel *cancel = NULL);
 
 inline socket_t
 net_connect(const char* host, uint16_t port) { return net_connect(host, NULL, port); }
@@ -48,12 +70,23 @@ net_recv_peek(socket_t sock);
 ssize_t
 net_recv_all(socket_t sock, void *buf, size_t len);
 
+// Same, but waits in poll so the token can cut it short (returns -1).
+// Gives up after 5 s without data, same as the socket timeout net_connect() sets.
+ssize_t
+net_recv_all(socket_t sock, void *buf, size_t len, const struct net_cancel *cancel);
+
 ssize_t
 net_send(socket_t sock, const void *buf, size_t len);
 
 ssize_t
 net_send_all(socket_t sock, const void *buf, size_t len);
 
+// Wait for data (or a close) on any of the sockets.
+// Returns a bitmask of the ready ones, 0 on timeout, -1 on error or when
+// the token fired.
+int
+net_wait_readable(const socket_t *socks, int count, int timeout_ms, const struct net_cancel *cancel = NULL);
+
 int
 set_recv_timeout(socket_t sock, int tv_sec);
 
@@ -63,5 +96,5 @@ set_recv_buf_len(socket_t sock, int len);
 bool
 set_nonblock(socket_t sock, int nonblock);
 
-struct sockaddr*
-net_sock_addr(const char* host);
+bool
+net_sock_addr(const char* host, struct sockaddr_storage* saddr);
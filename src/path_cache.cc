@@ -0,0 +1,116 @@
+/*
+Copyright (C) 2023 DEV47APPS, github.com/dev47apps
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "path_cache.h"
+
+#define MAX_PATHS 32
+
+struct path_entry {
+    struct cached_path path;
+    uint64_t used;
+};
+
+static std::mutex cache_lock;
+static std::unordered_map<std::string, path_entry> cache;
+static uint64_t cache_seq;
+
+static void path_read(obs_data_t *data, struct cached_path *path) {
+    memset(path, 0, sizeof(*path));
+    path->type = (DeviceType) obs_data_get_int(data, "type");
+    strncpy(path->host, obs_data_get_string(data, "host"), sizeof(path->host) - 1);
+    path->port = (int) obs_data_get_int(data, "port");
+}
+
+void path_cache_load(obs_data_t *config) {
+    obs_data_t *paths = obs_data_get_obj(config, "paths");
+    if (!paths)
+        return;
+
+    std::lock_guard<std::mutex> lock(cache_lock);
+    for (obs_data_item_t *item = obs_data_first(paths); item; obs_data_item_next(&item)) {
+        obs_data_t *data = obs_data_item_get_obj(item);
+        if (!data)
+            continue;
+
+        path_entry entry;
+        path_read(data, &entry.path);
+        entry.used = ++cache_seq;
+        obs_data_release(data);
+
+        if (entry.path.type != DeviceType::NONE && entry.path.port > 0)
+            cache[obs_data_item_get_name(item)] = entry;
+    }
+
+    dlog("path cache: %lu devices", cache.size());
+    obs_data_release(paths);
+}
+
+bool path_cache_get(const char *id, struct cached_path *path) {
+    std::lock_guard<std::mutex> lock(cache_lock);
+    auto it = cache.find(id);
+    if (it == cache.end())
+        return false;
+
+    *path = it->second.path;
+    return true;
+}
+
+// Called with cache_lock held
+static void path_cache_save(void) {
+    obs_data_t *paths = obs_data_create();
+    for (auto &it : cache) {
+        const struct cached_path *path = &it.second.path;
+        obs_data_t *data = obs_data_create();
+        obs_data_set_int(data, "type", (long long) path->type);
+        obs_data_set_string(data, "host", path->host);
+        obs_data_set_int(data, "port", path->port);
+        obs_data_set_obj(paths, it.first.c_str(), data);
+        obs_data_release(data);
+    }
+
+    module_config_save("paths", paths);
+    obs_data_release(paths);
+}
+
+void path_cache_put(const char *id, const struct cached_path *path) {
+    std::lock_guard<std::mutex> lock(cache_lock);
+    auto it = cache.find(id);
+    if (it != cache.end()) {
+        it->second.used = ++cache_seq;
+        const struct cached_path *old = &it->second.path;
+        if (old->type == path->type && strcmp(old->host, path->host) == 0
+            && old->port == path->port)
+            return;
+    }
+    else if (cache.size() >= MAX_PATHS) {
+        auto oldest = cache.begin();
+        for (auto i = cache.begin(); i != cache.end(); i++)
+            if (i->second.used < oldest->second.used) oldest = i;
+        cache.erase(oldest);
+    }
+
+    path_entry &entry = cache[id];
+    entry.path = *path;
+    entry.used = ++cache_seq;
+
+    dlog("path cache: %s -> %s:%d (type=%d)", id, path->host, path->port, (int) path->type);
+    path_cache_save();
+}
@@ -0,0 +1,20 @@
+// Copyright (C) 2023 DEV47APPS, github.com/dev47apps
+#pragma once
+#include "plugin.h"
+#include "source.h"
+
+// The last connection path that worked for each device, kept in config.json
+// so a source that comes up activated can try it while discovery runs.
+struct cached_path {
+    DeviceType type;
+    char host[64];  // mDNS address, or localhost for an ADB forward
+    int port;       // advertised port, or the local end of the ADB forward
+};
+
+// Read the "paths" object of the module config, at module load
+void path_cache_load(obs_data_t *config);
+
+bool path_cache_get(const char *id, struct cached_path *path);
+
+// Remember a working path, config.json is only written when it changed
+void path_cache_put(const char *id, const struct cached_path *path);
@@ -39,9 +39,14 @@ AddDevice* addDevUI = NULL;
 
 #endif /* ENABLE_GUI */
 
+#include <mutex>
+#include <util/platform.h>
 #include "plugin.h"
 #include "source.h"
 #include "plugin_properties.h"
+#include "decoder.h"
+#include "path_cache.h"
+#include "model_cache.h"
 
 const char* bindIP = NULL;
 char os_name_version[64];
@@ -73,6 +78,51 @@ static const char *plugin_getname(void *data) {
     #endif
 }
 
+// Module wide settings, from config.json in the plugin config directory
+static void load_module_config(void) {
+    char *path = obs_module_config_path("config.json");
+    if (!path)
+        return;
+
+    obs_data_t *config = obs_data_create_from_json_file_safe(path, "bak");
+    bfree(path);
+    if (!config)
+        return;
+
+    long long memory_limit_mb = obs_data_get_int(config, "memory_limit_mb");
+    if (memory_limit_mb > 0)
+        packet_budget_set_limit((size_t) memory_limit_mb << 20);
+
+    path_cache_load(config);
+    model_cache_load(config);
+    obs_data_release(config);
+}
+
+void module_config_save(const char *key, obs_data_t *value) {
+    static std::mutex save_lock;
+    std::lock_guard<std::mutex> lock(save_lock);
+
+    char *file = obs_module_config_path("config.json");
+    if (!file)
+        return;
+
+    // Other settings share the file, keep them
+    obs_data_t *config = obs_data_create_from_json_file_safe(file, "bak");
+    if (!config) {
+        char *dir = obs_module_config_path("");
+        if (dir) os_mkdirs(dir);
+        bfree(dir);
+        config = obs_data_create();
+    }
+
+    obs_data_set_obj(config, key, value);
+    if (!obs_data_save_json_safe(config, file, "tmp", "bak"))
+        elog("could not save %s", file);
+
+    obs_data_release(config);
+    bfree(file);
+}
+
 #if ENABLE_GUI
 static inline void swap_bindIP() {
     config_t *obs_config_profile = obs_frontend_get_profile_config();
@@ -108,6 +158,8 @@ bool obs_module_load(void) {
         return false;
     }
 
+    load_module_config();
+
     droidcam_obs_info.id           = "droidcam_obs";
     droidcam_obs_info.type         = OBS_SOURCE_TYPE_INPUT;
     droidcam_obs_info.output_flags = OBS_SOURCE_DO_NOT_DUPLICATE | OBS_SOURCE_AUDIO | OBS_SOURCE_ASYNC_VIDEO;
@@ -24,3 +24,6 @@ void droidcam_signal(obs_source_t* source, const char* signal);
 #endif
 
 void get_os_name_version(char *, size_t);
+
+// Replace one object in the module's config.json, keeping the other settings
+void module_config_save(const char *key, obs_data_t *value);
@@ -4,6 +4,7 @@
 #define OPT_WIFI_IP           "wifi_ip"
 #define OPT_APP_PORT          "app_port"
 #define OPT_RESOLUTION        "resolution"
+#define OPT_AUTO_RESOLUTION   "auto_resolution"
 #define OPT_VIDEO_FORMAT      "video_format"
 #define OPT_CONNECT           "connect"
 #define OPT_REFRESH           "refresh"
@@ -19,10 +20,17 @@
 #define OPT_ACTIVE_DEV_TYPE   "cur_dev_type"
 #define OPT_UHD_UNLOCK        "uhd_unlock"
 #define OPT_DUMMY_SOURCE      "dummy_source"
+#define OPT_STATS             "stats"
+#define OPT_STATS_TEXT        "stats_text"
+#define OPT_STATS_REFRESH     "stats_refresh"
+#define OPT_RECORD            "record"
+#define OPT_RECORD_PATH       "record_path"
+#define OPT_RECORD_FORMAT     "record_format"
 
 #define TEXT_DEVICE         obs_module_text("Device")
 #define TEXT_REFRESH        obs_module_text("Refresh")
 #define TEXT_RESOLUTION     obs_module_text("Resolution")
+#define TEXT_AUTO_RESOLUTION obs_module_text("AutoResolution")
 #define TEXT_VIDEO_FORMAT   obs_module_text("VideoFormat")
 #define TEXT_CONNECT        obs_module_text("Activate")
 #define TEXT_DEACTIVATE     obs_module_text("Deactivate")
@@ -31,10 +39,15 @@
 #define TEXT_ENABLE_AUDIO   obs_module_text("EnableAudio")
 #define TEXT_SYNC_AV        obs_module_text("SyncAV")
 #define TEXT_USE_HW_ACCEL   obs_module_text("AllowHWAccel")
+#define TEXT_STATS          obs_module_text("Stats")
+#define TEXT_STATS_REFRESH  obs_module_text("RefreshStats")
+#define TEXT_RECORD         obs_module_text("Record")
+#define TEXT_RECORD_PATH    obs_module_text("RecordPath")
+#define TEXT_RECORD_FORMAT  obs_module_text("RecordFormat")
 
 #define PING_REQ "GET /ping"
-#define BATT_REQ "GET /battery HTTP/1.1\r\n\r\n"
-#define TALLY_REQ "PUT /v1/tally/%s/ HTTP/1.1\r\n\r\n"
+#define BATT_PATH "/battery"
+#define TALLY_PATH "/v1/tally/%s/"
 #define AUDIO_REQ "GET /v1/audio.2"
 #define VIDEO_REQ "GET /v4/video/%s/%s/port/%d/os/%s/obs/%s/client/%s/nonce/%d/"
 
@@ -16,6 +16,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #ifndef _WIN32
 # include <sys/select.h>
+# include <sys/socket.h>
 #endif
 #include <util/platform.h>
 #if defined(TEST)
@@ -23,11 +24,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #endif
 
 #include <vector>
+#ifdef TEST
+#include <deque>
+#endif
 
 #include "plugin.h"
 #include "plugin_properties.h"
 #include "net.h"
 #include "device_discovery.h"
+#include "usbmux.h"
 
 void *proxy_run(void *data);
 
@@ -38,18 +43,25 @@ Proxy::Proxy(DeviceDiscovery* device_discovery) {
     proxy_device = NULL;
     proxy_sock = INVALID_SOCKET;
     discovery_mgr = device_discovery;
+#ifdef TEST
+    impair = NULL;
+    remote_host[0] = 0;
+#endif
+    net_cancel_init(&cancel);
 }
 
 Proxy::~Proxy() {
     if (thread_active) {
         thread_active = 0;
+        net_cancel_fire(&cancel);
         pthread_join(pthr, NULL);
         net_close(proxy_sock);
     }
+    net_cancel_free(&cancel);
 }
 
-int Proxy::Start(Device *dev, int remote_port) {
-    proxy_device = dev;
+int Proxy::Start(DeviceRef dev, int remote_port) {
+    std::atomic_store(&proxy_device, dev);
     port_remote = remote_port;
 
     if (thread_active == 0) {
@@ -72,14 +84,177 @@ int Proxy::Start(Device *dev, int remote_port) {
     return port_local;
 }
 
+#ifdef TEST
+struct proxy_chunk {
+    uint64_t due;
+    std::vector<uint8_t> data;
+};
+
+// One direction of an impaired connection
+struct proxy_link {
+    std::deque<proxy_chunk> queue;
+    uint64_t last_due;  // keeps the chunks in order
+    uint64_t free_at;   // when the rate limited link is idle again
+    proxy_link() : last_due(0), free_at(0) {}
+};
+#endif
+
 struct proxy_conn {
     socket_t client;
     socket_t remote;
+#ifdef TEST
+    proxy_link up;      // client to remote
+    proxy_link down;    // remote to client
+    bool closing;       // got an EOF, sending what's left
+#endif
     proxy_conn(socket_t c, socket_t r) {
         client = c; remote = r;
+#ifdef TEST
+        closing = false;
+#endif
     }
 };
 
+#ifdef TEST
+void Impairment::Stall(int ms) {
+    stall_until = os_gettime_ns() + (uint64_t) ms * 1000000;
+}
+
+void Impairment::Reset(void) {
+    resets++;
+}
+
+bool Impairment::Set(const char* script) {
+    char key[16];
+    int value, n;
+    const char *p = script, *at = script;
+
+    while (*p) {
+        if (*p == ' ' || *p == ',') {
+            p++;
+            continue;
+        }
+
+        at = p;
+        if (sscanf(p, "%15[a-z]%n", key, &n) != 1)
+            goto fail;
+
+        p += n;
+        value = 0;
+        if (*p == '=') {
+            if (sscanf(p + 1, "%d%n", &value, &n) != 1)
+                goto fail;
+            p += n + 1;
+        }
+
+        if      (strcmp(key, "latency") == 0) latency_ms = value;
+        else if (strcmp(key, "jitter") == 0)  jitter_ms = value;
+        else if (strcmp(key, "rate") == 0)    rate_kbps = value;
+        else if (strcmp(key, "seed") == 0)    seed = (uint32_t) value;
+        else if (strcmp(key, "stall") == 0)   Stall(value);
+        else if (strcmp(key, "reset") == 0)   Reset();
+        else goto fail;
+    }
+
+    dlog("impair: %s", script);
+    return true;
+
+fail:
+    elog("impair: bad script at \"%s\"", at);
+    return false;
+}
+
+static uint32_t impair_rand(Impairment *impair) {
+    uint32_t seed = impair->seed, x;
+    do {
+        x = seed ? seed : 1;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+    } while (!impair->seed.compare_exchange_weak(seed, x));
+    return x;
+}
+
+// Hold a chunk until it would come out the other end of the link
+static void impair_queue(Impairment *impair, proxy_link *link, const uint8_t *buf, size_t len, uint64_t now) {
+    int64_t delay = (int64_t) impair->latency_ms * 1000000;
+    int jitter = impair->jitter_ms;
+    if (jitter > 0)
+        delay += ((int64_t) (impair_rand(impair) % (2 * jitter + 1)) - jitter) * 1000000;
+    if (delay < 0)
+        delay = 0;
+
+    uint64_t sent = now;
+    int rate = impair->rate_kbps;
+    if (rate > 0) {
+        sent = link->free_at > now ? link->free_at : now;
+        sent += (uint64_t) len * 8 * 1000000 / rate;
+        link->free_at = sent;
+    }
+
+    uint64_t due = sent + delay;
+    if (due < link->last_due)
+        due = link->last_due;
+    link->last_due = due;
+
+    proxy_chunk chunk;
+    chunk.due = due;
+    chunk.data.assign(buf, buf + len);
+    link->queue.push_back(std::move(chunk));
+}
+
+// Send what's due, false when the connection is gone
+static bool impair_flush(Impairment *impair, proxy_link *link, socket_t to, uint64_t now, uint64_t *wake) {
+    uint64_t stall_until = impair->stall_until;
+    if (now < stall_until) {
+        if (stall_until < *wake) *wake = stall_until;
+        return true;
+    }
+
+    while (!link->queue.empty()) {
+        proxy_chunk &chunk = link->queue.front();
+        if (chunk.due > now) {
+            if (chunk.due < *wake) *wake = chunk.due;
+            break;
+        }
+
+        if (net_send_all(to, chunk.data.data(), chunk.data.size()) <= 0)
+            return false;
+
+        link->queue.pop_front();
+    }
+    return true;
+}
+
+// Close with an RST rather than a FIN
+static void impair_reset(socket_t sock) {
+    struct linger lg;
+    lg.l_onoff = 1;
+    lg.l_linger = 0;
+    setsockopt(sock, SOL_SOCKET, SO_LINGER, (const char*) &lg, sizeof(lg));
+}
+#endif
+
+static inline bool proxy_impaired(Proxy *proxy) {
+#ifdef TEST
+    return proxy->impair != NULL;
+#else
+    return false;
+#endif
+}
+
+// Pass data on, through the impaired link in test builds
+static inline ssize_t
+proxy_send(Proxy *proxy, struct proxy_conn *conn, bool up, const uint8_t *buf, size_t len) {
+#ifdef TEST
+    if (proxy->impair) {
+        impair_queue(proxy->impair, up ? &conn->up : &conn->down, buf, len, os_gettime_ns());
+        return (ssize_t) len;
+    }
+#endif
+    return net_send_all(up ? conn->remote : conn->client, buf, len);
+}
+
 #define BUF_SIZE 32768
 #ifdef DEBUG
 #define vlog dlog
@@ -91,6 +266,10 @@ void* proxy_run(void *data) {
     fd_set set;
     std::vector<struct proxy_conn*> list;
     Proxy *proxy = (Proxy*) data;
+#ifdef TEST
+    uint64_t wake = UINT64_MAX;
+    int resets = proxy->impair ? proxy->impair->resets.load() : 0;
+#endif
 
     auto buffer = (uint8_t*) bmalloc(BUF_SIZE);
     FD_ZERO(&set);
@@ -101,29 +280,33 @@ void* proxy_run(void *data) {
         socket_t client = net_accept(proxy->proxy_sock);
 
         if (client != INVALID_SOCKET) {
-            // todo: make connect function generic, usbmux hacked in here for now
-            #ifdef _WIN32
-            auto usbmux = (USBMux*) proxy->discovery_mgr;
-            int rc = usbmux->usbmuxd_connect(
-                (uint32_t) proxy->proxy_device->handle,
-                (short) proxy->port_remote);
+            DeviceRef device = std::atomic_load(&proxy->proxy_device);
+            socket_t remote;
 
-            #elif __linux__
-            int rc = usbmuxd_connect(
-                (uint32_t) proxy->proxy_device->handle,
-                (short) proxy->port_remote);
+            #ifdef TEST
+            if (proxy->remote_host[0]) {
+                remote = net_connect(proxy->remote_host, NULL,
+                    (uint16_t) proxy->port_remote, &proxy->cancel);
+            }
+            else
+            #endif
+            {
+            // todo: make connect function generic, usbmux hacked in here for now
+            #if defined(_WIN32) || defined(__linux__)
+            remote = usbmux_connect(device->handle,
+                (uint16_t) proxy->port_remote, &proxy->cancel);
 
             #elif __APPLE__
-            int rc = net_connect(
-                (const char*) proxy->proxy_device->address,
+            remote = net_connect(
+                (const char*) device->address,
                 proxy->port_remote);
 
             #else
             #error Unknown System
             #endif
+            }
 
-            if (rc > 0) {
-                socket_t remote = rc;
+            if (remote != INVALID_SOCKET) {
                 vlog("proxy: %llu <==> %llu created", client, remote);
                 set_nonblock(remote, 1);
                 set_recv_timeout(remote, 1);
@@ -139,17 +322,35 @@ void* proxy_run(void *data) {
         }
 
         if (list.size() == 0) {
-            os_sleep_ms(5);
+            // Nothing to relay, wait for the next client
+            const socket_t listening[1] = {proxy->proxy_sock};
+            net_wait_readable(listening, 1, 256, &proxy->cancel);
             continue;
         }
 
         fd_set read_fds = set;
+        if (proxy->cancel.rd != INVALID_SOCKET)
+            FD_SET(proxy->cancel.rd, &read_fds);
+
         struct timeval timeout;
         timeout.tv_sec = 0;
         timeout.tv_usec = 256000;
+#ifdef TEST
+        // Wake up for the next impaired chunk that's due
+        if (wake != UINT64_MAX) {
+            uint64_t now = os_gettime_ns();
+            uint64_t us = wake > now ? (wake - now) / 1000 : 0;
+            if (us < (uint64_t) timeout.tv_usec)
+                timeout.tv_usec = (long) us;
+        }
+#endif
         int rc = select(FD_SETSIZE, &read_fds, NULL, NULL, &timeout);
-        if (rc == 0)
-            continue;
+        if (rc == 0) {
+            if (!proxy_impaired(proxy))
+                continue;
+
+            FD_ZERO(&read_fds);
+        }
 
         if (rc < 0) {
             WSAErrno();
@@ -160,29 +361,66 @@ void* proxy_run(void *data) {
 
         vlog("select: %d read_fds", rc);
 
+#ifdef TEST
+        bool reset = false;
+        uint64_t now = os_gettime_ns();
+        wake = UINT64_MAX;
+        if (proxy->impair && proxy->impair->resets != resets) {
+            resets = proxy->impair->resets;
+            reset = true;
+        }
+#endif
+
         //auto size = list.size();
         auto i = std::begin(list);
         while (i != std::end(list)) {
-            int err = 0;
+            int err = 0, eof = 0;
             auto elem = *i;
 
             if (FD_ISSET(elem->client, &read_fds)) {
                 ssize_t r =         net_recv (elem->client, buffer, BUF_SIZE);
-                ssize_t s = r > 0 ? net_send_all(elem->remote, buffer, r) : 0;
-                if (r <= 0 || s <= 0) err = 1;
+                ssize_t s = r > 0 ? proxy_send(proxy, elem, true, buffer, r) : 0;
+                if (r == 0) eof = 1;
+                else if (r < 0 || s <= 0) err = 1;
                 vlog("proxy: %llu  ==> %llu // r=%ld s=%ld err=%d",
                     elem->client, elem->remote, r, s, err);
             }
 
             if (FD_ISSET(elem->remote, &read_fds)) {
                 ssize_t r =         net_recv (elem->remote, buffer, BUF_SIZE);
-                ssize_t s = r > 0 ? net_send_all(elem->client, buffer, r) : 0;
-                if (r <= 0 || s <= 0) err = 1;
+                ssize_t s = r > 0 ? proxy_send(proxy, elem, false, buffer, r) : 0;
+                if (r == 0) eof = 1;
+                else if (r < 0 || s <= 0) err = 1;
                 vlog("proxy: %llu <==  %llu // r=%ld s=%ld err=%d",
                     elem->client, elem->remote, r, s, err);
             }
 
-            if (err) {
+#ifdef TEST
+            if (reset) {
+                vlog("proxy: %llu <==> %llu reset", elem->client, elem->remote);
+                impair_reset(elem->client);
+                impair_reset(elem->remote);
+                err = 1;
+            }
+            else if (!err && proxy->impair) {
+                // A clean EOF still delivers what the link holds, a reset doesn't
+                if (eof && !elem->closing) {
+                    vlog("proxy: %llu <==> %llu draining", elem->client, elem->remote);
+                    elem->closing = true;
+                    FD_CLR(elem->client, &set);
+                    FD_CLR(elem->remote, &set);
+                }
+                eof = 0;
+
+                if (!impair_flush(proxy->impair, &elem->up, elem->remote, now, &wake)
+                    || !impair_flush(proxy->impair, &elem->down, elem->client, now, &wake))
+                    err = 1;
+                else if (elem->closing && elem->up.queue.empty() && elem->down.queue.empty())
+                    err = 1;
+            }
+#endif
+
+            if (err || eof) {
                 vlog("proxy: %llu <==> %llu close", elem->client, elem->remote);
                 i = list.erase(i);
                 net_close(elem->client);
@@ -0,0 +1,312 @@
+/*
+Copyright (C) 2023 DEV47APPS, github.com/dev47apps
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+
+extern "C" {
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable : 4244)
+#pragma warning(disable : 4204)
+#endif
+
+#include <libavformat/avformat.h>
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+}
+
+#include "plugin.h"
+#include "decoder.h"
+#include "recorder.h"
+
+#define AUDIO_WAIT_US (2 * 1000000) // video to hold back while waiting for audio
+#define US_TIME_BASE  AVRational{1, 1000000}
+
+void *recorder_thread(void *data);
+
+Recorder::Recorder() : tap(TAP_VIDEO | TAP_AUDIO, MAX_QUEUED), running(false),
+    want_audio(false), failed(false), ctx(NULL), audio_index(-1),
+    base_pts(0), packets(0), dropped(0)
+{
+    file[0] = 0;
+}
+
+bool Recorder::Start(const char *path, bool audio) {
+    Stop();
+
+    strncpy(file, path, sizeof(file) - 1);
+    file[sizeof(file) - 1] = 0;
+    want_audio = audio;
+    failed = false;
+    audio_index = -1;
+    video_config.clear();
+    audio_config.clear();
+    pending.clear();
+    last_dts[0] = last_dts[1] = -1;
+    packets = 0;
+    dropped = 0;
+    tap.Reset();
+
+    if (pthread_create(&thr, NULL, recorder_thread, this) != 0) {
+        elog("recording: error creating thread");
+        return false;
+    }
+
+    running = true;
+    ilog("recording: %s", file);
+    return true;
+}
+
+void Recorder::Stop(void) {
+    if (!running)
+        return;
+
+    running = false;
+    tap.Close();
+    pthread_join(thr, NULL);
+}
+
+void *recorder_thread(void *data) {
+    Recorder *rec = (Recorder*) data;
+    TapPacket tp;
+
+    // Whatever is still queued after Close() gets written out too
+    while (rec->tap.Next(&tp, 0)) {
+        if (!rec->Process(tp))
+            packet_unref(tp.packet);
+    }
+
+    rec->Close();
+    return NULL;
+}
+
+static void pending_clear(std::deque<TapPacket> &pending) {
+    while (!pending.empty()) {
+        packet_unref(pending.front().packet);
+        pending.pop_front();
+    }
+}
+
+// Returns true when the packet was kept in pending
+bool Recorder::Process(const TapPacket &tp) {
+    const DataPacket *packet = tp.packet;
+    if (failed || strcmp(tp.codec, "mjpeg") == 0)
+        return false;
+
+    if (tp.stream == TAP_AUDIO && !want_audio)
+        return false;
+
+    if (tp.config) {
+        if (audio_config.empty() && packet->used >= 2)
+            audio_config.assign(packet->data, packet->data + 2);
+        return false;
+    }
+
+    if (ctx) {
+        Write(tp);
+        return false;
+    }
+
+    // The header needs the codec configs, hold on to the packets until then
+    if (tp.stream == TAP_VIDEO && video_config.empty()) {
+        uint8_t sets[1024];
+        size_t len = h264_parameter_sets(packet->data, packet->used, sets, sizeof(sets));
+        if (len == 0 || !tp.key) {
+            dropped++;
+            return false;
+        }
+
+        video_config.assign(sets, sets + len);
+        base_pts = packet->pts;
+    }
+
+    if (video_config.empty())
+        return false;
+
+    pending.push_back(tp);
+    if (want_audio && audio_config.empty()
+        && !(tp.stream == TAP_VIDEO && packet->pts - base_pts >= AUDIO_WAIT_US))
+        return true;
+
+    if (!Open()) {
+        failed = true;
+        pending_clear(pending);
+        return true;
+    }
+
+    while (!pending.empty()) {
+        Write(pending.front());
+        packet_unref(pending.front().packet);
+        pending.pop_front();
+    }
+    return true;
+}
+
+// Coded size out of the SPS, the containers want it in the track header
+static void h264_dimensions(const uint8_t *data, size_t len, int *width, int *height) {
+    AVCodecParserContext *parser = av_parser_init(AV_CODEC_ID_H264);
+    AVCodecContext *avctx = avcodec_alloc_context3(NULL);
+    uint8_t *out;
+    int out_size;
+
+    if (parser && avctx) {
+        parser->flags |= PARSER_FLAG_COMPLETE_FRAMES;
+        av_parser_parse2(parser, avctx, &out, &out_size, data, (int) len,
+            AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+        *width = parser->width;
+        *height = parser->height;
+    }
+
+    if (parser) av_parser_close(parser);
+    avcodec_free_context(&avctx);
+}
+
+bool Recorder::Open(void) {
+    const DataPacket *first = pending.front().packet;
+    AVDictionary *opts = NULL;
+    AVStream *video, *audio;
+    int sample_rate, channels;
+    int ret;
+
+    if (avformat_alloc_output_context2(&ctx, NULL, NULL, file) < 0 || !ctx) {
+        elog("recording: no container for %s, use .mkv or .mp4", file);
+        return false;
+    }
+
+    video = avformat_new_stream(ctx, NULL);
+    if (!video)
+        goto fail;
+
+    video->time_base = US_TIME_BASE;
+    video->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    video->codecpar->codec_id = AV_CODEC_ID_H264;
+    h264_dimensions(first->data, first->used, &video->codecpar->width, &video->codecpar->height);
+    video->codecpar->extradata = (uint8_t*) av_mallocz(video_config.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!video->codecpar->extradata)
+        goto fail;
+    memcpy(video->codecpar->extradata, video_config.data(), video_config.size());
+    video->codecpar->extradata_size = (int) video_config.size();
+
+    if (audio_config.size() >= 2 && aac_config_parse(audio_config.data(), &sample_rate, &channels)) {
+        audio = avformat_new_stream(ctx, NULL);
+        if (!audio)
+            goto fail;
+
+        audio->time_base = US_TIME_BASE;
+        audio->codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
+        audio->codecpar->codec_id = AV_CODEC_ID_AAC;
+        audio->codecpar->sample_rate = sample_rate;
+        audio->codecpar->frame_size = 1024;
+        #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(59, 24, 100)
+        audio->codecpar->channels = channels;
+        #else
+        av_channel_layout_default(&audio->codecpar->ch_layout, channels);
+        #endif
+        audio->codecpar->extradata = (uint8_t*) av_mallocz(audio_config.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!audio->codecpar->extradata)
+            goto fail;
+        memcpy(audio->codecpar->extradata, audio_config.data(), audio_config.size());
+        audio->codecpar->extradata_size = (int) audio_config.size();
+        audio_index = audio->index;
+    }
+    else if (want_audio) {
+        elog("recording: no audio config, recording video only");
+    }
+
+    if (!(ctx->oformat->flags & AVFMT_NOFILE)
+        && (ret = avio_open(&ctx->pb, file, AVIO_FLAG_WRITE)) < 0)
+    {
+        elog("recording: could not open %s (%d)", file, ret);
+        goto fail;
+    }
+
+    // Fragments keep what was written playable if OBS goes away mid-recording
+    if (strcmp(ctx->oformat->name, "mp4") == 0 || strcmp(ctx->oformat->name, "mov") == 0)
+        av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+
+    ret = avformat_write_header(ctx, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        elog("recording: writing the header failed (%d)", ret);
+        goto fail;
+    }
+
+    ilog("recording: %dx%d video%s", video->codecpar->width, video->codecpar->height,
+        audio_index >= 0 ? ", AAC audio" : "");
+    return true;
+
+    fail:
+    if (ctx->pb) avio_closep(&ctx->pb);
+    avformat_free_context(ctx);
+    ctx = NULL;
+    return false;
+}
+
+void Recorder::Write(const TapPacket &tp) {
+    const DataPacket *packet = tp.packet;
+    const int stream = tp.stream == TAP_VIDEO ? 0 : 1;
+    int index = stream == 0 ? 0 : audio_index;
+    if (index < 0 || packet->pts < base_pts)
+        return;
+
+    // The muxers want strictly increasing timestamps per stream
+    int64_t ts = (int64_t) (packet->pts - base_pts);
+    if (ts <= last_dts[stream]) {
+        dropped++;
+        return;
+    }
+    last_dts[stream] = ts;
+
+    AVPacket *pkt = av_packet_alloc();
+    if (!pkt)
+        return;
+
+    // The packets come padded from the decoder's pool
+    pkt->data = packet->data;
+    pkt->size = (int) packet->used;
+    pkt->stream_index = index;
+    pkt->pts = pkt->dts = ts;
+    if (tp.key) pkt->flags |= AV_PKT_FLAG_KEY;
+    av_packet_rescale_ts(pkt, US_TIME_BASE, ctx->streams[index]->time_base);
+
+    int ret = av_interleaved_write_frame(ctx, pkt);
+    av_packet_free(&pkt);
+    if (ret < 0) {
+        elog("recording: write failed (%d), stopping", ret);
+        failed = true;
+        return;
+    }
+    packets++;
+}
+
+void Recorder::Close(void) {
+    if (ctx) {
+        av_write_trailer(ctx);
+        if (ctx->pb) avio_closep(&ctx->pb);
+        avformat_free_context(ctx);
+        ctx = NULL;
+    }
+    else if (!failed) {
+        elog("recording: nothing recorded, no keyframe with SPS/PPS came in");
+    }
+
+    pending_clear(pending);
+    ilog("recording: closed %s, %llu packets written, %llu dropped", file,
+        (unsigned long long) packets, (unsigned long long) (dropped + tap.Dropped()));
+}
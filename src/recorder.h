@@ -0,0 +1,57 @@
+// Copyright (C) 2023 DEV47APPS, github.com/dev47apps
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <util/threading.h>
+#include "decoder.h"
+
+struct AVFormatContext;
+
+// Passthrough (ISO) recording of one phone: the H.264 and AAC packets are
+// remuxed into fragmented MP4 or MKV as they come off the socket, nothing is
+// decoded or encoded. The packets come in through a PacketTap, the muxer
+// and the file writes run on the recorder's own thread. When the disk falls
+// behind the tap drops packets rather than holding up the live stream.
+struct Recorder {
+    static const size_t MAX_QUEUED = 32 << 20;
+
+    // Register with the source after Start(), remove before Stop()
+    PacketTap tap;
+
+    Recorder();
+    ~Recorder() { Stop(); }
+
+    // The container goes by the file extension, .mp4/.mov or .mkv.
+    // With audio, the file starts once the audio config is in, or after
+    // a couple of seconds of video without it.
+    bool Start(const char *file, bool audio);
+    void Stop(void);
+    inline bool Active(void) { return running; }
+
+private:
+    std::atomic<bool> running;
+    pthread_t thr;
+
+    // Recorder thread only
+    char file[1024];
+    bool want_audio;
+    bool failed;
+    AVFormatContext *ctx;
+    int audio_index;
+    std::vector<uint8_t> video_config;
+    std::vector<uint8_t> audio_config;
+    std::deque<TapPacket> pending;  // until the header is written
+    uint64_t base_pts;
+    int64_t last_dts[2];
+    uint64_t packets;
+    uint64_t dropped;
+
+    friend void *recorder_thread(void *data);
+    bool Process(const TapPacket &tp);
+    bool Open(void);
+    void Write(const TapPacket &tp);
+    void Close(void);
+};
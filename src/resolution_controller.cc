@@ -0,0 +1,112 @@
+/*
+Copyright (C) 2022 DEV47APPS, github.com/dev47apps
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "plugin.h"
+#include "plugin_properties.h"
+#include "resolution_controller.h"
+
+#define SEC_NS            UINT64_C(1000000000)
+#define HOLD_NS           (6 * SEC_NS)   // let a new connection settle
+#define STABLE_NS         (30 * SEC_NS)  // before trying a level up
+#define MAX_STABLE_NS     (600 * SEC_NS)
+#define LATENCY_BUDGET_MS 150.0
+#define MIN_FPS           10.0
+
+void ResolutionController::Start(int resolution, uint64_t now) {
+    ceiling = resolution;
+    current = resolution;
+    stepped_up = false;
+    up_wait = STABLE_NS;
+    Connected(now);
+}
+
+void ResolutionController::Connected(uint64_t now) {
+    overloaded = 0;
+    nominal_fps = 0;
+    last_change = now;
+    stable_since = now;
+}
+
+int ResolutionController::Update(uint64_t now, const ResolutionSample &s) {
+    if (s.seconds <= 0 || now - last_change < HOLD_NS)
+        return -1;
+
+    const double in_fps = s.packets / s.seconds;
+    const double out_fps = s.frames / s.seconds;
+    const double kbps = s.bits / s.seconds / 1000.0;
+    const char *reason = NULL;
+
+    if (in_fps > nominal_fps)
+        nominal_fps = in_fps;
+
+    if (s.packets == 0) {
+        // Nothing to judge, the connection is probably stalled
+        return -1;
+    }
+    else if (s.frames && s.decode_ms > 900.0 / in_fps) {
+        reason = "decode too slow";
+    }
+    else if (s.queue_ms > LATENCY_BUDGET_MS) {
+        reason = "queue over latency budget";
+    }
+    else if (s.discarded * 20 > s.packets || out_fps < in_fps * 0.8) {
+        reason = "dropping frames";
+    }
+    else if (nominal_fps > MIN_FPS && in_fps < nominal_fps * 0.6) {
+        // The phone keeps its frame rate unless the link is backing up
+        reason = "link too slow";
+    }
+
+    if (!reason) {
+        overloaded = 0;
+        if (stepped_up && now - stable_since >= STABLE_NS) {
+            // The new level held up, go back to the normal wait
+            stepped_up = false;
+            up_wait = STABLE_NS;
+        }
+
+        if (current < ceiling && now - stable_since >= up_wait) {
+            ilog("auto resolution: %s -> %s, stable for %llu s (%.1f fps, %.0f kbps, decode %.1f ms)",
+                Resolutions[current], Resolutions[current + 1],
+                (unsigned long long) ((now - stable_since) / SEC_NS), in_fps, kbps, s.decode_ms);
+            stepped_up = true;
+            last_change = now;
+            return ++current;
+        }
+        return -1;
+    }
+
+    stable_since = now;
+    if (++overloaded < 2 || current == 0) {
+        dlog("auto resolution: %s at %s (%.1f/%.1f fps, %.0f kbps, decode %.1f ms, queue %.1f ms)",
+            reason, Resolutions[current], out_fps, in_fps, kbps, s.decode_ms, s.queue_ms);
+        return -1;
+    }
+
+    if (stepped_up) {
+        stepped_up = false;
+        up_wait = up_wait * 2 < MAX_STABLE_NS ? up_wait * 2 : MAX_STABLE_NS;
+    }
+
+    ilog("auto resolution: %s -> %s, %s (%.1f/%.1f fps, %.0f kbps, decode %.1f ms, queue %.1f ms), next step up in %llu s",
+        Resolutions[current], Resolutions[current - 1], reason,
+        out_fps, in_fps, kbps, s.decode_ms, s.queue_ms, (unsigned long long) (up_wait / SEC_NS));
+    overloaded = 0;
+    last_change = now;
+    return --current;
+}
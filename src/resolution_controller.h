@@ -0,0 +1,40 @@
+// Copyright (C) 2022 DEV47APPS, github.com/dev47apps
+#pragma once
+#include <stdint.h>
+
+// What the video pipeline did over one measurement window
+struct ResolutionSample {
+    double seconds;
+    uint64_t packets;     // received
+    uint64_t frames;      // decoded and output
+    uint64_t discarded;   // catch-up, queue overflow, memory budget
+    uint64_t bits;        // received
+    double decode_ms;     // average per frame
+    double queue_ms;      // average per frame
+};
+
+// Picks the video resolution in automatic mode.
+// Steps down one level when decode or the link can't keep up for two
+// windows in a row, and tries one level up after a stable period. A level
+// that fails soon after stepping up doubles the wait before trying again.
+struct ResolutionController {
+    int ceiling;            // user selected resolution
+    int current;
+    int overloaded;         // consecutive overloaded windows
+    bool stepped_up;
+    double nominal_fps;     // best frame rate seen at the current level
+    uint64_t last_change;
+    uint64_t stable_since;
+    uint64_t up_wait;
+
+    ResolutionController() { Start(0, 0); }
+
+    // New ceiling, starts at the top
+    void Start(int resolution, uint64_t now);
+
+    // A new connection at the current resolution came up
+    void Connected(uint64_t now);
+
+    // Returns the resolution to switch to, or -1 to stay
+    int Update(uint64_t now, const ResolutionSample &sample);
+};
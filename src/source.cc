@@ -15,6 +15,7 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <stdlib.h>
+#include <condition_variable>
 #include <util/threading.h>
 #include <util/platform.h>
 
@@ -36,19 +37,40 @@ extern QMainWindow *main_window;
 #include "ffmpeg_decode.h"
 #include "mjpeg_decode.h"
 #include "net.h"
+#include "http.h"
 #include "buffer_util.h"
 #include "device_discovery.h"
+#include "stats.h"
+#include "clock_recovery.h"
+#include "resolution_controller.h"
+#include "path_cache.h"
+#include "model_cache.h"
+#include "recorder.h"
 
 #define PLUGIN_VERSION_STR "233"
 #define FPS 25
 #define MILLI_SEC 1000
 #define NANO_SEC  1000000000
+#define LATENCY_LOG_INTERVAL (60ULL * NANO_SEC)
+#define STALL_HOLD_NS (10ULL * NANO_SEC)
+#define WATCHDOG_MS 50
 
 extern char os_name_version[64];
 extern const char* bindIP;
 
 #define SOURCE_EXISTS() (os_event_try(plugin->stop_signal) == EAGAIN)
 
+// How to reach the active device, resolved once when the video connection
+// is set up and shared by the audio and comms connections.
+struct session_path {
+    bool ready;
+    bool cached;        // from the path cache, not confirmed by discovery
+    DeviceType type;
+    DeviceRef dev;
+    char host[256];
+    int port;
+};
+
 struct droidcam_obs_source {
     Tally_t tally;
 #ifndef _DISABLE_ADB
@@ -62,10 +84,18 @@ struct droidcam_obs_source {
     os_event_t *stop_signal;
     os_event_t *reset_signal;
     os_event_t *comms_signal;
+    os_event_t *video_ready;    // packets queued for the decode threads
+    os_event_t *audio_ready;
+    std::mutex wake_lock;
+    std::condition_variable wake_cv;
+    std::atomic<uint64_t> wake_gen;
+    struct net_cancel cancel;   // fired on destroy, cuts socket waits short
     pthread_t audio_thread;
     pthread_t video_thread;
     pthread_t video_decode_thread;
+    pthread_t audio_decode_thread;
     pthread_t comms_thread;
+    pthread_t watchdog_thread;
     enum video_range_type range;
     bool is_showing;
     bool activated;
@@ -74,13 +104,45 @@ struct droidcam_obs_source {
     bool use_hw;
     bool audio_running;
     bool video_running;
+    bool auto_resolution;
+    bool launch_path;               // try the cached path before discovery
     int video_resolution;
+    int active_resolution;
     int usb_port;
     enum VideoFormat video_format;
+    enum VideoFormat stream_format;     // of the running stream
     struct active_device_info device_info;
+    std::mutex session_lock;
+    struct session_path session;
+    std::mutex watch_lock;
+    socket_t video_sock;                  // what the watchdog cuts on a stall
+    socket_t audio_sock;
+    std::atomic<uint64_t> video_progress; // when video pts last moved, 0 while not watched
+    std::atomic<uint64_t> stall_time;     // same, for the stream the watchdog cut
+    uint64_t video_last_pts;
+    DeviceType failover_type;             // the other transport we moved to
+    char failover_id[sizeof(Device::serial)];
+    char failover_for[sizeof(Device::serial)];
     struct obs_source_audio obs_audio_frame;
     struct obs_source_frame2 obs_video_frame;
     uint64_t time_start;
+    LatencyStats latency;
+    SourceCounters counters;
+    ClockRecovery clock;
+    ResolutionController resolution_ctl;
+    uint64_t resolution_window;
+    ResolutionSample resolution_base;
+    Recorder recorder;
+    std::mutex taps_lock;
+    std::vector<PacketTap*> taps;         // see droidcam_tap_add
+    std::atomic<droidcam_obs_source*> owner; // whose connection we're sharing, see shared_attach
+    char shared_id[sizeof(Device::serial)];
+    std::mutex followers_lock;
+    std::vector<droidcam_obs_source*> followers; // sources our frames also go to
+    uint64_t video_last_ts;
+    uint64_t audio_last_ts;
+    uint64_t audio_last_output;
+    uint64_t audio_last_duration;
     #if DROIDCAM_OVERRIDE
     std::vector<OBSSignal> signal_handlers;
     #endif
@@ -99,13 +161,129 @@ static void signal_source_update(obs_source_t* source, const char* battery_level
 }
 #endif
 
+static void latency_log(struct droidcam_obs_source *plugin) {
+    char report[512];
+    const char *line = report;
+    const char *eol;
+
+    plugin->latency.Format(report, sizeof(report));
+    while ((eol = strchr(line, '\n')) != NULL) {
+        ilog("%.*s", (int) (eol - line), line);
+        line = eol + 1;
+    }
+}
+
+// Decode times stay with the decode thread, the packet may be shared with taps
+static void latency_record(struct droidcam_obs_source *plugin, DataPacket *packet,
+    uint64_t decode_start, uint64_t decode_end)
+{
+    LatencyStats *latency = &plugin->latency;
+    const uint64_t now = os_gettime_ns();
+
+    latency->net.Record((packet->ts_queued - packet->ts_header) / 1000);
+    latency->queue.Record((decode_start - packet->ts_queued) / 1000);
+    latency->decode.Record((decode_end - decode_start) / 1000);
+    latency->total.Record((now - packet->ts_header) / 1000);
+    latency->last_pts.store(packet->pts, std::memory_order_relaxed);
+
+    plugin->counters.decode_us += (decode_end - decode_start) / 1000;
+    plugin->counters.queue_us += (decode_start - packet->ts_queued) / 1000;
+
+    // Log and start over every so often, so the numbers reflect recent conditions
+    uint64_t last_dump = latency->last_dump.load(std::memory_order_relaxed);
+    if (last_dump == 0) {
+        latency->last_dump.store(now, std::memory_order_relaxed);
+    }
+    else if (now - last_dump >= LATENCY_LOG_INTERVAL) {
+        latency_log(plugin);
+        latency->Reset();
+        latency->last_dump.store(now, std::memory_order_relaxed);
+    }
+}
+
+// Phone pts on the recovered host timeline, never going backwards within a stream
+static uint64_t stream_time(struct droidcam_obs_source *plugin, uint64_t *last, uint64_t pts) {
+    uint64_t ts = plugin->clock.Map(pts);
+    if (ts <= *last)
+        ts = *last + 1;
+
+    *last = ts;
+    return ts;
+}
+
+// Totals so far, adapt_resolution() works on the difference between two of these
+static void resolution_snapshot(struct droidcam_obs_source *plugin, ResolutionSample *s) {
+    SourceCounters *c = &plugin->counters;
+    s->packets = c->packets;
+    s->frames = c->frames;
+    s->discarded = c->discard_catchup + c->discard_overflow + c->discard_budget;
+    s->bits = c->bytes * 8;
+    s->decode_ms = (double) c->decode_us / 1000.0;
+    s->queue_ms = (double) c->queue_us / 1000.0;
+}
+
+#define RESOLUTION_WINDOW_NS (2ULL * NANO_SEC)
+
+// Automatic mode: step the resolution to what decode and the link can hold
+static void adapt_resolution(struct droidcam_obs_source *plugin) {
+    const uint64_t now = os_gettime_ns();
+    ResolutionSample cur, win;
+
+    if (!plugin->auto_resolution || now - plugin->resolution_window < RESOLUTION_WINDOW_NS)
+        return;
+
+    resolution_snapshot(plugin, &cur);
+    win.seconds = (double) (now - plugin->resolution_window) / NANO_SEC;
+    win.packets = cur.packets - plugin->resolution_base.packets;
+    win.frames = cur.frames - plugin->resolution_base.frames;
+    win.discarded = cur.discarded - plugin->resolution_base.discarded;
+    win.bits = cur.bits - plugin->resolution_base.bits;
+    win.decode_ms = win.frames ? (cur.decode_ms - plugin->resolution_base.decode_ms) / win.frames : 0;
+    win.queue_ms = win.frames ? (cur.queue_ms - plugin->resolution_base.queue_ms) / win.frames : 0;
+
+    plugin->resolution_base = cur;
+    plugin->resolution_window = now;
+
+    int resolution = plugin->resolution_ctl.Update(now, win);
+    if (resolution >= 0 && resolution != plugin->active_resolution) {
+        plugin->active_resolution = resolution;
+        os_event_signal(plugin->reset_signal);
+    }
+}
+
 #define comms_task(t) do {\
     plugin->comms_queue.add_item(t);\
     os_event_signal(plugin->comms_signal);\
     } while(0)
 
-static socket_t connect(struct droidcam_obs_source *plugin) {
-    Device* dev;
+// Idle threads sleep until something that may change what they should be
+// doing happens: activation, visibility, settings, video coming up, or stop.
+static void plugin_wake(struct droidcam_obs_source *plugin) {
+    {
+        std::lock_guard<std::mutex> lock(plugin->wake_lock);
+        plugin->wake_gen++;
+    }
+    plugin->wake_cv.notify_all();
+    if (plugin->comms_signal)
+        os_event_signal(plugin->comms_signal);
+}
+
+// Wait for a plugin_wake() after `seen` was read from wake_gen,
+// or up to timeout_ms when that's not 0
+static void plugin_wait(struct droidcam_obs_source *plugin, uint64_t seen, unsigned long timeout_ms) {
+    std::unique_lock<std::mutex> lock(plugin->wake_lock);
+    auto woken = [&] { return plugin->wake_gen != seen; };
+    if (timeout_ms)
+        plugin->wake_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), woken);
+    else
+        plugin->wake_cv.wait(lock, woken);
+}
+
+// Work out the path to a device: mDNS address, ADB forward, usbmux device.
+static bool session_resolve(struct droidcam_obs_source *plugin,
+    DeviceType type, const char *id, struct session_path *path)
+{
+    DeviceRef dev;
     #ifndef _DISABLE_ADB
     AdbMgr* adbMgr = &plugin->adbMgr;
     #endif
@@ -113,17 +291,28 @@ static socket_t connect(struct droidcam_obs_source *plugin) {
     MDNS  *mdnsMgr = &plugin->mdnsMgr;
 
     struct active_device_info *device_info = &plugin->device_info;
-
-    dlog("connect device: id=%s type=%d", device_info->id, (int) device_info->type);
-
-    if (device_info->type == DeviceType::WIFI) {
-        return net_connect(device_info->ip, bindIP, device_info->port);
+    path->ready = false;
+    path->cached = false;
+    path->type = type;
+    path->port = device_info->port;
+    path->host[0] = 0;
+
+    dlog("session setup: id=%s type=%d", id, (int) type);
+
+    if (type == DeviceType::WIFI) {
+        strncpy(path->host, device_info->ip, sizeof(path->host) - 1);
+        path->host[sizeof(path->host) - 1] = 0;
+        goto ready;
     }
 
-    if (device_info->type == DeviceType::MDNS) {
-        dev = mdnsMgr->GetDevice(device_info->id);
+    if (type == DeviceType::MDNS) {
+        dev = mdnsMgr->GetDevice(id);
         if (dev) {
-            return net_connect(dev->address, bindIP, device_info->port);
+            strncpy(path->host, dev->address, sizeof(path->host) - 1);
+            path->host[sizeof(path->host) - 1] = 0;
+            // SRV port when the phone advertised one
+            if (dev->port) path->port = dev->port;
+            goto ready;
         }
 
         mdnsMgr->Reload();
@@ -131,44 +320,32 @@ static socket_t connect(struct droidcam_obs_source *plugin) {
     }
 #ifndef _DISABLE_ADB
 
-    if (device_info->type == DeviceType::ADB) {
-        dev = adbMgr->GetDevice(device_info->id);
+    if (type == DeviceType::ADB) {
+        dev = adbMgr->GetDevice(id);
         if (dev) {
-            if (adbMgr->DeviceOffline(dev)) {
+            if (adbMgr->DeviceOffline(dev.get())) {
                 elog("device is offline...");
                 goto out;
             }
 
-            int port_start = device_info->port + (adbMgr->Iter() * 10);
-            if (plugin->usb_port < port_start) {
-                plugin->usb_port = port_start;
-            }
-            else if (plugin->usb_port > (port_start + 8)) {
-                plugin->usb_port = port_start;
-                adbMgr->ClearForwards(dev);
-            }
-
-            dlog("ADB: mapping %d -> %d\n", plugin->usb_port, device_info->port);
-            if (!adbMgr->AddForward(dev, plugin->usb_port, device_info->port)) {
-                plugin->usb_port++;
+            int port = adbMgr->Forward(dev.get(), device_info->port);
+            if (!port)
                 goto out;
-            }
-
-            socket_t rc = net_connect(localhost_ip, plugin->usb_port);
-            if (rc != INVALID_SOCKET) return rc;
 
-            adbMgr->ClearForwards(dev);
-            goto out;
+            plugin->usb_port = port;
+            strncpy(path->host, localhost_ip, sizeof(path->host) - 1);
+            path->port = plugin->usb_port;
+            goto ready;
         }
 
         adbMgr->Reload();
         goto out;
     }
 #endif
-    if (device_info->type == DeviceType::IOS) {
-        dev = iosMgr->GetDevice(device_info->id);
+    if (type == DeviceType::IOS) {
+        dev = iosMgr->GetDevice(id);
         if (dev) {
-            return iosMgr->Connect(dev, device_info->port, &plugin->usb_port);
+            goto ready;
         }
 
         iosMgr->Reload();
@@ -176,27 +353,363 @@ static socket_t connect(struct droidcam_obs_source *plugin) {
     }
 
     out:
-    return INVALID_SOCKET;
+    return false;
+
+    ready:
+    path->dev = dev;
+    path->ready = true;
+    return true;
+}
+
+static void discovery_start(struct droidcam_obs_source *plugin, DeviceType type) {
+    switch (type) {
+        case DeviceType::MDNS:
+            plugin->mdnsMgr.Reload();
+            break;
+#ifndef _DISABLE_ADB
+        case DeviceType::ADB:
+            plugin->adbMgr.Reload();
+            break;
+#endif
+        case DeviceType::IOS:
+            plugin->iosMgr.Reload();
+            break;
+        default:
+            break;
+    }
+}
+
+static void discovery_wait(struct droidcam_obs_source *plugin, DeviceType type) {
+    switch (type) {
+        case DeviceType::MDNS:
+            plugin->mdnsMgr.WaitReload();
+            break;
+#ifndef _DISABLE_ADB
+        case DeviceType::ADB:
+            plugin->adbMgr.WaitReload();
+            break;
+#endif
+        case DeviceType::IOS:
+            plugin->iosMgr.WaitReload();
+            break;
+        default:
+            break;
+    }
+}
+
+// The path that worked last time, from before OBS was restarted.
+// The ADB forward usually outlives OBS, but only counts while adb still
+// has it going to the same phone. The mDNS address stays while the phone
+// does. usbmux numbers devices anew on every plug, so iOS waits for the
+// listener's list instead, it's there quickly.
+static bool session_cached(struct droidcam_obs_source *plugin, struct session_path *path) {
+    struct active_device_info *device_info = &plugin->device_info;
+    struct cached_path cached;
+
+    if (!path_cache_get(device_info->id, &cached) || cached.type != device_info->type)
+        return false;
+
+#ifndef __APPLE__
+    if (cached.type == DeviceType::IOS) {
+        discovery_wait(plugin, DeviceType::IOS);
+        return false;
+    }
+#endif
+#ifndef _DISABLE_ADB
+    if (cached.type == DeviceType::ADB
+        && !plugin->adbMgr.Forwarded(device_info->id, cached.port, device_info->port))
+    {
+        ilog("last known forward %d is not to this device anymore", cached.port);
+        return false;
+    }
+#endif
+
+    path->ready = true;
+    path->cached = true;
+    path->type = cached.type;
+    path->port = cached.port;
+    path->dev.reset();
+    strncpy(path->host, cached.host, sizeof(path->host) - 1);
+    path->host[sizeof(path->host) - 1] = 0;
+
+    if (cached.type == DeviceType::IOS) {
+        DeviceRef dev = std::make_shared<Device>();
+        strncpy(dev->serial, device_info->id, sizeof(dev->serial) - 1);
+        strncpy(dev->address, cached.host, sizeof(dev->address) - 1);
+        dev->port = cached.port;
+        path->dev = dev;
+        path->port = device_info->port;
+    }
+#ifndef _DISABLE_ADB
+    else if (cached.type == DeviceType::ADB) {
+        plugin->usb_port = cached.port;
+    }
+#endif
+
+    ilog("trying the last known path: %s:%d (type=%d)", cached.host, cached.port, (int) cached.type);
+    return true;
+}
+
+// Keep the path of a working session for the next launch, failovers aside
+static void session_remember(struct droidcam_obs_source *plugin) {
+    struct active_device_info *device_info = &plugin->device_info;
+    const struct session_path *session = &plugin->session;
+    struct cached_path cached;
+
+    if (session->type != device_info->type || session->type == DeviceType::WIFI)
+        return;
+
+    memset(&cached, 0, sizeof(cached));
+    cached.type = session->type;
+    cached.port = session->port;
+    strncpy(cached.host, session->host, sizeof(cached.host) - 1);
+
+    if (session->type == DeviceType::IOS) {
+        if (!session->dev)
+            return;
+
+        strncpy(cached.host, session->dev->address, sizeof(cached.host) - 1);
+        cached.port = session->dev->port;
+    }
+
+    path_cache_put(device_info->id, &cached);
+}
+
+// Resolve the session path, called by the video thread for each new session,
+// so the lookups and the ADB forward happen once rather than for every connection.
+// After a failover this is the other transport, for as long as it works.
+static bool session_setup(struct droidcam_obs_source *plugin) {
+    struct active_device_info *device_info = &plugin->device_info;
+    struct session_path path;
+
+    if (plugin->launch_path) {
+        plugin->launch_path = false;
+        if (session_cached(plugin, &path))
+            goto ready;
+    }
+
+    if (plugin->failover_type != DeviceType::NONE) {
+        if (strncmp(plugin->failover_for, device_info->id, sizeof(plugin->failover_for)) == 0
+            && session_resolve(plugin, plugin->failover_type, plugin->failover_id, &path))
+            goto ready;
+
+        ilog("failover path is gone, back to %s", device_info->id);
+        plugin->failover_type = DeviceType::NONE;
+    }
+
+    if (!session_resolve(plugin, device_info->type, device_info->id, &path))
+        return false;
+
+    ready:
+    std::lock_guard<std::mutex> lock(plugin->session_lock);
+    plugin->session = path;
+    return true;
+}
+
+static inline bool is_usb(DeviceType type) {
+    return type == DeviceType::ADB || type == DeviceType::IOS;
+}
+
+// Device label up to the transport suffix, "Pixel 7 [USB] (serial)" -> "Pixel 7"
+static void device_name(const Device *dev, char *name, size_t size) {
+    const char *end = strstr(dev->model, " [");
+    size_t len = end ? (size_t) (end - dev->model) : strlen(dev->model);
+    if (len >= size) len = size - 1;
+    memcpy(name, dev->model, len);
+    name[len] = 0;
+}
+
+// Look up the devices without a name and wait for the answers
+static DeviceListRef resolve_models(DeviceDiscovery *mgr) {
+    mgr->ResolveModels();
+    mgr->WaitModels();
+    return mgr->Devices();
+}
+
+// Find another way to reach the phone behind a stalled session: back to the
+// configured device if we failed over earlier, otherwise the same phone over
+// the other transport, USB when on Wi-Fi and Wi-Fi when on USB.
+// Phones have a different id on each transport, so the match goes by device
+// name, or takes the only unnamed candidate when there is just one.
+static bool session_failover(struct droidcam_obs_source *plugin) {
+    struct active_device_info *device_info = &plugin->device_info;
+    DeviceType cur_type, type = DeviceType::NONE, only_type = DeviceType::NONE;
+    DeviceRef cur, found, only;
+    DeviceListRef list;
+    char name[sizeof(Device::model)];
+    char other[sizeof(Device::model)];
+    int count = 0;
+    {
+        std::lock_guard<std::mutex> lock(plugin->session_lock);
+        if (!plugin->session.ready)
+            return false;
+
+        cur_type = plugin->session.type;
+        cur = plugin->session.dev;
+    }
+
+    if (plugin->failover_type != DeviceType::NONE) {
+        plugin->failover_type = DeviceType::NONE;
+        ilog("failover: back to %s", device_info->id);
+        return true;
+    }
+
+    name[0] = 0;
+    if (cur) {
+        DeviceDiscovery *mgr = NULL;
+        #ifndef _DISABLE_ADB
+        if (cur_type == DeviceType::ADB) mgr = &plugin->adbMgr;
+        #endif
+        if (cur_type == DeviceType::IOS) mgr = &plugin->iosMgr;
+
+        if (mgr && cur->model[0] == 0) {
+            DeviceRef dev = resolve_models(mgr)->Find(cur->serial, sizeof(Device::serial));
+            if (dev) cur = dev;
+        }
+
+        device_name(cur.get(), name, sizeof(name));
+    }
+
+    auto candidate = [&](const DeviceRef &dev, DeviceType t) {
+        device_name(dev.get(), other, sizeof(other));
+        if (name[0] && other[0]) {
+            if (strcmp(name, other) != 0)
+                return false;
+
+            found = dev;
+            type = t;
+            return true;
+        }
+
+        // No name on one side, only good if it's the only one around
+        only = dev;
+        only_type = t;
+        count++;
+        return false;
+    };
+
+    if (is_usb(cur_type)) {
+        list = plugin->mdnsMgr.Devices();
+        for (const DeviceRef &dev : list->devices)
+            if (candidate(dev, DeviceType::MDNS)) break;
+
+        // Next time round the list may know about it
+        if (!found) plugin->mdnsMgr.Reload();
+    }
+    else {
+        // A phone plugged in since the last refresh is a good bet
+        #ifndef _DISABLE_ADB
+        plugin->adbMgr.Reload();
+        plugin->adbMgr.WaitReload();
+        list = resolve_models(&plugin->adbMgr);
+        for (const DeviceRef &dev : list->devices) {
+            if (plugin->adbMgr.DeviceOffline(dev.get()))
+                continue;
+
+            if (candidate(dev, DeviceType::ADB)) break;
+        }
+        #endif
+
+        if (!found) {
+            plugin->iosMgr.Reload();
+            plugin->iosMgr.WaitReload();
+            list = resolve_models(&plugin->iosMgr);
+            for (const DeviceRef &dev : list->devices)
+                if (candidate(dev, DeviceType::IOS)) break;
+        }
+    }
+
+    if (!found && count == 1) {
+        found = only;
+        type = only_type;
+    }
+
+    if (!found) {
+        dlog("failover: no other path to %s", name[0] ? name : device_info->id);
+        return false;
+    }
+
+    ilog("failover: %s -> %s (type=%d)", name[0] ? name : device_info->id, found->serial, (int) type);
+    plugin->failover_type = type;
+    strncpy(plugin->failover_id, found->serial, sizeof(plugin->failover_id) - 1);
+    plugin->failover_id[sizeof(plugin->failover_id) - 1] = 0;
+    strncpy(plugin->failover_for, device_info->id, sizeof(plugin->failover_for) - 1);
+    plugin->failover_for[sizeof(plugin->failover_for) - 1] = 0;
+    return true;
+}
+
+static void session_reset(struct droidcam_obs_source *plugin) {
+    std::lock_guard<std::mutex> lock(plugin->session_lock);
+    plugin->session.ready = false;
+    plugin->session.dev.reset();
+}
+
+// Open a connection over the current session path
+static socket_t connect(struct droidcam_obs_source *plugin) {
+    struct session_path path;
+    socket_t sock;
+    {
+        std::lock_guard<std::mutex> lock(plugin->session_lock);
+        path = plugin->session;
+    }
+
+    if (!path.ready)
+        return INVALID_SOCKET;
+
+    DeviceType type = path.type;
+    if (type == DeviceType::IOS) {
+        sock = plugin->iosMgr.Connect(path.dev, path.port, &plugin->usb_port, &plugin->cancel);
+    }
+    else if (type == DeviceType::WIFI || type == DeviceType::MDNS) {
+        sock = net_connect(path.host, bindIP, path.port, &plugin->cancel);
+    }
+    else {
+        sock = net_connect(path.host, NULL, path.port, &plugin->cancel);
+    }
+
+#ifndef _DISABLE_ADB
+    if (sock == INVALID_SOCKET && type == DeviceType::ADB && path.dev) {
+        plugin->adbMgr.RemoveForward(path.dev.get(), path.port);
+    }
+#endif
+
+    return sock;
 }
 
 #define MAXCONFIG 1024
 #define MAXPACKET 1024 * 1024 * 16
+
+// Read and throw away len bytes
+static bool skip_bytes(socket_t sock, const struct net_cancel *cancel, size_t len) {
+    uint8_t scratch[4096];
+    while (len > 0) {
+        size_t n = len < sizeof(scratch) ? len : sizeof(scratch);
+        if (net_recv_all(sock, scratch, n, cancel) != (ssize_t) n)
+            return false;
+        len -= n;
+    }
+    return true;
+}
+
 static DataPacket*
-read_frame(Decoder *decoder, socket_t sock, int *has_config)
+read_frame(Decoder *decoder, socket_t sock, const struct net_cancel *cancel, int *has_config)
 {
     uint8_t header[HEADER_SIZE];
     uint8_t config[MAXCONFIG];
     size_t r;
     size_t len, config_len = 0;
     uint64_t pts;
+    uint64_t ts_header;
 
     AGAIN:
-    r = net_recv_all(sock, header, HEADER_SIZE);
+    r = net_recv_all(sock, header, HEADER_SIZE, cancel);
     if (r != HEADER_SIZE) {
         elog("read header recv returned %ld", r);
         return NULL;
     }
 
+    ts_header = os_gettime_ns();
+
     pts = buffer_read64be(header);
     len = buffer_read32be(&header[8]);
     // dlog("read_frame: header: pts=%llu len=%ld", pts, len);
@@ -217,7 +730,7 @@ read_frame(Decoder *decoder, socket_t sock, int *has_config)
             return NULL;
         }
 
-        r = net_recv_all(sock, config, len);
+        r = net_recv_all(sock, config, len, cancel);
         if (r != len) {
             elog("read config recv returned %ld", r);
             return NULL;
@@ -234,6 +747,20 @@ read_frame(Decoder *decoder, socket_t sock, int *has_config)
         return NULL;
     }
 
+    // Over the memory budget: drop frames rather than allocate, except
+    // ones carrying config since the decoder cannot do without it
+    if (config_len == 0 && decoder->over_budget()) {
+        if (!skip_bytes(sock, cancel, len)) {
+            elog("read_frame: skip %ld bytes failed", len);
+            return NULL;
+        }
+
+        dlog("read_frame: over memory budget, dropped %ld bytes", len);
+        if (decoder->counters) decoder->counters->discard_budget++;
+        decoder->skip_to_keyframe();
+        goto AGAIN;
+    }
+
     DataPacket* data_packet = decoder->pull_empty_packet(config_len + len);
     uint8_t *p = data_packet->data;
     if (config_len) {
@@ -241,7 +768,7 @@ read_frame(Decoder *decoder, socket_t sock, int *has_config)
         p += config_len;
     }
 
-    r = net_recv_all(sock, p, len);
+    r = net_recv_all(sock, p, len, cancel);
     if (r != len) {
         elog("read_frame: read %ld bytes wanted %ld", r, len);
         decoder->push_empty_packet(data_packet);
@@ -250,35 +777,138 @@ read_frame(Decoder *decoder, socket_t sock, int *has_config)
 
     data_packet->pts = pts;
     data_packet->used = config_len + len;
+    data_packet->ts_header = ts_header;
+    data_packet->ts_queued = 0;
     return data_packet;
 }
 
+// Sources showing the same device in the same format and resolution share
+// one connection and decoder, as long as the owner has audio when the
+// follower wants it. The first one to connect owns the session, the others attach
+// as followers and get each decoded frame output to them as well. When the
+// owner goes away the followers are let go and connect again, the first of
+// them becoming the new owner.
+static std::mutex shared_lock;
+static std::vector<droidcam_obs_source*> shared_owners;
+
+// Offer our running session to other sources
+static void shared_publish(struct droidcam_obs_source *plugin) {
+    std::lock_guard<std::mutex> lock(shared_lock);
+    snprintf(plugin->shared_id, sizeof(plugin->shared_id), "%s", plugin->device_info.id);
+    for (droidcam_obs_source *owner : shared_owners)
+        if (owner == plugin) return;
+
+    shared_owners.push_back(plugin);
+}
+
+static bool shared_match(struct droidcam_obs_source *owner, struct droidcam_obs_source *plugin) {
+    return owner != plugin && owner->video_running
+        && owner->stream_format == plugin->video_format
+        && owner->video_resolution == plugin->video_resolution
+        && owner->auto_resolution == plugin->auto_resolution
+        && (owner->enable_audio || !plugin->enable_audio)
+        && strncmp(owner->shared_id, plugin->device_info.id, sizeof(owner->shared_id)) == 0;
+}
+
+// Attach to a source that already has our device up
+static bool shared_attach(struct droidcam_obs_source *plugin) {
+    std::lock_guard<std::mutex> lock(shared_lock);
+    for (droidcam_obs_source *owner : shared_owners) {
+        if (!shared_match(owner, plugin))
+            continue;
+
+        std::lock_guard<std::mutex> followers(owner->followers_lock);
+        owner->followers.push_back(plugin);
+        plugin->owner = owner;
+        plugin->counters.hw_decode = owner->counters.hw_decode.load();
+        ilog("sharing the connection of \"%s\"", obs_source_get_name(owner->source));
+        return true;
+    }
+    return false;
+}
+
+// Still attached to an owner streaming what we want
+static bool shared_following(struct droidcam_obs_source *plugin) {
+    std::lock_guard<std::mutex> lock(shared_lock);
+    return plugin->owner && shared_match(plugin->owner, plugin);
+}
+
+// Stop owning or following, followers go back to connecting themselves
+static void shared_release(struct droidcam_obs_source *plugin) {
+    std::lock_guard<std::mutex> lock(shared_lock);
+    for (auto it = shared_owners.begin(); it != shared_owners.end(); ++it) {
+        if (*it == plugin) {
+            shared_owners.erase(it);
+            break;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> followers(plugin->followers_lock);
+        for (droidcam_obs_source *follower : plugin->followers) {
+            follower->owner = NULL;
+            plugin_wake(follower);
+        }
+        plugin->followers.clear();
+    }
+
+    droidcam_obs_source *owner = plugin->owner;
+    if (owner) {
+        std::lock_guard<std::mutex> followers(owner->followers_lock);
+        for (auto it = owner->followers.begin(); it != owner->followers.end(); ++it) {
+            if (*it == plugin) {
+                owner->followers.erase(it);
+                break;
+            }
+        }
+        plugin->owner = NULL;
+        ilog("stopped sharing the connection of \"%s\"", obs_source_get_name(owner->source));
+    }
+}
+
 static void *video_decode_thread(void *data) {
     droidcam_obs_source *plugin = (droidcam_obs_source*)(data);
 
     Decoder *decoder = NULL;
     DataPacket* data_packet = NULL;
     bool got_output;
+    uint64_t decode_start, decode_end;
 
     ilog("video_decode_thread start");
 
     while (SOURCE_EXISTS()) {
         if ((decoder = plugin->video_decoder) == NULL || (data_packet = decoder->pull_ready_packet()) == NULL) {
-            os_sleep_ms(5);
+            os_event_wait(plugin->video_ready);
             continue;
         }
 
-        if (decoder->failed)
+        if (decoder->failed) {
+            plugin->counters.discard_failed++;
             goto LOOP;
+        }
 
+        decode_start = os_gettime_ns();
         if (!decoder->decode_video(&plugin->obs_video_frame, data_packet, &got_output)) {
             elog("error decoding video");
+            plugin->counters.discard_failed++;
+            if (decoder->recover()) {
+                // A restarted decoder may hand out another pixel format
+                plugin->obs_video_frame.format = VIDEO_FORMAT_NONE;
+                plugin->obs_video_frame.range  = VIDEO_RANGE_DEFAULT;
+                if (plugin->stream_format == FORMAT_AVC)
+                    plugin->counters.hw_decode = ((FFMpegDecoder*)decoder)->hw;
+                goto LOOP;
+            }
+
+            // Nothing more to do in place, get a new stream and decoder
             decoder->failed = true;
+            os_event_signal(plugin->reset_signal);
             goto LOOP;
         }
+        decode_end = os_gettime_ns();
 
         if (got_output) {
-            plugin->obs_video_frame.timestamp = data_packet->pts * 1000;
+            plugin->obs_video_frame.timestamp = stream_time(plugin, &plugin->video_last_ts, data_packet->pts);
             //if (flip) plugin->obs_video_frame.flip = !plugin->obs_video_frame.flip;
             #if 0
             dlog("output video: %dx%d %lu",
@@ -287,6 +917,31 @@ static void *video_decode_thread(void *data) {
                 plugin->obs_video_frame.timestamp);
             #endif
             obs_source_output_video2(plugin->source, &plugin->obs_video_frame);
+            {
+                std::lock_guard<std::mutex> lock(plugin->followers_lock);
+                for (droidcam_obs_source *follower : plugin->followers) {
+                    obs_source_output_video2(follower->source, &plugin->obs_video_frame);
+                    follower->counters.frames++;
+                }
+            }
+            latency_record(plugin, data_packet, decode_start, decode_end);
+            plugin->counters.frames++;
+
+            uint64_t start = plugin->counters.session_start.exchange(0);
+            if (start) {
+                uint64_t ms = (os_gettime_ns() - start) / 1000000;
+                plugin->counters.first_frame_ms = ms ? ms : 1;
+                ilog("first frame after %llu ms", (unsigned long long) ms);
+            }
+
+            uint64_t stalled = plugin->stall_time.exchange(0);
+            if (stalled) {
+                uint64_t ms = (os_gettime_ns() - stalled) / 1000000;
+                plugin->counters.recovery_ms = ms;
+                if (ms > plugin->counters.recovery_max_ms)
+                    plugin->counters.recovery_max_ms = ms;
+                ilog("recovered from stall after %llu ms", (unsigned long long) ms);
+            }
         }
 
         LOOP:
@@ -297,31 +952,141 @@ static void *video_decode_thread(void *data) {
     return NULL;
 }
 
-static bool
-recv_video_frame(droidcam_obs_source *plugin, socket_t sock) {
-    int has_config = 0;
-    DataPacket* data_packet;
-    Decoder *decoder = plugin->video_decoder;
+static Decoder *video_decoder_create(droidcam_obs_source *plugin, enum VideoFormat format) {
+    Decoder *decoder;
+    if (format == FORMAT_AVC) {
+        decoder = new FFMpegDecoder();
+    }
+    else if (format == FORMAT_MJPG) {
+        decoder = new MJpegDecoder();
+    }
+    else {
+        elog("unexpected video format %d", format);
+        decoder = new MJpegDecoder();
+        decoder->failed = true;
+    }
+    decoder->counters = &plugin->counters;
+    return decoder;
+}
 
-    if (!decoder) {
-        if (plugin->video_format == FORMAT_AVC) {
-            decoder = new FFMpegDecoder();
-        }
-        else if (plugin->video_format == FORMAT_MJPG) {
-            decoder = new MJpegDecoder();
+// Wait for the decode thread to hand back all of the decoder's packets.
+// Packets only held by taps don't count, they free themselves later.
+static void video_decoder_drain(droidcam_obs_source *plugin, Decoder *decoder) {
+    while (!decoder->idle() && SOURCE_EXISTS()) {
+        dlog("waiting for decode thread: %lu/%lu",
+            decoder->recieveQueue.items.size(), decoder->alloc_count);
+        os_sleep_ms(MILLI_SEC / FPS);
+    }
+}
+
+static bool video_decoder_init(droidcam_obs_source *plugin, Decoder *decoder, enum VideoFormat format) {
+    bool init = false;
+    bool use_hw = plugin->use_hw;
+    dlog("init video decoder");
+
+    if (format == FORMAT_AVC) {
+        init = (((FFMpegDecoder*)decoder)->init(NULL, AV_CODEC_ID_H264, use_hw) >= 0);
+    }
+    else if (format == FORMAT_MJPG) {
+        init = ((MJpegDecoder*)decoder)->init();
+    }
+
+    if (!init) {
+        elog("could not initialize decoder");
+        decoder->failed = true;
+    }
+    return init;
+}
+
+// The decoder is about to get its first frame
+static void video_decoder_started(droidcam_obs_source *plugin, Decoder *decoder) {
+    plugin->counters.hw_decode = plugin->stream_format == FORMAT_AVC
+        ? ((FFMpegDecoder*)decoder)->hw : 0;
+    comms_task(CommsTask::TALLY);
+    droidcam_signal(plugin->source, "droidcam_connect");
+}
+
+// Hand a received packet to the registered taps
+static void tap_publish(droidcam_obs_source *plugin, int stream, const DataPacket *packet, bool config) {
+    std::lock_guard<std::mutex> lock(plugin->taps_lock);
+    if (plugin->taps.empty())
+        return;
+
+    TapPacket tp;
+    tp.stream = stream;
+    tp.config = config;
+    tp.packet = packet;
+    if (stream == TAP_AUDIO) {
+        tp.key = true;
+        tp.codec = "aac";
+    }
+    else if (plugin->stream_format == FORMAT_AVC) {
+        tp.key = h264_is_keyframe(packet->data, packet->used);
+        tp.codec = "h264";
+    }
+    else {
+        tp.key = true;
+        tp.codec = "mjpeg";
+    }
+
+    size_t fullest = 0;
+    for (PacketTap *tap : plugin->taps) {
+        size_t queued = tap->Push(tp);
+        if (queued > fullest) fullest = queued;
+    }
+    plugin->counters.TapQueued(fullest);
+}
+
+static void tap_add(droidcam_obs_source *plugin, PacketTap *tap) {
+    std::lock_guard<std::mutex> lock(plugin->taps_lock);
+    for (PacketTap *t : plugin->taps)
+        if (t == tap) return;
+
+    plugin->taps.push_back(tap);
+}
+
+static void tap_remove(droidcam_obs_source *plugin, PacketTap *tap) {
+    std::lock_guard<std::mutex> lock(plugin->taps_lock);
+    for (auto it = plugin->taps.begin(); it != plugin->taps.end(); ++it) {
+        if (*it == tap) {
+            plugin->taps.erase(it);
+            return;
         }
-        else {
-            elog("unexpected video format %d", plugin->video_format);
-            decoder = new MJpegDecoder();
-            decoder->failed = true;
+    }
+}
+
+// Bookkeeping for each video packet read off the active stream
+static void video_packet_received(droidcam_obs_source *plugin, DataPacket *data_packet) {
+    const uint64_t now = os_gettime_ns();
+    plugin->counters.bytes += data_packet->used;
+    plugin->counters.packets++;
+    plugin->counters.Tick(now);
+
+    {
+        // Followers have no connection of their own, their Stats show ours
+        std::lock_guard<std::mutex> lock(plugin->followers_lock);
+        for (droidcam_obs_source *follower : plugin->followers) {
+            follower->counters.bytes += data_packet->used;
+            follower->counters.packets++;
+            follower->counters.Tick(now);
         }
-        plugin->video_decoder = decoder;
     }
 
-    data_packet = read_frame(decoder, sock, &has_config);
-    if (!data_packet)
-        return false;
+    // Moving pts is what the stall watchdog looks for
+    if (data_packet->pts > plugin->video_last_pts || plugin->video_progress == 0) {
+        plugin->video_last_pts = data_packet->pts;
+        plugin->video_progress = data_packet->ts_header;
+    }
 
+    tap_publish(plugin, TAP_VIDEO, data_packet, false);
+    plugin->clock.Update(0, data_packet->pts, data_packet->ts_header);
+    plugin->counters.clock_drift = (float) plugin->clock.Drift();
+    plugin->counters.clock_jitter = (float) plugin->clock.Jitter();
+    adapt_resolution(plugin);
+}
+
+// Set up the decoder on its first packet and queue the packet for decoding
+static bool queue_video_frame(droidcam_obs_source *plugin, Decoder *decoder, DataPacket *data_packet) {
     // NOTE: data_packet must be properly disposed from here
 
     // Decoder failures should not happen generally.
@@ -329,141 +1094,458 @@ recv_video_frame(droidcam_obs_source *plugin, socket_t sock) {
     if (decoder->failed) {
         FAILED:
         dlog("discarding frame.. decoder failed");
+        plugin->counters.discard_failed++;
         decoder->push_empty_packet(data_packet);
         return true;
     }
 
 
-    if (!decoder->ready) {
-        bool init = false;
-        bool use_hw = plugin->use_hw;
-        dlog("init video decoder");
+    // Only a new decoder is set up here, a restart keeps it ready
+    // and rebuilds it on the decode thread
+    if (!decoder->ready) {
+        std::lock_guard<std::mutex> lock(decoder->setup_lock);
+        if (!decoder->ready) {
+            plugin->obs_video_frame.format = VIDEO_FORMAT_NONE;
+            plugin->obs_video_frame.range  = VIDEO_RANGE_DEFAULT;
+            if (!video_decoder_init(plugin, decoder, plugin->stream_format))
+                goto FAILED;
+
+            video_decoder_started(plugin, decoder);
+        }
+    }
+
+    data_packet->ts_queued = os_gettime_ns();
+    decoder->push_ready_packet(data_packet);
+    os_event_signal(plugin->video_ready);
+    plugin->counters.QueueDepth(decoder->decodeQueue.items.size());
+    return true;
+}
+
+static bool
+recv_video_frame(droidcam_obs_source *plugin, socket_t sock) {
+    int has_config = 0;
+    DataPacket* data_packet;
+    Decoder *decoder = plugin->video_decoder;
+
+    if (!decoder) {
+        decoder = video_decoder_create(plugin, plugin->stream_format);
+        plugin->video_decoder = decoder;
+    }
+
+    data_packet = read_frame(decoder, sock, &plugin->cancel, &has_config);
+    if (!data_packet)
+        return false;
+
+    video_packet_received(plugin, data_packet);
+    return queue_video_frame(plugin, decoder, data_packet);
+}
+
+// The sockets the watchdog may cut, swapped under the lock so it never
+// touches one that was already closed
+static void watch_socket(struct droidcam_obs_source *plugin, socket_t *slot, socket_t sock) {
+    std::lock_guard<std::mutex> lock(plugin->watch_lock);
+    *slot = sock;
+}
+
+// Notice video stalls within a few frame intervals rather than waiting out the
+// recv timeout, and break the video thread out of recv so it can reconnect
+static void *watchdog_thread(void *data) {
+    droidcam_obs_source *plugin = (droidcam_obs_source*)(data);
+
+    ilog("watchdog_thread start");
+
+    while (SOURCE_EXISTS()) {
+        uint64_t seen = plugin->wake_gen;
+        if (!plugin->video_running) {
+            plugin_wait(plugin, seen, 0);
+            continue;
+        }
+
+        plugin_wait(plugin, seen, WATCHDOG_MS);
+        uint64_t progress = plugin->video_progress;
+        if (progress == 0)
+            continue;
+
+        uint64_t now = os_gettime_ns();
+        uint64_t timeout = SourceCounters::StallTimeout(plugin->counters.packet_rate);
+        if (now < progress || now - progress < timeout)
+            continue;
+
+        if (!plugin->video_progress.compare_exchange_strong(progress, 0))
+            continue;
+
+        // Recovery time counts from the last frame that made it
+        uint64_t none = 0;
+        plugin->stall_time.compare_exchange_strong(none, progress);
+        plugin->counters.stalls++;
+        ilog("video stalled, nothing new for %llu ms", (unsigned long long) ((now - progress) / 1000000));
+
+        std::lock_guard<std::mutex> lock(plugin->watch_lock);
+        if (plugin->video_sock != INVALID_SOCKET)
+            net_shutdown(plugin->video_sock);
+        if (plugin->audio_sock != INVALID_SOCKET)
+            net_shutdown(plugin->audio_sock);
+    }
+
+    ilog("watchdog_thread end");
+    return NULL;
+}
+
+// Pick the resolution for a new stream, the controller decides in automatic mode
+static void video_params(struct droidcam_obs_source *plugin) {
+    if (plugin->auto_resolution) {
+        uint64_t now = os_gettime_ns();
+        if (plugin->resolution_ctl.ceiling != plugin->video_resolution)
+            plugin->resolution_ctl.Start(plugin->video_resolution, now);
+        else
+            plugin->resolution_ctl.Connected(now);
+
+        plugin->active_resolution = plugin->resolution_ctl.current;
+        plugin->resolution_window = now;
+        resolution_snapshot(plugin, &plugin->resolution_base);
+    }
+    else {
+        plugin->active_resolution = plugin->video_resolution;
+    }
+}
+
+static int video_request(struct droidcam_obs_source *plugin, enum VideoFormat format, char *buf, size_t size) {
+    const char *obs_version_str = obs_get_version_string();
+
+    #if DROIDCAM_OVERRIDE
+    // todo: dont do this
+    char obs_version_str_flat[4];
+    obs_version_str_flat[0] = obs_version_str[0];
+    obs_version_str_flat[1] = obs_version_str[2];
+    obs_version_str_flat[2] = obs_version_str[4];
+    obs_version_str_flat[3] = 0;
+    #endif
+
+    int len = snprintf(buf, size, VIDEO_REQ,
+        VideoFormatNames[format][1],
+        Resolutions[plugin->active_resolution],
+        plugin->usb_port,
+        os_name_version,
+        #if DROIDCAM_OVERRIDE
+        "", obs_version_str_flat, 5912);
+        #else
+        obs_version_str, PLUGIN_VERSION_STR, 5912);
+        #endif
+
+    dlog("%s", buf);
+    return len;
+}
+
+static void recording_stop(struct droidcam_obs_source *plugin) {
+    tap_remove(plugin, &plugin->recorder.tap);
+    plugin->recorder.Stop();
+}
+
+// Passthrough recording, a new file for every video stream
+// since the parameters may have changed in between
+static void recording_start(struct droidcam_obs_source *plugin) {
+    obs_data_t *settings = obs_source_get_settings(plugin->source);
+    const char *dir = obs_data_get_string(settings, OPT_RECORD_PATH);
+    const char *ext = obs_data_get_string(settings, OPT_RECORD_FORMAT);
+    char name[256];
+    char file[1024];
+    char *date;
+
+    recording_stop(plugin);
+    if (!obs_data_get_bool(settings, OPT_RECORD))
+        goto out;
+
+    if (plugin->stream_format != FORMAT_AVC) {
+        elog("recording: needs the AVC/H.264 video format");
+        goto out;
+    }
+
+    if (!dir || !dir[0]) {
+        elog("recording: no folder set");
+        goto out;
+    }
+
+    // The source name goes into the file name
+    snprintf(name, sizeof(name), "%s", obs_source_get_name(plugin->source));
+    for (char *c = name; *c; c++)
+        if (strchr("/\\:*?\"<>|", *c)) *c = '_';
+
+    date = os_generate_formatted_filename(ext && ext[0] ? ext : "mkv", true, "%CCYY-%MM-%DD %hh-%mm-%ss");
+    snprintf(file, sizeof(file), "%s/%s %s", dir, name, date);
+    bfree(date);
+    if (plugin->recorder.Start(file, plugin->enable_audio))
+        tap_add(plugin, &plugin->recorder.tap);
+
+    out:
+    obs_data_release(settings);
+}
+
+#define SWITCH_TIMEOUT_NS (4ULL * NANO_SEC)
+
+// Make-before-break switch to new video parameters.
+// The new stream comes up next to the old one, which keeps the picture going
+// until the new stream reaches a keyframe; then the decoders are swapped.
+// If the phone drops the old stream for the new one, the last frame stays up
+// meanwhile. Returns false with reset_signal set to fall back to reconnecting.
+static bool video_switch(struct droidcam_obs_source *plugin, socket_t *sock) {
+    DataPacket *data_packet = NULL;
+    Decoder *decoder = NULL;
+    socket_t next = INVALID_SOCKET;
+    enum VideoFormat format;
+    char video_req[256];
+    int video_req_len;
+    uint64_t start;
+
+    RESTART:
+    // Another change while switching starts over
+    os_event_reset(plugin->reset_signal);
+    start = os_gettime_ns();
+    format = plugin->video_format;
+    video_params(plugin);
+    ilog("switching video to %s %s", VideoFormatNames[format][1], Resolutions[plugin->active_resolution]);
+
+    if ((next = connect(plugin)) == INVALID_SOCKET)
+        goto fail;
+
+    video_req_len = video_request(plugin, format, video_req, sizeof(video_req));
+    if (net_send_all(next, video_req, video_req_len) <= 0) {
+        elog("send(/video) failed");
+        goto fail;
+    }
 
-        if (plugin->video_format == FORMAT_AVC) {
-            init = (((FFMpegDecoder*)decoder)->init(NULL, AV_CODEC_ID_H264, use_hw) >= 0);
+    set_recv_buf_len(next, 65536 * 4);
+    decoder = video_decoder_create(plugin, format);
+    if (!decoder->failed && !video_decoder_init(plugin, decoder, format))
+        goto fail;
+
+    while (SOURCE_EXISTS()) {
+        socket_t socks[2] = { next, *sock };
+        int has_config = 0;
+        int ready;
+
+        if (os_event_try(plugin->reset_signal) == 0) {
+            net_close(next);
+            delete decoder;
+            decoder = NULL;
+            goto RESTART;
         }
-        else if (plugin->video_format == FORMAT_MJPG) {
-            init = ((MJpegDecoder*)decoder)->init();
+
+        if (os_gettime_ns() - start > SWITCH_TIMEOUT_NS) {
+            elog("switch: no keyframe from the new stream");
+            goto fail;
         }
-        else {
-            init = false;
+
+        ready = net_wait_readable(socks, *sock == INVALID_SOCKET ? 1 : 2, 100, &plugin->cancel);
+        if (ready < 0)
+            goto fail;
+
+        if (ready & 2) {
+            if (!recv_video_frame(plugin, *sock)) {
+                // Likely the phone only serves one stream at a time
+                dlog("switch: old stream closed");
+                plugin->video_progress = 0;
+                watch_socket(plugin, &plugin->video_sock, INVALID_SOCKET);
+                net_close(*sock);
+                *sock = INVALID_SOCKET;
+            }
         }
 
-        plugin->obs_video_frame.format = VIDEO_FORMAT_NONE;
-        plugin->obs_video_frame.range  = VIDEO_RANGE_DEFAULT;
-        if (init) {
-            comms_task(CommsTask::TALLY);
-            droidcam_signal(plugin->source, "droidcam_connect");
-        } else {
-            elog("could not initialize decoder");
-            decoder->failed = true;
-            goto FAILED;
+        if (ready & 1) {
+            data_packet = read_frame(decoder, next, &plugin->cancel, &has_config);
+            if (!data_packet)
+                goto fail;
+
+            if (format != FORMAT_AVC || h264_is_keyframe(data_packet->data, data_packet->used))
+                break;
+
+            decoder->push_empty_packet(data_packet);
+            data_packet = NULL;
         }
     }
 
-    decoder->push_ready_packet(data_packet);
+    if (!data_packet)
+        goto fail;
+
+    // Let the old decoder finish what it has, then hand over
+    if (*sock != INVALID_SOCKET) {
+        watch_socket(plugin, &plugin->video_sock, INVALID_SOCKET);
+        net_close(*sock);
+    }
+    if (plugin->video_decoder) {
+        Decoder *old = plugin->video_decoder;
+        video_decoder_drain(plugin, old);
+        plugin->video_decoder = NULL;
+        delete old;
+    }
+
+    *sock = next;
+    watch_socket(plugin, &plugin->video_sock, next);
+    plugin->stream_format = format;
+    recording_start(plugin);
+    plugin->obs_video_frame.format = VIDEO_FORMAT_NONE;
+    plugin->obs_video_frame.range  = VIDEO_RANGE_DEFAULT;
+    video_decoder_started(plugin, decoder);
+    plugin->video_decoder = decoder;
+    plugin->video_last_pts = 0;
+    plugin->video_progress = 0;
+    video_packet_received(plugin, data_packet);
+    queue_video_frame(plugin, decoder, data_packet);
+    ilog("switched video in %llu ms", (unsigned long long) ((os_gettime_ns() - start) / 1000000));
     return true;
+
+    fail:
+    if (decoder) {
+        if (data_packet) decoder->push_empty_packet(data_packet);
+        delete decoder;
+    }
+    if (next != INVALID_SOCKET)
+        net_close(next);
+
+    os_event_signal(plugin->reset_signal);
+    return false;
 }
 
 static void *video_thread(void *data) {
     droidcam_obs_source *plugin = (droidcam_obs_source*)(data);
-    const char *obs_version_str = obs_get_version_string();
     socket_t sock = INVALID_SOCKET;
     char remote_url[256];
     char video_req[256];
     int video_req_len = 0;
-
-    #if DROIDCAM_OVERRIDE
-    // todo: dont do this
-    char obs_version_str_flat[4];
-    obs_version_str_flat[0] = obs_version_str[0];
-    obs_version_str_flat[1] = obs_version_str[2];
-    obs_version_str_flat[2] = obs_version_str[4];
-    obs_version_str_flat[3] = 0;
-    #endif
-
+    bool dropped = false;
+    bool failover = false;
+    bool blanked = false;
+    uint64_t seen;
 
     ilog("video_thread start");
 
     // Preload devices if plugin is created already active
-    // (ex. when obs is re-launched)
-    // This saves an unnecessary initial SLOW_LOOP
+    // (ex. when obs is re-launched), meanwhile try the path
+    // that worked last time. This saves an unnecessary initial SLOW_LOOP
     if (plugin->activated) {
-        switch (plugin->device_info.type) {
-            case DeviceType::MDNS:
-                plugin->mdnsMgr.Reload();
-                plugin->mdnsMgr.ResetIter();
-                break;
-#ifndef _DISABLE_ADB
-            case DeviceType::ADB:
-                plugin->adbMgr.Reload();
-                plugin->adbMgr.ResetIter();
-                break;
-#endif
-            case DeviceType::IOS:
-                plugin->iosMgr.Reload();
-                plugin->iosMgr.ResetIter();
-                break;
-            case DeviceType::WIFI:
-            case DeviceType::NONE:
-                break;
-        }
+        discovery_start(plugin, plugin->device_info.type);
+        plugin->launch_path = true;
     }
 
     while (SOURCE_EXISTS()) {
+        seen = plugin->wake_gen;
         if (plugin->activated && plugin->is_showing) {
             if (plugin->video_running) {
+                if (os_event_try(plugin->reset_signal) == 0
+                    && video_switch(plugin, &sock))
+                    continue;
+
                 if (os_event_try(plugin->reset_signal) == EAGAIN
                     && recv_video_frame(plugin, sock))
                     continue;
 
                 plugin->video_running = false;
+                plugin->video_progress = 0;
                 dlog("closing failed video socket %d", sock);
+                watch_socket(plugin, &plugin->video_sock, INVALID_SOCKET);
                 net_close(sock);
                 sock = INVALID_SOCKET;
+
+                // Renegotiating, reconnect right away
+                if (os_event_try(plugin->reset_signal) == 0)
+                    goto LOOP;
+
+                dropped = true;
+
+                // The watchdog cut a stalled stream, try the other transport
+                // right away rather than after the slow retry
+                if (plugin->stall_time != 0) {
+                    failover = session_failover(plugin);
+                    goto LOOP;
+                }
                 goto SLOW_LOOP;
             }
 
-            if ((sock = connect(plugin)) == INVALID_SOCKET)
+            // Another source has the device up already, use its frames
+            if (!plugin->owner && shared_attach(plugin)) {
+                os_event_reset(plugin->reset_signal);
+                blanked = false;
+            }
+
+            if (plugin->owner) {
+                if (!shared_following(plugin) || os_event_try(plugin->reset_signal) == 0)
+                    goto LOOP;
+
+                plugin_wait(plugin, seen, MILLI_SEC / 2);
+                continue;
+            }
+
+            if (plugin->counters.session_start == 0) {
+                plugin->counters.session_start = os_gettime_ns();
+                plugin->counters.first_frame_ms = 0;
+            }
+
+            if (!session_setup(plugin))
                 goto SLOW_LOOP;
 
-            video_req_len = snprintf(video_req, sizeof(video_req), VIDEO_REQ,
-                VideoFormatNames[plugin->video_format][1],
-                Resolutions[plugin->video_resolution],
-                plugin->usb_port,
-                os_name_version,
-                #if DROIDCAM_OVERRIDE
-                "", obs_version_str_flat, 5912);
-                #else
-                obs_version_str, PLUGIN_VERSION_STR, 5912);
-                #endif
+            if ((sock = connect(plugin)) == INVALID_SOCKET) {
+                if (plugin->session.cached) {
+                    // Stale, go with what discovery finds instead
+                    ilog("last known path failed, waiting for discovery");
+                    discovery_wait(plugin, plugin->session.type);
+                    goto LOOP;
+                }
+                goto SLOW_LOOP;
+            }
 
-            dlog("%s", video_req);
+            video_params(plugin);
+            plugin->stream_format = plugin->video_format;
+            video_req_len = video_request(plugin, plugin->stream_format, video_req, sizeof(video_req));
             if (net_send_all(sock, video_req, video_req_len) <= 0) {
                 elog("send(/video) failed");
                 net_close(sock);
                 sock = INVALID_SOCKET;
 
                 SLOW_LOOP:
-                os_sleep_ms(MILLI_SEC * 2);
+                plugin_wait(plugin, seen, MILLI_SEC * 2);
                 goto LOOP;
             }
 
             set_recv_buf_len(sock, 65536 * 4);
+            plugin->clock.Reset();
+            plugin->video_last_ts = 0;
+            plugin->video_last_pts = 0;
+            plugin->video_progress = 0;
+            watch_socket(plugin, &plugin->video_sock, sock);
             plugin->video_running = true;
+            blanked = false;
+            if (dropped) {
+                plugin->counters.reconnects++;
+                dropped = false;
+            }
+            if (failover) {
+                plugin->counters.failovers++;
+                failover = false;
+            }
             dlog("starting video via socket %d", sock);
 
+            // Bring up audio and comms right away over the same path
+            plugin_wake(plugin);
+            session_remember(plugin);
+            recording_start(plugin);
+            shared_publish(plugin);
+
+            DeviceType type = plugin->session.type;
             int port = (
 #ifndef _DISABLE_ADB
-                        plugin->device_info.type == DeviceType::ADB ||
+                        type == DeviceType::ADB ||
 #endif
-                        plugin->device_info.type == DeviceType::IOS
+                        type == DeviceType::IOS
             )
                 ? plugin->usb_port
                 : plugin->device_info.port;
 
+            if (type == DeviceType::MDNS)
+                port = plugin->session.port;
+
             if (port > 0) {
-                snprintf(remote_url, sizeof(remote_url), "http://%s:%d", plugin->device_info.ip, port);
+                snprintf(remote_url, sizeof(remote_url), "http://%s:%d",
+                    type == DeviceType::MDNS ? plugin->session.host
+                    : is_usb(type) ? localhost_ip : plugin->device_info.ip, port);
                 obs_data_t *settings = obs_source_get_settings(plugin->source);
                 obs_data_set_string(settings, "remote_url", remote_url);
                 obs_data_release(settings);
@@ -474,14 +1556,27 @@ static void *video_thread(void *data) {
         }
         // else: not activated
         video_req_len = 0;
+        dropped = false;
+        failover = false;
+        plugin->counters.session_start = 0;
+        plugin->stall_time = 0;
 
         LOOP:
         if (plugin->video_running) {
             plugin->video_running = false;
         }
+        plugin->video_progress = 0;
+
+        shared_release(plugin);
+        session_reset(plugin);
+        plugin->counters.QueueDepth(0);
+        plugin->counters.AudioQueueDepth(0);
+        plugin->counters.Tick(os_gettime_ns());
 
+        recording_stop(plugin);
         if (sock != INVALID_SOCKET) {
             dlog("closing active video socket %d", sock);
+            watch_socket(plugin, &plugin->video_sock, INVALID_SOCKET);
             net_close(sock);
             sock = INVALID_SOCKET;
         }
@@ -490,13 +1585,11 @@ static void *video_thread(void *data) {
             if (plugin->video_decoder->ready)
                 droidcam_signal(plugin->source, "droidcam_disconnect");
 
-            while (plugin->video_decoder->recieveQueue.items.size() < plugin->video_decoder->alloc_count
-                    && SOURCE_EXISTS())
-            {
-                dlog("waiting for decode thread: %lu/%lu",
-                    plugin->video_decoder->recieveQueue.items.size(),
-                    plugin->video_decoder->alloc_count);
-                os_sleep_ms(MILLI_SEC / FPS);
+            video_decoder_drain(plugin, plugin->video_decoder);
+
+            if (plugin->latency.total.Count()) {
+                latency_log(plugin);
+                plugin->latency.Reset();
             }
 
             dlog("release video_decoder");
@@ -504,13 +1597,30 @@ static void *video_thread(void *data) {
             plugin->video_decoder = NULL;
         }
 
-        obs_source_output_video2(plugin->source, NULL);
-        os_sleep_ms(MILLI_SEC / FPS);
+        // Keep the last frame up while renegotiating or getting over a stall
+        uint64_t stalled = plugin->stall_time;
+        if (!blanked && os_event_try(plugin->reset_signal) == EAGAIN
+            && (stalled == 0 || os_gettime_ns() - stalled > STALL_HOLD_NS)) {
+            obs_source_output_video2(plugin->source, NULL);
+            blanked = true;
+        }
+
+        // Reconnecting goes round again shortly, otherwise there's
+        // nothing to do until the source is activated or shown
+        if (plugin->activated && plugin->is_showing)
+            os_sleep_ms(MILLI_SEC / FPS);
+        else
+            plugin_wait(plugin, seen, 0);
     }
 
     ilog("video_thread end");
     plugin->video_running = false;
-    if (sock != INVALID_SOCKET) net_close(sock);
+    shared_release(plugin);
+    recording_stop(plugin);
+    if (sock != INVALID_SOCKET) {
+        watch_socket(plugin, &plugin->video_sock, INVALID_SOCKET);
+        net_close(sock);
+    }
     return NULL;
 }
 
@@ -520,15 +1630,18 @@ do_audio_frame(droidcam_obs_source *plugin, socket_t sock) {
     if (!decoder) {
         dlog("create audio decoder");
         decoder = new FFMpegDecoder();
+        decoder->counters = &plugin->counters;
         plugin->audio_decoder = decoder;
     }
 
     int has_config = 0;
-    bool got_output;
-    DataPacket* data_packet = read_frame(decoder, sock, &has_config);
+    DataPacket* data_packet = read_frame(decoder, sock, &plugin->cancel, &has_config);
     if (!data_packet)
         return false;
 
+    tap_publish(plugin, TAP_AUDIO, data_packet, has_config);
+    plugin->clock.Update(1, data_packet->pts, data_packet->ts_header);
+
     // NOTE: data_packet must be properly disposed from here
 
     // Decoder failures should not happen generally.
@@ -559,37 +1672,155 @@ do_audio_frame(droidcam_obs_source *plugin, socket_t sock) {
     }
 
 
-    // decoder->push_ready_packet(data_packet);
-    if (!decoder->decode_audio(&plugin->obs_audio_frame, data_packet, &got_output)) {
-        elog("error decoding audio");
-        decoder->failed = true;
-        goto FAILED;
-    }
-
-    if (got_output) {
-        plugin->obs_audio_frame.timestamp = os_gettime_ns(); // data_packet->pts * 1000;
-        #if 0
-        dlog("output audio: %d frames: %d HZ, Fmt %d, Chan %d,  pts %lu",
-            plugin->obs_audio_frame.frames,
-            plugin->obs_audio_frame.samples_per_sec,
-            plugin->obs_audio_frame.format,
-            plugin->obs_audio_frame.speakers,
-            plugin->obs_audio_frame.timestamp);
-        #endif
-        obs_source_output_audio(plugin->source, &plugin->obs_audio_frame);
+    decoder->push_ready_packet(data_packet);
+    os_event_signal(plugin->audio_ready);
+    plugin->counters.AudioQueueDepth(decoder->decodeQueue.items.size());
+    return true;
+}
+
+// Audio jitter buffer: hold each packet until the time the fastest recent
+// audio packet would have arrived, plus a delay that follows the measured jitter.
+// Measuring against audio arrivals keeps any fixed audio vs video delay out of it.
+#define AUDIO_BUFFER_MIN_MS  20
+#define AUDIO_BUFFER_MAX_MS  150
+#define AUDIO_BASE_WINDOW_NS (5ULL * NANO_SEC)
+// Packets this far behind their playout time are dropped to catch up
+#define AUDIO_MAX_LATE_MS    100
+
+static void audio_output(droidcam_obs_source *plugin, uint64_t pts) {
+    struct obs_source_audio *frame = &plugin->obs_audio_frame;
+    frame->timestamp = stream_time(plugin, &plugin->audio_last_ts, pts);
+
+    // OBS ran dry if the previous frame finished playing well before this one
+    uint64_t now = os_gettime_ns();
+    if (plugin->audio_last_output
+        && now > plugin->audio_last_output + plugin->audio_last_duration * 2)
+        plugin->counters.audio_underruns++;
+
+    plugin->audio_last_output = now;
+    plugin->audio_last_duration = frame->samples_per_sec
+        ? (uint64_t) frame->frames * NANO_SEC / frame->samples_per_sec
+        : 0;
+    #if 0
+    dlog("output audio: %d frames: %d HZ, Fmt %d, Chan %d,  pts %lu",
+        frame->frames,
+        frame->samples_per_sec,
+        frame->format,
+        frame->speakers,
+        frame->timestamp);
+    #endif
+    obs_source_output_audio(plugin->source, frame);
+
+    std::lock_guard<std::mutex> lock(plugin->followers_lock);
+    for (droidcam_obs_source *follower : plugin->followers)
+        if (follower->enable_audio)
+            obs_source_output_audio(follower->source, frame);
+}
+
+static void *audio_decode_thread(void *data) {
+    droidcam_obs_source *plugin = (droidcam_obs_source*)(data);
+
+    Decoder *decoder = NULL;
+    DataPacket* data_packet = NULL;
+    bool got_output;
+
+    // Fastest audio arrival relative to the recovered clock,
+    // as the minimum over the current and the previous window
+    int64_t base_cur = INT64_MAX, base_prev = INT64_MAX;
+    uint64_t base_time = 0;
+    uint64_t due = 0;
+
+    ilog("audio_decode_thread start");
+
+    while (SOURCE_EXISTS()) {
+        if (!data_packet) {
+            if ((decoder = plugin->audio_decoder) == NULL || (data_packet = decoder->pull_ready_packet()) == NULL) {
+                os_event_wait(plugin->audio_ready);
+                continue;
+            }
+
+            uint64_t now = os_gettime_ns();
+            uint64_t mapped = plugin->clock.Map(data_packet->pts);
+            int64_t delay = (int64_t) (data_packet->ts_header - mapped);
+
+            if (now - base_time > AUDIO_BASE_WINDOW_NS) {
+                base_prev = base_cur;
+                base_cur = delay;
+                base_time = now;
+            }
+            else if (delay < base_cur) {
+                base_cur = delay;
+            }
+
+            uint64_t jitter_ms = (uint64_t) (plugin->clock.Jitter() * 3);
+            uint64_t buffer_ms = jitter_ms < AUDIO_BUFFER_MIN_MS ? AUDIO_BUFFER_MIN_MS
+                : jitter_ms > AUDIO_BUFFER_MAX_MS ? AUDIO_BUFFER_MAX_MS : jitter_ms;
+            plugin->counters.audio_buffer_ms = (uint32_t) buffer_ms;
+
+            due = mapped + (base_cur < base_prev ? base_cur : base_prev) + buffer_ms * 1000000;
+        }
+
+        if (decoder->failed)
+            goto LOOP;
+
+        {
+            uint64_t now = os_gettime_ns();
+            if (now < due) {
+                // Woken early by the next packet or by stop, either is fine
+                os_event_timedwait(plugin->audio_ready, (unsigned long) ((due - now) / 1000000));
+                continue;
+            }
+
+            if (now - due > AUDIO_MAX_LATE_MS * 1000000ULL) {
+                dlog("audio: dropping late packet, %llu ms", (unsigned long long) ((now - due) / 1000000));
+                plugin->counters.audio_dropped++;
+                goto LOOP;
+            }
+        }
+
+        if (!decoder->decode_audio(&plugin->obs_audio_frame, data_packet, &got_output)) {
+            elog("error decoding audio");
+            decoder->failed = true;
+            goto LOOP;
+        }
+
+        // Drain every frame the packet produced
+        for (uint64_t pts = data_packet->pts; got_output; ) {
+            audio_output(plugin, pts);
+
+            if (plugin->obs_audio_frame.samples_per_sec)
+                pts += (uint64_t) plugin->obs_audio_frame.frames * 1000000
+                    / plugin->obs_audio_frame.samples_per_sec;
+
+            if (!decoder->decode_audio(&plugin->obs_audio_frame, NULL, &got_output)) {
+                elog("error decoding audio");
+                decoder->failed = true;
+                break;
+            }
+        }
+
+        LOOP:
+        decoder->push_empty_packet(data_packet);
+        data_packet = NULL;
     }
 
-    decoder->push_empty_packet(data_packet);
-    return true;
+    if (data_packet)
+        decoder->push_empty_packet(data_packet);
+
+    ilog("audio_decode_thread end");
+    return NULL;
 }
 
 static void *audio_thread(void *data) {
     droidcam_obs_source *plugin = (droidcam_obs_source*)(data);
     socket_t sock = INVALID_SOCKET;
     const char *audio_req = AUDIO_REQ;
+    bool blanked = false;
+    uint64_t seen;
 
     ilog("audio_thread start");
     while (SOURCE_EXISTS()) {
+        seen = plugin->wake_gen;
         if (plugin->activated && plugin->is_showing && plugin->enable_audio) {
             if (plugin->audio_running) {
                 if (do_audio_frame(plugin, sock)) {
@@ -598,18 +1829,21 @@ static void *audio_thread(void *data) {
 
                 plugin->audio_running = false;
                 dlog("closing failed audio socket %d", sock);
+                watch_socket(plugin, &plugin->audio_sock, INVALID_SOCKET);
                 net_close(sock);
                 sock = INVALID_SOCKET;
+
+                // Cut on a stall, follow the video thread as soon as it's back
+                if (plugin->stall_time != 0)
+                    goto LOOP;
                 goto SLOW_LOOP;
             }
 
-            // connect audio only after video works
+            // connect audio only after video works,
+            // the video thread wakes us as soon as it does
             if (!plugin->video_running)
                 goto LOOP;
 
-            // no rush..
-            os_sleep_ms(MILLI_SEC);
-
             if ((sock = connect(plugin)) == INVALID_SOCKET)
                 goto SLOW_LOOP;
 
@@ -619,11 +1853,13 @@ static void *audio_thread(void *data) {
                 sock = INVALID_SOCKET;
 
                 SLOW_LOOP:
-                os_sleep_ms(MILLI_SEC * 2);
+                plugin_wait(plugin, seen, MILLI_SEC * 2);
                 goto LOOP;
             }
 
+            watch_socket(plugin, &plugin->audio_sock, sock);
             plugin->audio_running = true;
+            blanked = false;
             dlog("starting audio via socket %d", sock);
             continue;
         }
@@ -636,73 +1872,61 @@ static void *audio_thread(void *data) {
         LOOP:
         if (sock != INVALID_SOCKET) {
             dlog("closing active audio socket %d", sock);
+            watch_socket(plugin, &plugin->audio_sock, INVALID_SOCKET);
             net_close(sock);
             sock = INVALID_SOCKET;
         }
 
         if (plugin->audio_decoder) {
+            while (!plugin->audio_decoder->idle() && SOURCE_EXISTS()) {
+                dlog("waiting for audio decode thread: %lu/%lu",
+                    plugin->audio_decoder->recieveQueue.items.size(),
+                    plugin->audio_decoder->alloc_count);
+                os_sleep_ms(MILLI_SEC / FPS);
+            }
+
             dlog("release audio_decoder");
             delete plugin->audio_decoder;
             plugin->audio_decoder = NULL;
         }
 
-        if (plugin->enable_audio) obs_source_output_audio(plugin->source, NULL);
-        os_sleep_ms(MILLI_SEC / FPS);
-    }
-
-    ilog("audio_thread end");
-    plugin->audio_running = false;
-    if (sock != INVALID_SOCKET) net_close(sock);
-    return NULL;
-}
-
-static int
-basic_http(socket_t sock, char* buf, const size_t maxlen, const char *request, const size_t len) {
-    if (net_send_all(sock, request, len) <= 0) {
-        return 0;
-    }
+        plugin->audio_last_output = 0;
+        plugin->audio_last_ts = 0;
 
-    memset(buf, 0, maxlen);
-    int i = 0;
-    while (i < maxlen) {
-        int rc = net_recv(sock, &buf[i], maxlen - i);
-        if (rc > 0) {
-            i += rc;
-            continue;
+        if (!blanked && plugin->enable_audio) {
+            obs_source_output_audio(plugin->source, NULL);
+            blanked = true;
         }
 
-        #if _WIN32
-        WSAErrno();
-        if (rc < 0 && (errno == WSAEWOULDBLOCK || errno == WSAETIMEDOUT))
-            break;
-
-        #else
-        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS))
-            break;
-
-        #endif
-
-        return 0;
+        // Retry right away while video is up, else wait for it or for a change
+        if (!(plugin->activated && plugin->is_showing && plugin->enable_audio && plugin->video_running))
+            plugin_wait(plugin, seen, 0);
     }
 
-    for (i = 0; i < maxlen; i++) {
-        if (!(buf[i] == '\r' && buf[i+1] == '\n' && buf[i+2] == '\r' && buf[i+3] == '\n'))
-            continue;
-
-        return i+4;
+    ilog("audio_thread end");
+    plugin->audio_running = false;
+    if (sock != INVALID_SOCKET) {
+        watch_socket(plugin, &plugin->audio_sock, INVALID_SOCKET);
+        net_close(sock);
     }
-
-    return 0;
+    return NULL;
 }
 
+#define COMMS_TIMEOUT (MILLI_SEC * 2)
+
 static void *comms_thread(void *data) {
     droidcam_obs_source *plugin = (droidcam_obs_source*)(data);
-    socket_t sock = INVALID_SOCKET;
-    char buf[4096] = {0};
-    const size_t maxlen = sizeof(buf) - 4;
+    HttpClient http;
+    http.cancel = &plugin->cancel;
+    struct http_response resp;
+    char path[128];
+    unsigned long wait_ms = 30 * MILLI_SEC;
+
+    // What each in-flight (pipelined) request was for
+    enum { REQ_BATTERY, REQ_TALLY } sent[4];
+    int nsent;
 
     #if DROIDCAM_OVERRIDE
-    const char *battery_req = BATT_REQ;
     const int WARN = 15;
     int prevBattery = 100;
     #endif /* DROIDCAM_OVERRIDE */
@@ -711,60 +1935,47 @@ static void *comms_thread(void *data) {
 
     dlog("comms_thread start");
 
-    while ((event = os_event_timedwait(plugin->comms_signal, (30*MILLI_SEC))) != EINVAL
+    // wait_ms of 0 sleeps until signaled
+    while ((event = wait_ms ? os_event_timedwait(plugin->comms_signal, wait_ms)
+                            : os_event_wait(plugin->comms_signal)) != EINVAL
         && SOURCE_EXISTS())
     {
         os_event_reset(plugin->comms_signal);
+        wait_ms = 30 * MILLI_SEC;
 
         if (plugin->activated && plugin->video_running) {
 
-            if (sock == INVALID_SOCKET) {
-                if ((sock = connect(plugin)) == INVALID_SOCKET)
+            if (!http.Connected()) {
+                socket_t sock = connect(plugin);
+                if (sock == INVALID_SOCKET)
                     continue;
-                set_recv_timeout(sock, 1);
+                http.Attach(sock);
             }
         }
         else {
-            if (sock != INVALID_SOCKET) {
+            if (http.Connected()) {
                 #if DROIDCAM_OVERRIDE
                 prevBattery = 100;
-                buf[0] = 0;
-                signal_source_update(plugin->source, (const char*) &buf[0], 0);
+                signal_source_update(plugin->source, "", 0);
                 #endif
 
-                CLOSE:
-                dlog("closing comms socket %d // (%d) %s", sock, errno, strerror(errno));
-                net_close(sock);
-                sock = INVALID_SOCKET;
+                dlog("closing comms socket");
+                http.Close();
             }
+
+            // Nothing to poll, plugin_wake() signals when video comes up
+            wait_ms = 0;
         }
 
-        if (sock == INVALID_SOCKET)
+        if (!http.Connected())
             continue;
 
-        if (event == ETIMEDOUT) {
-            #if DROIDCAM_OVERRIDE
-            int i = basic_http(sock, buf, maxlen, battery_req, sizeof(BATT_REQ) - 1);
-            if (i > 0) {
-                int start = i;
-                for (; i < maxlen && isdigit(buf[i]); i++);
-
-                if (i > start) {
-                    buf[i++] = '%';
-                    buf[i  ] = 0;
-
-                    const char* value = (const char*) &buf[start];
-                    i = atoi(value);
-                    const int alert = (prevBattery > WARN && i <= WARN);
-                    dlog("battery %d -> %d (%s) alert=%d", prevBattery, i, value, alert);
-                    signal_source_update(plugin->source, value, alert);
-                    prevBattery = i;
-                }
-            }
-            else goto CLOSE;
+        nsent = 0;
 
-            #endif // DROIDCAM_OVERRIDE
-        }
+        #if DROIDCAM_OVERRIDE
+        if (event == ETIMEDOUT && http.Send("GET", BATT_PATH))
+            sent[nsent++] = REQ_BATTERY;
+        #endif // DROIDCAM_OVERRIDE
 
         CommsTask task;
         const char *tally = NULL;
@@ -785,25 +1996,106 @@ static void *comms_thread(void *data) {
             }
         }
 
+        bool failed = false;
         if (tally != NULL) {
-            int len = snprintf(buf, maxlen, TALLY_REQ, tally);
-            if (basic_http(sock, buf, maxlen, (const char*) &buf[0], len) > 0) {
-                dlog("comms: tally -> %s", tally);
+            snprintf(path, sizeof(path), TALLY_PATH, tally);
+            if (http.Send("PUT", path)) {
+                sent[nsent++] = REQ_TALLY;
+            } else {
+                comms_task(CommsTask::TALLY);
+                wait_ms = MILLI_SEC;
+                failed = true;
+            }
+        }
+
+        // Collect the responses, in request order
+        int rc = HTTP_OK;
+        int i = 0;
+        bool resent = false;
+
+        COLLECT:
+        for (; i < nsent; i++) {
+            if ((rc = http.Recv(&resp, COMMS_TIMEOUT)) != HTTP_OK) {
+                dlog("comms: request failed (%d)", rc);
+                failed = true;
+                break;
+            }
+
+            if (sent[i] == REQ_TALLY) {
+                dlog("comms: tally -> %s (%d)", tally, resp.status);
             }
-            else {
-                if (errno != 0) {
-                    // Try again if the request actually failed.
-                    // If there is no error, most likely the app closed the connection,
-                    // ie. tally is not supported (such as with old app versions).
-                    os_sleep_ms(MILLI_SEC * 5);
-                    comms_task(CommsTask::TALLY);
+
+            #if DROIDCAM_OVERRIDE
+            if (sent[i] == REQ_BATTERY && resp.status == 200) {
+                char *value = resp.body;
+                int end = 0;
+                while (end < 8 && isdigit(value[end])) end++;
+
+                if (end > 0) {
+                    value[end++] = '%';
+                    value[end  ] = 0;
+
+                    int level = atoi(value);
+                    const int alert = (prevBattery > WARN && level <= WARN);
+                    dlog("battery %d -> %d (%s) alert=%d", prevBattery, level, value, alert);
+                    signal_source_update(plugin->source, value, alert);
+                    prevBattery = level;
                 }
-                goto CLOSE;
+            }
+            #endif // DROIDCAM_OVERRIDE
+
+            if (!resp.keep_alive) {
+                i++;
+                failed = true;
+                break;
+            }
+        }
+
+        if (failed && http.Stale(rc) && !resent && i < nsent) {
+            // The phone dropped the idle connection before these requests
+            // got to it, that says nothing about tally support. Once more.
+            dlog("comms: idle connection was closed, sending again");
+            resent = true;
+            http.Close();
+
+            socket_t sock = connect(plugin);
+            if (sock != INVALID_SOCKET) {
+                http.Attach(sock);
+                bool ok = true;
+                for (int j = i; j < nsent && ok; j++)
+                    ok = sent[j] == REQ_TALLY
+                        ? http.Send("PUT", path)
+                        : http.Send("GET", BATT_PATH);
+
+                if (ok) {
+                    for (int j = i; j < nsent; j++)
+                        sent[j - i] = sent[j];
+                    nsent -= i;
+                    i = 0;
+                    failed = false;
+                    goto COLLECT;
+                }
+            }
+
+            // Not even that worked, try again shortly
+            rc = HTTP_ERROR;
+        }
+
+        if (!failed)
+            continue;
+
+        for (; i < nsent; i++) {
+            // If the app simply closed the connection, tally is most likely not supported
+            // (such as with old app versions). Otherwise try again shortly.
+            if (sent[i] == REQ_TALLY && rc != HTTP_CLOSED) {
+                comms_task(CommsTask::TALLY);
+                wait_ms = MILLI_SEC;
             }
         }
-    } // while (SOURCE_EXISTS)
 
-    if (sock != INVALID_SOCKET) net_close(sock);
+        dlog("closing comms socket");
+        http.Close();
+    } // while (SOURCE_EXISTS)
 
     dlog("comms_thread end");
     return NULL;
@@ -814,28 +2106,59 @@ void source_destroy(void *data) {
     ilog("destroy: \"%s\"", obs_source_get_name(plugin->source));
 
     if (plugin) {
+        // Discovery waits for phones to answer, not for us
+        plugin->mdnsMgr.Cancel();
+        plugin->iosMgr.Cancel();
+
         if (plugin->time_start != 0) {
             ilog("stopping");
             os_event_signal(plugin->stop_signal);
+            net_cancel_fire(&plugin->cancel);
+            {
+                std::lock_guard<std::mutex> lock(plugin->taps_lock);
+                for (PacketTap *tap : plugin->taps)
+                    tap->Close();
+            }
+            os_event_signal(plugin->video_ready);
+            os_event_signal(plugin->audio_ready);
+            plugin_wake(plugin);
             pthread_join(plugin->video_thread, NULL);
             pthread_join(plugin->audio_thread, NULL);
 
             os_event_signal(plugin->comms_signal);
             pthread_join(plugin->comms_thread, NULL);
             pthread_join(plugin->video_decode_thread, NULL);
+            pthread_join(plugin->audio_decode_thread, NULL);
+            pthread_join(plugin->watchdog_thread, NULL);
 
             os_event_destroy(plugin->stop_signal);
             os_event_destroy(plugin->reset_signal);
             os_event_destroy(plugin->comms_signal);
+            os_event_destroy(plugin->video_ready);
+            os_event_destroy(plugin->audio_ready);
         }
 
+        // Name lookups still running report back to this source
+        #ifndef _DISABLE_ADB
+        plugin->adbMgr.WaitModels();
+        #endif
+        plugin->iosMgr.WaitModels();
+
         ilog("cleanup");
         if (plugin->video_decoder) delete plugin->video_decoder;
         if (plugin->audio_decoder) delete plugin->audio_decoder;
+        net_cancel_free(&plugin->cancel);
         delete plugin;
     }
 }
 
+// A device name came in, show it and remember it for next time
+static void models_changed(void *data) {
+    droidcam_obs_source *plugin = (droidcam_obs_source*)(data);
+    model_cache_save();
+    obs_source_update_properties(plugin->source);
+}
+
 #if DROIDCAM_OVERRIDE
 static const char *droidcam_signals[] = {
     "void droidcam_source_status(in out int status)",
@@ -856,13 +2179,83 @@ void *source_create(obs_data_t *settings, obs_source_t *source) {
     plugin->audio_decoder = NULL;
     plugin->video_decoder = NULL;
     plugin->usb_port = 0;
+    plugin->audio_last_output = 0;
+    plugin->audio_last_duration = 0;
+    plugin->video_last_ts = 0;
+    plugin->audio_last_ts = 0;
+    plugin->wake_gen = 0;
+    plugin->video_sock = INVALID_SOCKET;
+    plugin->audio_sock = INVALID_SOCKET;
+    plugin->video_progress = 0;
+    plugin->stall_time = 0;
+    plugin->video_last_pts = 0;
+    plugin->failover_type = DeviceType::NONE;
+    plugin->launch_path = false;
+    plugin->owner = NULL;
+    plugin->shared_id[0] = 0;
+    #ifndef _DISABLE_ADB
+    plugin->adbMgr.models_changed = models_changed;
+    plugin->adbMgr.models_data = plugin;
+    #endif
+    plugin->iosMgr.models_changed = models_changed;
+    plugin->iosMgr.models_data = plugin;
     plugin->use_hw = obs_data_get_bool(settings, OPT_USE_HW_ACCEL);
     plugin->video_format = (VideoFormat) obs_data_get_int(settings, OPT_VIDEO_FORMAT);
+    plugin->stream_format = plugin->video_format;
     plugin->video_resolution = obs_data_get_int(settings, OPT_RESOLUTION);
+    plugin->active_resolution = plugin->video_resolution;
+    plugin->auto_resolution = obs_data_get_bool(settings, OPT_AUTO_RESOLUTION);
+    plugin->resolution_window = 0;
     plugin->enable_audio  = obs_data_get_bool(settings, OPT_ENABLE_AUDIO);
     plugin->deactivateWNS = obs_data_get_bool(settings, OPT_DEACTIVATE_WNS);
     plugin->activated = obs_data_get_bool(settings, OPT_IS_ACTIVATED);
+    obs_source_set_async_decoupled(source, !obs_data_get_bool(settings, OPT_SYNC_AV));
     obs_data_set_string(settings, "remote_url", "");
+    obs_data_set_string(settings, OPT_STATS_TEXT, "");
+
+    proc_handler_t *ph = obs_source_get_proc_handler(source);
+    proc_handler_add(ph, "void droidcam_stats(out string report, out int bitrate, out float fps,"
+        " out int frames, out int discarded, out int reconnects, out int mem_used, out int mem_peak)",
+        [](void *data, calldata_t *cd) {
+            droidcam_obs_source *plugin = (droidcam_obs_source*)(data);
+            SourceCounters *c = &plugin->counters;
+            char report[1024];
+            c->Format(report, sizeof(report), os_gettime_ns());
+            calldata_set_string(cd, "report", report);
+            calldata_set_int(cd, "bitrate", (long long) c->bitrate.load());
+            calldata_set_float(cd, "fps", c->frame_rate.load());
+            calldata_set_int(cd, "frames", (long long) c->frames.load());
+            calldata_set_int(cd, "discarded", (long long) (c->discard_catchup
+                + c->discard_overflow + c->discard_failed + c->discard_budget));
+            calldata_set_int(cd, "reconnects", (long long) c->reconnects.load());
+            calldata_set_int(cd, "mem_used", (long long) c->mem_used.load());
+            calldata_set_int(cd, "mem_peak", (long long) c->mem_peak.load());
+        }, plugin);
+
+    proc_handler_add(ph, "void droidcam_latency(out string report)",
+        [](void *data, calldata_t *cd) {
+            droidcam_obs_source *plugin = (droidcam_obs_source*)(data);
+            char report[512];
+            plugin->latency.Format(report, sizeof(report));
+            latency_log(plugin);
+            calldata_set_string(cd, "report", report);
+        }, plugin);
+
+    // Packet taps: the caller owns the PacketTap and must remove it before
+    // freeing it, sources close their taps when destroyed
+    proc_handler_add(ph, "void droidcam_tap_add(in ptr tap)",
+        [](void *data, calldata_t *cd) {
+            droidcam_obs_source *plugin = (droidcam_obs_source*)(data);
+            PacketTap *tap = (PacketTap*) calldata_ptr(cd, "tap");
+            if (tap) tap_add(plugin, tap);
+        }, plugin);
+
+    proc_handler_add(ph, "void droidcam_tap_remove(in ptr tap)",
+        [](void *data, calldata_t *cd) {
+            droidcam_obs_source *plugin = (droidcam_obs_source*)(data);
+            PacketTap *tap = (PacketTap*) calldata_ptr(cd, "tap");
+            if (tap) tap_remove(plugin, tap);
+        }, plugin);
 
     #if DROIDCAM_OVERRIDE
     plugin->deactivateWNS = true;
@@ -925,6 +2318,10 @@ void *source_create(obs_data_t *settings, obs_source_t *source) {
         //     plugin->is_showing = true;
     }
 
+    // Without it waits still end, only slower
+    if (!net_cancel_init(&plugin->cancel))
+        elog("cancel token setup failed");
+
     if (os_event_init(&plugin->stop_signal, OS_EVENT_TYPE_MANUAL) != 0) {
         source_destroy(plugin);
         return NULL;
@@ -940,6 +2337,16 @@ void *source_create(obs_data_t *settings, obs_source_t *source) {
         return NULL;
     }
 
+    if (os_event_init(&plugin->video_ready, OS_EVENT_TYPE_AUTO) != 0) {
+        source_destroy(plugin);
+        return NULL;
+    }
+
+    if (os_event_init(&plugin->audio_ready, OS_EVENT_TYPE_AUTO) != 0) {
+        source_destroy(plugin);
+        return NULL;
+    }
+
     if (pthread_create(&plugin->video_thread, NULL, video_thread, plugin) != 0) {
         source_destroy(plugin);
         return NULL;
@@ -950,6 +2357,11 @@ void *source_create(obs_data_t *settings, obs_source_t *source) {
         return NULL;
     }
 
+    if (pthread_create(&plugin->audio_decode_thread, NULL, audio_decode_thread, plugin) != 0) {
+        source_destroy(plugin);
+        return NULL;
+    }
+
     if (pthread_create(&plugin->comms_thread, NULL, comms_thread, plugin) != 0) {
         source_destroy(plugin);
         return NULL;
@@ -960,6 +2372,11 @@ void *source_create(obs_data_t *settings, obs_source_t *source) {
         return NULL;
     }
 
+    if (pthread_create(&plugin->watchdog_thread, NULL, watchdog_thread, plugin) != 0) {
+        source_destroy(plugin);
+        return NULL;
+    }
+
     plugin->time_start = os_gettime_ns() / 100;
     return plugin;
 }
@@ -991,6 +2408,7 @@ void source_show(void *data) {
 
     plugin->tally.on_preview = true;
     comms_task(CommsTask::TALLY);
+    plugin_wake(plugin);
     dlog("source_show: is_showing=%d", plugin->is_showing);
 }
 
@@ -1001,6 +2419,7 @@ void source_hide(void *data) {
 
     plugin->tally.on_preview = false;
     comms_task(CommsTask::TALLY);
+    plugin_wake(plugin);
     dlog("source_hide: is_showing=%d", plugin->is_showing);
 }
 
@@ -1023,6 +2442,9 @@ static inline void toggle_ppts(obs_properties_t *ppts, bool enable) {
     obs_property_set_enabled(obs_properties_get(ppts, OPT_APP_PORT)    , enable);
     obs_property_set_enabled(obs_properties_get(ppts, OPT_ENABLE_AUDIO), enable);
     obs_property_set_enabled(obs_properties_get(ppts, OPT_USE_HW_ACCEL), enable);
+    obs_property_set_enabled(obs_properties_get(ppts, OPT_RECORD)      , enable);
+    obs_property_set_enabled(obs_properties_get(ppts, OPT_RECORD_PATH) , enable);
+    obs_property_set_enabled(obs_properties_get(ppts, OPT_RECORD_FORMAT), enable);
 }
 
 void resolve_device_type(struct active_device_info *device_info, void* data) {
@@ -1032,7 +2454,7 @@ void resolve_device_type(struct active_device_info *device_info, void* data) {
     const char *id = device_info->id;
     droidcam_obs_source *plugin = (droidcam_obs_source*)(data);
 
-    Device* dev;
+    DeviceRef dev;
 #ifndef _DISABLE_ADB
     AdbMgr* adbMgr = &plugin->adbMgr;
 #endif
@@ -1048,7 +2470,7 @@ void resolve_device_type(struct active_device_info *device_info, void* data) {
 #ifndef _DISABLE_ADB
     dev = adbMgr->GetDevice(id);
     if (dev) {
-        if (adbMgr->DeviceOffline(dev)) {
+        if (adbMgr->DeviceOffline(dev.get())) {
             elog("adb device is offline");
             goto out;
         }
@@ -1088,6 +2510,7 @@ static bool video_parms_changed(void *data, obs_properties_t*, obs_property_t*,
         plugin->video_format, VideoFormatNames[plugin->video_format][1],
         plugin->video_resolution, Resolutions[plugin->video_resolution]);
     os_event_signal(plugin->reset_signal);
+    plugin_wake(plugin);
     return false;
 }
 
@@ -1191,6 +2614,8 @@ static bool connect_clicked(obs_properties_t *ppts, obs_property_t *p, void *dat
     obs_data_set_string(settings, OPT_ACTIVE_DEV_ID, device_info->id);
     obs_data_set_string(settings, OPT_ACTIVE_DEV_IP, device_info->ip);
     obs_data_set_int(settings, OPT_ACTIVE_DEV_TYPE, (long long) device_info->type);
+    // don't hold on to the discovered device's address, it goes away with the next reload
+    device_info->ip = obs_data_get_string(settings, OPT_ACTIVE_DEV_IP);
     obs_data_set_bool(settings, OPT_IS_ACTIVATED, true);
     plugin->activated = true;
     ilog("activated: id=%s type=%d ip=%s port=%d", device_info->id, (int)device_info->type, device_info->ip, device_info->port);
@@ -1199,14 +2624,29 @@ static bool connect_clicked(obs_properties_t *ppts, obs_property_t *p, void *dat
         plugin->video_resolution, Resolutions[plugin->video_resolution]);
 
     out:
+    plugin_wake(plugin);
     obs_property_set_enabled(cp, true);
     if (settings) obs_data_release(settings);
     return true;
 }
 
+static void stats_update(droidcam_obs_source *plugin) {
+    char report[1024];
+    plugin->counters.Format(report, sizeof(report), os_gettime_ns());
+
+    obs_data_t *settings = obs_source_get_settings(plugin->source);
+    obs_data_set_string(settings, OPT_STATS_TEXT, report);
+    obs_data_release(settings);
+}
+
+static bool stats_clicked(obs_properties_t *, obs_property_t *, void *data) {
+    stats_update((droidcam_obs_source*)(data));
+    return true;
+}
+
 static bool refresh_clicked(obs_properties_t *ppts, obs_property_t *p, void *data) {
     droidcam_obs_source *plugin = (droidcam_obs_source*)(data);
-    Device* dev;
+    DeviceListRef list;
 #ifndef _DISABLE_ADB
     AdbMgr *adbMgr = &plugin->adbMgr;
 #endif
@@ -1232,26 +2672,29 @@ static bool refresh_clicked(obs_properties_t *ppts, obs_property_t *p, void *dat
     p = obs_properties_get(ppts, OPT_DEVICE_LIST);
     obs_property_list_clear(p);
 #ifndef _DISABLE_ADB
-    adbMgr->ResetIter();
-    while ((dev = adbMgr->NextDevice()) != NULL) {
-        adbMgr->GetModel(dev);
+    adbMgr->WaitReload();
+    adbMgr->ResolveModels();
+    list = adbMgr->Devices();
+    for (auto dev : list->devices) {
         char *label = dev->model[0] != 0 ? dev->model : dev->serial;
         dlog("ADB: label:%s serial:%s", label, dev->serial);
         size_t idx = obs_property_list_add_string(p, label, dev->serial);
-        if (adbMgr->DeviceOffline(dev))
+        if (adbMgr->DeviceOffline(dev.get()))
             obs_property_list_item_disable(p, idx, true);
     }
 #endif
-    iosMgr->ResetIter();
-    while ((dev = iosMgr->NextDevice()) != NULL) {
-        iosMgr->GetModel(dev);
+    iosMgr->WaitReload();
+    iosMgr->ResolveModels();
+    list = iosMgr->Devices();
+    for (auto dev : list->devices) {
         char *label = dev->model[0] != 0 ? dev->model : dev->serial;
         dlog("IOS: handle:%d label:%s serial:%s", dev->handle, label, dev->serial);
         obs_property_list_add_string(p, label, dev->serial);
     }
 
-    mdnsMgr->ResetIter();
-    while ((dev = mdnsMgr->NextDevice()) != NULL) {
+    mdnsMgr->WaitReload();
+    list = mdnsMgr->Devices();
+    for (auto dev : list->devices) {
         char *label = dev->model[0] != 0 ? dev->model : dev->serial;
         dlog("MDNS: label:%s serial:%s", label, dev->serial);
         obs_property_list_add_string(p, label, dev->serial);
@@ -1267,7 +2710,8 @@ void source_update(void *data, obs_data_t *settings) {
     plugin->deactivateWNS = obs_data_get_bool(settings, OPT_DEACTIVATE_WNS);
     plugin->enable_audio  = obs_data_get_bool(settings, OPT_ENABLE_AUDIO);
     plugin->use_hw = obs_data_get_bool(settings, OPT_USE_HW_ACCEL);
-    bool sync_av = false; // obs_data_get_bool(settings, OPT_SYNC_AV);
+    plugin->auto_resolution = obs_data_get_bool(settings, OPT_AUTO_RESOLUTION);
+    bool sync_av = obs_data_get_bool(settings, OPT_SYNC_AV);
     bool activated = obs_data_get_bool(settings, OPT_IS_ACTIVATED);
 
     dlog("plugin_udpate: activated=%d (actual=%d) audio=%d sync_av=%d",
@@ -1281,6 +2725,7 @@ void source_update(void *data, obs_data_t *settings) {
     if (activated != plugin->activated) {
         plugin->activated = activated;
     }
+    plugin_wake(plugin);
 }
 
 obs_properties_t *source_properties(void *data) {
@@ -1308,6 +2753,7 @@ obs_properties_t *source_properties(void *data) {
     }
 
     obs_property_set_modified_callback2(cp, video_parms_changed, data);
+    obs_properties_add_bool(ppts, OPT_AUTO_RESOLUTION, TEXT_AUTO_RESOLUTION);
 
     cp = obs_properties_add_list(ppts, OPT_VIDEO_FORMAT, TEXT_VIDEO_FORMAT, OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
     for (size_t i = 0; i < ARRAY_LEN(VideoFormatNames); i++)
@@ -1318,30 +2764,30 @@ obs_properties_t *source_properties(void *data) {
     obs_properties_add_list(ppts, OPT_DEVICE_LIST, TEXT_DEVICE, OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
     cp = obs_properties_get(ppts, OPT_DEVICE_LIST);
     if (plugin) {
-        Device* dev;
+        DeviceListRef list;
 #ifndef _DISABLE_ADB
         AdbMgr *adbMgr = &plugin->adbMgr;
 #endif
         USBMux* iosMgr = &plugin->iosMgr;
         MDNS  *mdnsMgr = &plugin->mdnsMgr;
 #ifndef _DISABLE_ADB
-        adbMgr->ResetIter();
-        while ((dev = adbMgr->NextDevice()) != NULL) {
+        list = adbMgr->Devices();
+        for (auto dev : list->devices) {
             char *label = dev->model[0] != 0 ? dev->model : dev->serial;
             size_t idx = obs_property_list_add_string(cp, label, dev->serial);
-            if (adbMgr->DeviceOffline(dev))
+            if (adbMgr->DeviceOffline(dev.get()))
                 obs_property_list_item_disable(cp, idx, true);
         }
 #endif
 
-        iosMgr->ResetIter();
-        while ((dev = iosMgr->NextDevice()) != NULL) {
+        list = iosMgr->Devices();
+        for (auto dev : list->devices) {
             char *label = dev->model[0] != 0 ? dev->model : dev->serial;
             obs_property_list_add_string(cp, label, dev->serial);
         }
 
-        mdnsMgr->ResetIter();
-        while ((dev = mdnsMgr->NextDevice()) != NULL) {
+        list = mdnsMgr->Devices();
+        for (auto dev : list->devices) {
             char *label = dev->model[0] != 0 ? dev->model : dev->serial;
             obs_property_list_add_string(cp, label, dev->serial);
         }
@@ -1355,12 +2801,27 @@ obs_properties_t *source_properties(void *data) {
     obs_properties_add_int(ppts, OPT_APP_PORT, "DroidCam Port", 1, 65535, 1);
 
     obs_properties_add_bool(ppts, OPT_ENABLE_AUDIO, TEXT_ENABLE_AUDIO);
-    // obs_properties_add_bool(ppts, OPT_SYNC_AV, TEXT_SYNC_AV);
+    obs_properties_add_bool(ppts, OPT_SYNC_AV, TEXT_SYNC_AV);
     #if DROIDCAM_OVERRIDE==0
     obs_properties_add_bool(ppts, OPT_DEACTIVATE_WNS, TEXT_DWNS);
     #endif
     obs_properties_add_bool(ppts, OPT_USE_HW_ACCEL, TEXT_USE_HW_ACCEL);
 
+    obs_properties_add_bool(ppts, OPT_RECORD, TEXT_RECORD);
+    obs_properties_add_path(ppts, OPT_RECORD_PATH, TEXT_RECORD_PATH, OBS_PATH_DIRECTORY, NULL, NULL);
+    obs_property_t *rf = obs_properties_add_list(ppts, OPT_RECORD_FORMAT, TEXT_RECORD_FORMAT, OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
+    obs_property_list_add_string(rf, "Matroska (.mkv)", "mkv");
+    obs_property_list_add_string(rf, "Fragmented MP4 (.mp4)", "mp4");
+
+    if (plugin) {
+        obs_properties_t *stats = obs_properties_create();
+        obs_property_t *sp = obs_properties_add_text(stats, OPT_STATS_TEXT, "", OBS_TEXT_MULTILINE);
+        obs_property_set_enabled(sp, false);
+        obs_properties_add_button(stats, OPT_STATS_REFRESH, TEXT_STATS_REFRESH, stats_clicked);
+        obs_properties_add_group(ppts, OPT_STATS, TEXT_STATS, OBS_GROUP_NORMAL, stats);
+        stats_update(plugin);
+    }
+
     if (activated) {
         toggle_ppts(ppts, false);
         obs_property_set_description(cp, TEXT_DEACTIVATE);
@@ -1374,8 +2835,11 @@ void source_defaults(obs_data_t *settings) {
     obs_data_set_default_bool(settings, OPT_UHD_UNLOCK, false);
     obs_data_set_default_bool(settings, OPT_IS_ACTIVATED, false);
     obs_data_set_default_bool(settings, OPT_SYNC_AV, false);
+    obs_data_set_default_bool(settings, OPT_AUTO_RESOLUTION, false);
     obs_data_set_default_bool(settings, OPT_USE_HW_ACCEL, true);
     obs_data_set_default_bool(settings, OPT_ENABLE_AUDIO, false);
     obs_data_set_default_bool(settings, OPT_DEACTIVATE_WNS, false);
+    obs_data_set_default_bool(settings, OPT_RECORD, false);
+    obs_data_set_default_string(settings, OPT_RECORD_FORMAT, "mkv");
     obs_data_set_default_int(settings, OPT_APP_PORT, DEFAULT_PORT);
 }
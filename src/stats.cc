@@ -0,0 +1,242 @@
+/*
+Copyright (C) 2022 DEV47APPS, github.com/dev47apps
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include "stats.h"
+
+// Values below SUB_COUNT get exact buckets, above that the bucket is
+// picked by the top SUB_BITS+1 bits of the value.
+static int bucket_index(uint64_t value) {
+    int shift = 0;
+    if (value < (uint64_t) Histogram::SUB_COUNT)
+        return (int) value;
+
+    while ((value >> shift) >= (uint64_t) (Histogram::SUB_COUNT * 2))
+        shift++;
+
+    if (shift > Histogram::MAX_SHIFT)
+        return Histogram::BUCKETS - 1;
+
+    return (shift + 1) * Histogram::SUB_COUNT + (int) ((value >> shift) - Histogram::SUB_COUNT);
+}
+
+// Middle of the range covered by a bucket
+static uint64_t bucket_value(int index) {
+    if (index < Histogram::SUB_COUNT)
+        return index;
+
+    int shift = index / Histogram::SUB_COUNT - 1;
+    uint64_t low = (uint64_t) (index % Histogram::SUB_COUNT + Histogram::SUB_COUNT) << shift;
+    return low + ((UINT64_C(1) << shift) >> 1);
+}
+
+void Histogram::Record(uint64_t value) {
+    counts[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t prev = max.load(std::memory_order_relaxed);
+    while (value > prev && !max.compare_exchange_weak(prev, value, std::memory_order_relaxed))
+        ;
+}
+
+void Histogram::Reset(void) {
+    for (int i = 0; i < BUCKETS; i++)
+        counts[i].store(0, std::memory_order_relaxed);
+
+    total.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::Percentile(double p) const {
+    uint64_t count = Count();
+    if (count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) (p / 100.0 * (double) count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t v = bucket_value(i);
+            uint64_t m = Max();
+            return v < m ? v : m;
+        }
+    }
+
+    return Max();
+}
+
+void LatencyStats::Reset(void) {
+    net.Reset();
+    queue.Reset();
+    decode.Reset();
+    total.Reset();
+}
+
+size_t LatencyStats::Format(char *buf, size_t size) const {
+    const struct { const char *name; const Histogram *h; } rows[] = {
+        {"net",    &net},
+        {"queue",  &queue},
+        {"decode", &decode},
+        {"total",  &total},
+    };
+    size_t len = 0;
+    int n;
+
+    if (size == 0)
+        return 0;
+
+    buf[0] = 0;
+    n = snprintf(buf, size, "latency (us) over %llu frames, last pts %llu\n",
+        (unsigned long long) total.Count(),
+        (unsigned long long) last_pts.load(std::memory_order_relaxed));
+    if (n < 0 || (size_t) n >= size)
+        return size - 1;
+
+    len = n;
+    for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); i++) {
+        const Histogram *h = rows[i].h;
+        n = snprintf(buf + len, size - len, "  %-6s p50=%llu p95=%llu p99=%llu max=%llu\n",
+            rows[i].name,
+            (unsigned long long) h->Percentile(50),
+            (unsigned long long) h->Percentile(95),
+            (unsigned long long) h->Percentile(99),
+            (unsigned long long) h->Max());
+        if (n < 0 || (size_t) n >= size - len)
+            return size - 1;
+
+        len += n;
+    }
+
+    return len;
+}
+
+#define RATE_INTERVAL_NS UINT64_C(1000000000)
+#define STALL_FRAMES     6
+#define STALL_MIN_NS     UINT64_C(300000000)
+#define STALL_MAX_NS     UINT64_C(1500000000)
+
+SourceCounters::SourceCounters()
+    : bytes(0), packets(0), frames(0), decode_us(0), queue_us(0),
+      discard_catchup(0), discard_overflow(0), discard_failed(0), discard_budget(0),
+      reconnects(0), stalls(0), failovers(0), recovery_ms(0), recovery_max_ms(0),
+      audio_underruns(0), audio_dropped(0), audio_buffer_ms(0),
+      queue_depth(0), queue_peak(0), audio_queue_depth(0), audio_queue_peak(0),
+      tap_queued(0), tap_peak(0), mem_used(0), mem_peak(0), hw_decode(-1),
+      decoder_recoveries(0), decoder_restarts(0),
+      session_start(0), first_frame_ms(0), clock_drift(0), clock_jitter(0),
+      rate_time(0), bitrate(0), packet_rate(0), frame_rate(0),
+      tick_bytes(0), tick_packets(0), tick_frames(0)
+{
+}
+
+void SourceCounters::Tick(uint64_t now) {
+    uint64_t last = rate_time.load(std::memory_order_relaxed);
+    uint64_t b = bytes.load(std::memory_order_relaxed);
+    uint64_t p = packets.load(std::memory_order_relaxed);
+    uint64_t f = frames.load(std::memory_order_relaxed);
+
+    if (last != 0 && now - last < RATE_INTERVAL_NS)
+        return;
+
+    if (last != 0) {
+        double secs = (double) (now - last) / 1e9;
+        bitrate.store((uint64_t) ((double) (b - tick_bytes) * 8 / secs), std::memory_order_relaxed);
+        packet_rate.store((float) ((double) (p - tick_packets) / secs), std::memory_order_relaxed);
+        frame_rate.store((float) ((double) (f - tick_frames) / secs), std::memory_order_relaxed);
+    }
+
+    tick_bytes = b;
+    tick_packets = p;
+    tick_frames = f;
+    rate_time.store(now, std::memory_order_relaxed);
+}
+
+uint64_t SourceCounters::StallTimeout(float fps) {
+    uint64_t timeout;
+    if (fps < 1.0f)
+        return STALL_MAX_NS;
+
+    timeout = (uint64_t) (STALL_FRAMES * 1e9 / fps);
+    if (timeout < STALL_MIN_NS) return STALL_MIN_NS;
+    if (timeout > STALL_MAX_NS) return STALL_MAX_NS;
+    return timeout;
+}
+
+size_t SourceCounters::Format(char *buf, size_t size, uint64_t now) const {
+    uint64_t kbps = bitrate.load(std::memory_order_relaxed) / 1000;
+    float pps = packet_rate.load(std::memory_order_relaxed);
+    float fps = frame_rate.load(std::memory_order_relaxed);
+    int hw = hw_decode.load(std::memory_order_relaxed);
+    int n;
+
+    if (size == 0)
+        return 0;
+
+    // Rates nobody refreshed lately are from a stalled or closed connection
+    if (now - rate_time.load(std::memory_order_relaxed) > 3 * RATE_INTERVAL_NS) {
+        kbps = 0;
+        pps = fps = 0;
+    }
+
+    n = snprintf(buf, size,
+        "ingest: %llu kbps, %.1f packets/s, %.1f fps\n"
+        "frames: %llu decoded, discarded %llu catch-up, %llu mjpeg overflow, %llu decoder failed, %llu memory\n"
+        "queue: video %u (peak %u), audio %u (peak %u), taps %llu KB (peak %llu KB)\n"
+        "memory: %llu KB (peak %llu KB)\n"
+        "decoder: %s, %llu recoveries, %llu restarts\n"
+        "reconnects: %llu, first frame: %llu ms\n"
+        "stalls: %llu, failovers %llu, recovery %llu ms (max %llu ms)\n"
+        "clock: drift %.1f ppm, jitter %.2f ms\n"
+        "audio: %llu underruns, %llu dropped, buffer %u ms\n",
+        (unsigned long long) kbps, pps, fps,
+        (unsigned long long) frames.load(std::memory_order_relaxed),
+        (unsigned long long) discard_catchup.load(std::memory_order_relaxed),
+        (unsigned long long) discard_overflow.load(std::memory_order_relaxed),
+        (unsigned long long) discard_failed.load(std::memory_order_relaxed),
+        (unsigned long long) discard_budget.load(std::memory_order_relaxed),
+        queue_depth.load(std::memory_order_relaxed),
+        queue_peak.load(std::memory_order_relaxed),
+        audio_queue_depth.load(std::memory_order_relaxed),
+        audio_queue_peak.load(std::memory_order_relaxed),
+        (unsigned long long) (tap_queued.load(std::memory_order_relaxed) >> 10),
+        (unsigned long long) (tap_peak.load(std::memory_order_relaxed) >> 10),
+        (unsigned long long) (mem_used.load(std::memory_order_relaxed) >> 10),
+        (unsigned long long) (mem_peak.load(std::memory_order_relaxed) >> 10),
+        hw < 0 ? "none" : hw ? "hardware" : "software",
+        (unsigned long long) decoder_recoveries.load(std::memory_order_relaxed),
+        (unsigned long long) decoder_restarts.load(std::memory_order_relaxed),
+        (unsigned long long) reconnects.load(std::memory_order_relaxed),
+        (unsigned long long) first_frame_ms.load(std::memory_order_relaxed),
+        (unsigned long long) stalls.load(std::memory_order_relaxed),
+        (unsigned long long) failovers.load(std::memory_order_relaxed),
+        (unsigned long long) recovery_ms.load(std::memory_order_relaxed),
+        (unsigned long long) recovery_max_ms.load(std::memory_order_relaxed),
+        clock_drift.load(std::memory_order_relaxed),
+        clock_jitter.load(std::memory_order_relaxed),
+        (unsigned long long) audio_underruns.load(std::memory_order_relaxed),
+        (unsigned long long) audio_dropped.load(std::memory_order_relaxed),
+        audio_buffer_ms.load(std::memory_order_relaxed));
+
+    if (n < 0)
+        return 0;
+
+    return (size_t) n < size ? (size_t) n : size - 1;
+}
@@ -0,0 +1,131 @@
+// Copyright (C) 2022 DEV47APPS, github.com/dev47apps
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// Log-linear (HDR style) histogram of microsecond values.
+// 32 sub-buckets per power of two keep each bucket within ~3% of its value,
+// values over a day land in the last bucket. Record() is lock-free and safe
+// from any thread; readers get an approximate snapshot, which is fine for
+// latency reporting.
+struct Histogram {
+    static const int SUB_BITS = 5;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int MAX_SHIFT = 31;
+    static const int BUCKETS = (MAX_SHIFT + 2) * SUB_COUNT;
+
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> max;
+
+    Histogram() { Reset(); }
+
+    void Record(uint64_t value);
+    void Reset(void);
+
+    // Value at percentile p (0-100), 0 if empty
+    uint64_t Percentile(double p) const;
+    inline uint64_t Count(void) const { return total.load(std::memory_order_relaxed); }
+    inline uint64_t Max(void) const { return max.load(std::memory_order_relaxed); }
+};
+
+// Where each video frame spends its time inside the plugin, in microseconds.
+//  net:    header arrival to the full frame being read off the socket
+//  queue:  waiting in the decode queue
+//  decode: inside the decoder
+//  total:  header arrival to obs_source_output_video2
+struct LatencyStats {
+    Histogram net;
+    Histogram queue;
+    Histogram decode;
+    Histogram total;
+    std::atomic<uint64_t> last_pts;
+    std::atomic<uint64_t> last_dump;
+
+    LatencyStats() : last_pts(0), last_dump(0) {}
+
+    void Reset(void);
+
+    // Multi-line report, returns the number of characters written
+    size_t Format(char *buf, size_t size) const;
+};
+
+// Running counters for one source. The worker threads update them,
+// the proc handler and properties read them from any thread.
+struct SourceCounters {
+    std::atomic<uint64_t> bytes;            // video bytes received
+    std::atomic<uint64_t> packets;          // video packets received
+    std::atomic<uint64_t> frames;           // video frames sent to OBS
+    std::atomic<uint64_t> decode_us;        // total decode time of those frames
+    std::atomic<uint64_t> queue_us;         // total decode queue wait
+    std::atomic<uint64_t> discard_catchup;  // dropped by the H.264 catch-up
+    std::atomic<uint64_t> discard_overflow; // dropped by the MJPEG queue limit
+    std::atomic<uint64_t> discard_failed;   // dropped because the decoder failed
+    std::atomic<uint64_t> discard_budget;   // dropped while over the memory budget
+    std::atomic<uint64_t> reconnects;
+    std::atomic<uint64_t> stalls;           // cut by the stall watchdog
+    std::atomic<uint64_t> failovers;        // reconnected over the other transport
+    std::atomic<uint64_t> recovery_ms;      // last stall until the next frame
+    std::atomic<uint64_t> recovery_max_ms;
+    std::atomic<uint64_t> audio_underruns;
+    std::atomic<uint64_t> audio_dropped;    // late audio dropped to bound latency
+    std::atomic<uint32_t> audio_buffer_ms;  // jitter buffer target
+    std::atomic<uint32_t> queue_depth;      // video decode queue
+    std::atomic<uint32_t> queue_peak;
+    std::atomic<uint32_t> audio_queue_depth; // audio decode queue, the jitter buffer
+    std::atomic<uint32_t> audio_queue_peak;
+    std::atomic<size_t> tap_queued;         // bytes in the fullest packet tap
+    std::atomic<size_t> tap_peak;
+    std::atomic<size_t> mem_used;           // bytes held by packet pools
+    std::atomic<size_t> mem_peak;
+    std::atomic<int> hw_decode;             // -1 until a decoder is set up
+    std::atomic<uint64_t> decoder_recoveries; // flushed after a decode error
+    std::atomic<uint64_t> decoder_restarts;   // set up again after repeated errors
+    std::atomic<uint64_t> session_start;    // ns, start of the current connection attempt
+    std::atomic<uint64_t> first_frame_ms;   // time to first frame, 0 until it shows up
+    std::atomic<float> clock_drift;         // ppm, phone vs host clock
+    std::atomic<float> clock_jitter;        // ms
+
+    // Per second rates, refreshed by Tick()
+    std::atomic<uint64_t> rate_time;
+    std::atomic<uint64_t> bitrate;
+    std::atomic<float> packet_rate;
+    std::atomic<float> frame_rate;
+
+    SourceCounters();
+
+    // Update the rates, called regularly from one thread
+    void Tick(uint64_t now);
+
+    inline void QueueDepth(size_t depth) {
+        StorePeak(queue_depth, queue_peak, (uint32_t) depth);
+    }
+
+    inline void AudioQueueDepth(size_t depth) {
+        StorePeak(audio_queue_depth, audio_queue_peak, (uint32_t) depth);
+    }
+
+    inline void TapQueued(size_t bytes) {
+        StorePeak(tap_queued, tap_peak, bytes);
+    }
+
+    // Human readable summary, returns the number of characters written
+    size_t Format(char *buf, size_t size, uint64_t now) const;
+
+    // How long video may go without new frames before it counts as stalled:
+    // a few frame intervals at the measured rate, within sane bounds.
+    static uint64_t StallTimeout(float fps);
+
+private:
+    template <typename T>
+    static inline void StorePeak(std::atomic<T> &cur, std::atomic<T> &peak, T value) {
+        cur.store(value, std::memory_order_relaxed);
+        if (value > peak.load(std::memory_order_relaxed))
+            peak.store(value, std::memory_order_relaxed);
+    }
+
+    uint64_t tick_bytes;
+    uint64_t tick_packets;
+    uint64_t tick_frames;
+};
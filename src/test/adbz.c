@@ -1,9 +1,20 @@
 #include "stdio.h"
+#include "stdlib.h"
 #include "string.h"
 void list_props(void);
 void list_devices(void);
 
 int main(int argc, char** argv) {
+	const char *log = getenv("ADBZ_LOG");
+	if (log) {
+		FILE *f = fopen(log, "a");
+		if (f) {
+			for (int i = 1; i < argc; i++)
+				fprintf(f, "%s%s", argv[i], i + 1 < argc ? " " : "\n");
+			fclose(f);
+		}
+	}
+
 	if (argc == 2 && strcmp(argv[1], "start-server") == 0) {
 		return 0;
 	}
@@ -21,6 +32,16 @@ int main(int argc, char** argv) {
 		return 0;
 	}
 
+	if (argc == 3 && strcmp(argv[1], "forward") == 0 && strcmp(argv[2], "--list") == 0) {
+		printf("10a3a5185d8ac3b1 tcp:4747 tcp:4747\n");
+		return 0;
+	}
+
+	// 4748 is taken by something else
+	if (argc == 7 && strcmp(argv[3], "forward") == 0 && strcmp(argv[4], "--no-rebind") == 0) {
+		return strcmp(argv[5], "tcp:4748") == 0 ? 1 : 0;
+	}
+
 	if (argc > 4 && strcmp(argv[3], "shell") == 0) {
 		if (strcmp(argv[4], "getprop") == 0) {
 			printf("Nexus X\n\n");
@@ -2,12 +2,29 @@
 #include <stdio.h>
 
 #include <util/threading.h>
+#include <util/platform.h>
 
 #include "net.h"
+#include "http.h"
 #include "command.h"
 #include "plugin.h"
 #include "plugin_properties.h"
 #include "device_discovery.h"
+#include "stats.h"
+#include "decoder.h"
+#include "clock_recovery.h"
+#include "resolution_controller.h"
+#include "usbmux.h"
+
+#ifndef _WIN32
+# include <arpa/inet.h>
+# include <sys/un.h>
+# include <unistd.h>
+# pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#include "mdns.h"
+
+const char* bindIP = NULL;
 
 void test_exec(void) {
     enum process_result pr;
@@ -55,13 +72,14 @@ void test_exec(void) {
 void test_adb(void) {
     ilog("test_adb()");
     int count = 0;
-    Device* dev;
+    DeviceRef dev;
     AdbMgr adbMgr;
     adbMgr.Reload();
-    adbMgr.ResetIter();
-    while ((dev = adbMgr.NextDevice()) != NULL) {
-        adbMgr.GetModel(dev);
-        ilog("dev: serial=%s state=%s model=%s", dev->serial, dev->state, dev->model);
+    adbMgr.WaitReload();
+    DeviceListRef list = adbMgr.Devices();
+    for (auto d : list->devices) {
+        adbMgr.GetModel(d.get());
+        ilog("dev: serial=%s state=%s model=%s", d->serial, d->state, d->model);
         count++;
     }
     if (count == 0) {
@@ -72,14 +90,176 @@ void test_adb(void) {
         const char* serial = "empty1";
         dev = adbMgr.GetDevice(serial, strlen(serial));
 
-        ilog("device '%s' returned %p @ %d", serial, dev, adbMgr.Iter());
-        if (!dev)           elog("Failed: Expected device '%s' was not loaded\n", serial);
-        if (!adbMgr.Iter()) elog("Failed: Expected device '%s' to update Iter\n", serial);
+        ilog("device '%s' returned %p @ %d", serial, dev.get(), dev ? dev->index : -1);
+        if (!dev)        elog("Failed: Expected device '%s' was not loaded\n", serial);
+        else if (!dev->index) elog("Failed: Expected device '%s' to have an index\n", serial);
+
+        // Readers keep their snapshot across reloads
+        adbMgr.Reload();
+        adbMgr.WaitReload();
+        if (adbMgr.Devices()->generation != list->generation + 1)
+            elog("Failed: Expected a new device list generation");
+        if (strcmp(dev->serial, serial) != 0)
+            elog("Failed: Device '%s' changed under a reader", serial);
     }
 
     dlog("~test_adb");
 }
 
+#ifndef _WIN32
+static int count_lines(const char *file) {
+    int count = 0;
+    char line[256];
+    FILE *f = fopen(file, "r");
+    if (!f)
+        return 0;
+
+    while (fgets(line, sizeof(line), f))
+        count++;
+    fclose(f);
+    return count;
+}
+
+// Forwards left by a previous run are reused, new ones get a port no other
+// device has, and asking again doesn't run adb
+void test_forwards(void) {
+    ilog("test_forwards()");
+    const char *log = "build/adbz.log";
+    AdbMgr adbMgr;
+    adbMgr.Reload();
+    adbMgr.WaitReload();
+
+    DeviceRef a = adbMgr.GetDevice("10a3a5185d8ac3b1");
+    DeviceRef b = adbMgr.GetDevice("empty1");
+    if (!a || !b) {
+        elog("Failed: test devices not found");
+        return;
+    }
+
+    unlink(log);
+    setenv("ADBZ_LOG", log, 1);
+    int port_a = adbMgr.Forward(a.get(), 4747);
+    int port_b = adbMgr.Forward(b.get(), 4747);
+    int calls = count_lines(log);
+    ilog("forwards: %s -> %d, %s -> %d, %d adb calls", a->serial, port_a, b->serial, port_b, calls);
+    if (port_a != 4747)
+        elog("Failed: existing forward not reused");
+    if (port_b != 4749)
+        elog("Failed: expected 4749 past the taken ports");
+    if (calls != 3)
+        elog("Failed: expected list + 2 forward calls");
+
+    // Another list order changes nothing
+    adbMgr.Reload();
+    adbMgr.WaitReload();
+    calls = count_lines(log);
+    if (adbMgr.Forward(b.get(), 4747) != port_b || adbMgr.Forward(a.get(), 4747) != port_a)
+        elog("Failed: forward moved after a reload");
+    if (count_lines(log) != calls)
+        elog("Failed: reconnect ran adb");
+
+    // remove, then 4748 again and 4749
+    adbMgr.RemoveForward(b.get(), port_b);
+    if (adbMgr.Forward(b.get(), 4747) != port_b || count_lines(log) != calls + 3)
+        elog("Failed: removed forward not made again");
+
+    // A port remembered for one phone that another phone has now
+    if (!adbMgr.Forwarded(a->serial, port_a, 4747) || !adbMgr.Forwarded(b->serial, port_b, 4747))
+        elog("Failed: current forwards not recognized");
+    if (adbMgr.Forwarded(b->serial, port_a, 4747) || adbMgr.Forwarded(a->serial, port_b, 4747))
+        elog("Failed: forward of another device trusted");
+    if (adbMgr.Forwarded(a->serial, 4750, 4747) || adbMgr.Forwarded(a->serial, port_a, 4748))
+        elog("Failed: unknown forward trusted");
+
+    // The device list stops at a duplicate, the forwards of
+    // devices past it stay, adb didn't say they're gone
+    {
+        Device extra;
+        strcpy(extra.serial, "extra1");
+        int port_x = adbMgr.Forward(&extra, 4747);
+        adbMgr.Reload();
+        adbMgr.WaitReload();
+        if (!port_x || adbMgr.GetDevice("extra1") || !adbMgr.Forwarded("extra1", port_x, 4747))
+            elog("Failed: forward of an unlisted device dropped, port %d", port_x);
+    }
+
+    unsetenv("ADBZ_LOG");
+    unlink(log);
+    dlog("~test_forwards");
+}
+#endif
+
+// Slow lookups run side by side, each name is published as it
+// comes in and the next reload takes it from the cache
+struct SlowModels : DeviceDiscovery {
+    std::atomic<int> asked{0};
+    ~SlowModels() { WaitModels(); }
+
+    void DoReload() {
+        char serial[16];
+        for (int i = 0; i < 4; i++) {
+            snprintf(serial, sizeof(serial), "slow%d", i);
+            AddDevice(serial, strlen(serial));
+        }
+    }
+
+    bool LookupModel(const Device* dev, char* model, size_t size) {
+        asked++;
+        os_sleep_ms(200);
+        snprintf(model, size, "Phone %s [USB]", dev->serial);
+        return true;
+    }
+};
+
+static void count_changed(void *data) {
+    (*(std::atomic<int>*) data)++;
+}
+
+void test_models(void) {
+    ilog("test_models()");
+    std::atomic<int> changed(0);
+    SlowModels mgr;
+    mgr.models_changed = count_changed;
+    mgr.models_data = &changed;
+    mgr.Reload();
+    mgr.WaitReload();
+
+    DeviceListRef before = mgr.Devices();
+    uint64_t start = os_gettime_ns();
+    mgr.ResolveModels();
+    mgr.ResolveModels(); // already in flight
+    mgr.WaitModels();
+    unsigned long long ms = (os_gettime_ns() - start) / 1000000;
+
+    DeviceListRef after = mgr.Devices();
+    ilog("4 lookups took %llu ms, generation %llu -> %llu", ms,
+        (unsigned long long) before->generation, (unsigned long long) after->generation);
+    if (ms >= 600)
+        elog("Failed: lookups did not run in parallel");
+    if (mgr.asked != 4 || changed != 4)
+        elog("Failed: expected 4 lookups, got %d (%d changes)", mgr.asked.load(), changed.load());
+    if (after->generation != before->generation + 4)
+        elog("Failed: expected a generation per name");
+
+    for (const DeviceRef &dev : before->devices)
+        if (dev->model[0] != 0) elog("Failed: device changed under a reader");
+
+    for (const DeviceRef &dev : after->devices)
+        if (strncmp(dev->model, "Phone slow", 10) != 0) elog("Failed: no name for %s", dev->serial);
+
+    mgr.Reload();
+    mgr.WaitReload();
+    mgr.ResolveModels();
+    mgr.WaitModels();
+    DeviceRef dev = mgr.GetDevice("slow2");
+    if (mgr.asked != 4)
+        elog("Failed: cached names looked up again");
+    if (!dev || strcmp(dev->model, "Phone slow2 [USB]") != 0)
+        elog("Failed: cached name not used");
+
+    dlog("~test_models");
+}
+
 #define REQ "GET / HTTP/1.1\r\nHost: %s\r\n\r\n"
 void test_net(const char *host, int port) {
     char buffer[1024];
@@ -115,7 +295,640 @@ out:
     dlog("~test_net");
 }
 
-static void *proxy_run(void *data) {
+// "localhost" usually resolves to ::1 first while the server only listens on IPv4,
+// the connect should fall through to 127.0.0.1 without waiting out any timeouts
+void test_connect(void) {
+    ilog("test_connect()");
+    socket_t server = net_listen(localhost_ip, 0);
+    if (server == INVALID_SOCKET) {
+        elog("Failed: listen failed");
+        return;
+    }
+
+    int port = net_listen_port(server);
+    for (int i = 0; i < 2; i++) {
+        uint64_t start = os_gettime_ns();
+        socket_t sock = net_connect("localhost", port);
+        uint64_t elapsed = (os_gettime_ns() - start) / 1000000;
+        if (sock == INVALID_SOCKET) {
+            elog("Failed: connect failed");
+            break;
+        }
+
+        ilog("test_connect: connected in %llu ms", (unsigned long long) elapsed);
+        if (elapsed > 500)
+            elog("Failed: connect took too long");
+
+        net_close(sock);
+    }
+
+    uint64_t start = os_gettime_ns();
+    socket_t sock = net_connect(localhost_ip, port + 1);
+    if (sock != INVALID_SOCKET) {
+        elog("Failed: connected to a closed port");
+        net_close(sock);
+    }
+    else if ((os_gettime_ns() - start) / 1000000 > 500) {
+        elog("Failed: refused connect took too long");
+    }
+
+    net_close(server);
+    dlog("~test_connect");
+}
+
+static void *http_server_run(void *data) {
+    socket_t server = *(socket_t*) data;
+    char buf[1024];
+    int len = 0, requests = 0;
+    const char* reply =
+        "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\n42"
+        "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n4\r\nWiki\r\n5\r\npedia\r\n0\r\n\r\n"
+        "HTTP/1.0 404 Not Found\r\n\r\nbye";
+
+    set_nonblock(server, 0);
+    socket_t sock = net_accept(server);
+    if (sock == INVALID_SOCKET)
+        return NULL;
+
+    // wait for all three requests, they should arrive pipelined
+    while (requests < 3 && len < (int) sizeof(buf) - 1) {
+        int r = (int) net_recv(sock, buf + len, sizeof(buf) - 1 - len);
+        if (r <= 0) break;
+        len += r;
+        buf[len] = 0;
+
+        requests = 0;
+        for (char *p = buf; (p = strstr(p, "\r\n\r\n")) != NULL; p += 4)
+            requests++;
+    }
+
+    net_send_all(sock, reply, strlen(reply));
+    net_close(sock);
+    return NULL;
+}
+
+// Answers one request and closes the connection while it sits idle
+static void *http_idle_server_run(void *data) {
+    socket_t server = *(socket_t*) data;
+    char buf[1024];
+    const char* reply = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\n42";
+
+    set_nonblock(server, 0);
+    socket_t sock = net_accept(server);
+    if (sock == INVALID_SOCKET)
+        return NULL;
+
+    if (net_recv(sock, buf, sizeof(buf)) > 0)
+        net_send_all(sock, reply, strlen(reply));
+
+    os_sleep_ms(50);
+    net_close(sock);
+    return NULL;
+}
+
+void test_http(void) {
+    ilog("test_http()");
+    pthread_t thr;
+    int rc;
+    HttpClient http;
+    struct http_response resp;
+    socket_t server = net_listen(localhost_ip, 0);
+    if (server == INVALID_SOCKET) {
+        elog("Failed: listen failed");
+        return;
+    }
+
+    pthread_create(&thr, NULL, http_server_run, &server);
+    http.Attach(net_connect(localhost_ip, net_listen_port(server)));
+    if (!http.Send("GET", "/battery") || !http.Send("PUT", "/v1/tally/program/") || !http.Send("GET", "/close")) {
+        elog("Failed: send failed");
+        goto out;
+    }
+
+    if (http.Recv(&resp, 1000) != HTTP_OK || resp.status != 200 || strcmp(resp.body, "42") != 0 || !resp.keep_alive)
+        elog("Failed: Content-Length response");
+
+    if (http.Recv(&resp, 1000) != HTTP_OK || resp.status != 200 || strcmp(resp.body, "Wikipedia") != 0)
+        elog("Failed: chunked response");
+
+    if (http.Recv(&resp, 1000) != HTTP_OK || resp.status != 404 || strcmp(resp.body, "bye") != 0 || resp.keep_alive)
+        elog("Failed: read-until-close response");
+
+    if (http.pending != 0)
+        elog("Failed: %d responses pending", http.pending);
+
+    if (http.Recv(&resp, 1000) != HTTP_CLOSED)
+        elog("Failed: connection should be closed");
+    // One keep-alive response, then the server drops the idle connection
+    http.Close();
+    pthread_join(thr, NULL);
+    pthread_create(&thr, NULL, http_idle_server_run, &server);
+    http.Attach(net_connect(localhost_ip, net_listen_port(server)));
+    if (http.Stale(HTTP_CLOSED))
+        elog("Failed: a fresh connection can't be stale");
+
+    if (!http.Send("GET", "/battery") || http.Recv(&resp, 1000) != HTTP_OK)
+        elog("Failed: keep-alive response");
+
+    os_sleep_ms(100);
+    http.Send("PUT", "/v1/tally/program/");
+    rc = http.Recv(&resp, 1000);
+    if (!http.Stale(rc))
+        elog("Failed: idle close not noticed (%d)", rc);
+
+out:
+    http.Close();
+    pthread_join(thr, NULL);
+    net_close(server);
+    dlog("~test_http");
+}
+
+struct cancel_waiter {
+    socket_t sock;
+    struct net_cancel *cancel;
+    ssize_t recv_rc;
+    int http_rc;
+    bool slept;
+};
+
+static void *cancel_recv_run(void *data) {
+    struct cancel_waiter *w = (struct cancel_waiter*) data;
+    char buf[16];
+    w->recv_rc = net_recv_all(w->sock, buf, sizeof(buf), w->cancel);
+    return NULL;
+}
+
+static void *cancel_http_run(void *data) {
+    struct cancel_waiter *w = (struct cancel_waiter*) data;
+    HttpClient http;
+    struct http_response resp;
+    http.cancel = w->cancel;
+    http.Attach(w->sock);
+    http.pending = 1;
+    w->http_rc = http.Recv(&resp, 10000);
+    http.sock = INVALID_SOCKET;
+    return NULL;
+}
+
+static void *cancel_sleep_run(void *data) {
+    struct cancel_waiter *w = (struct cancel_waiter*) data;
+    w->slept = net_cancel_sleep(w->cancel, 10000);
+    return NULL;
+}
+
+// Source teardown: threads blocked on idle connections and in the
+// retry sleep all have to let go well within 100 ms of the token firing
+void test_cancel(void) {
+    ilog("test_cancel()");
+    pthread_t thr[3];
+    struct net_cancel cancel;
+    struct cancel_waiter w = {INVALID_SOCKET, &cancel, 0, 0, true};
+    struct cancel_waiter h = w;
+    socket_t conns[2] = {INVALID_SOCKET, INVALID_SOCKET};
+    uint64_t start, elapsed;
+
+    socket_t server = net_listen(localhost_ip, 0);
+    if (server == INVALID_SOCKET || !net_cancel_init(&cancel)) {
+        elog("Failed: setup failed");
+        return;
+    }
+
+    set_nonblock(server, 0);
+    w.sock = net_connect(localhost_ip, net_listen_port(server));
+    conns[0] = net_accept(server);
+    h.sock = net_connect(localhost_ip, net_listen_port(server));
+    conns[1] = net_accept(server);
+    if (w.sock == INVALID_SOCKET || h.sock == INVALID_SOCKET) {
+        elog("Failed: connect failed");
+        goto out;
+    }
+
+    pthread_create(&thr[0], NULL, cancel_recv_run, &w);
+    pthread_create(&thr[1], NULL, cancel_http_run, &h);
+    pthread_create(&thr[2], NULL, cancel_sleep_run, &w);
+    os_sleep_ms(200);
+
+    start = os_gettime_ns();
+    net_cancel_fire(&cancel);
+    for (int i = 0; i < 3; i++)
+        pthread_join(thr[i], NULL);
+    elapsed = (os_gettime_ns() - start) / 1000000;
+
+    ilog("test_cancel: waits ended %llu ms after cancel", (unsigned long long) elapsed);
+    if (elapsed >= 100)
+        elog("Failed: cancel took too long");
+
+    if (w.recv_rc != -1 || h.http_rc != HTTP_ERROR || w.slept)
+        elog("Failed: cancelled waits returned recv=%ld http=%d slept=%d",
+            (long) w.recv_rc, h.http_rc, w.slept);
+
+    // Nothing answers there, only the token ends the attempt early
+    start = os_gettime_ns();
+    if (net_connect("10.255.255.1", NULL, 9, &cancel) != INVALID_SOCKET
+        || (os_gettime_ns() - start) / 1000000 >= 100)
+        elog("Failed: connect ignored the cancel");
+
+    // Discovery on a cold cache waits for phones, not for a source going away
+    {
+        MDNS *mdnsMgr = new MDNS();
+        mdnsMgr->Reload();
+        os_sleep_ms(200);
+
+        start = os_gettime_ns();
+        mdnsMgr->Cancel();
+        delete mdnsMgr;
+        elapsed = (os_gettime_ns() - start) / 1000000;
+        ilog("test_cancel: mDNS discovery done %llu ms after cancel", (unsigned long long) elapsed);
+        if (elapsed >= 100)
+            elog("Failed: mDNS discovery ignored the cancel");
+    }
+    #ifndef _WIN32
+    {
+        // A daemon that never answers the Listen request
+        char env[64];
+        socket_t daemon = net_listen(localhost_ip, 0);
+        snprintf(env, sizeof(env), "%s:%d", localhost_ip, net_listen_port(daemon));
+        setenv("USBMUXD_SOCKET_ADDRESS", env, 1);
+
+        USBMux *iosMgr = new USBMux();
+        iosMgr->Reload();
+        os_sleep_ms(200);
+
+        start = os_gettime_ns();
+        iosMgr->Cancel();
+        delete iosMgr;
+        elapsed = (os_gettime_ns() - start) / 1000000;
+        ilog("test_cancel: usbmux discovery done %llu ms after cancel", (unsigned long long) elapsed);
+        if (elapsed >= 100)
+            elog("Failed: usbmux discovery ignored the cancel");
+
+        unsetenv("USBMUXD_SOCKET_ADDRESS");
+        net_close(daemon);
+    }
+    #endif
+
+out:
+    for (int i = 0; i < 2; i++)
+        if (conns[i] != INVALID_SOCKET) net_close(conns[i]);
+    if (w.sock != INVALID_SOCKET) net_close(w.sock);
+    if (h.sock != INVALID_SOCKET) net_close(h.sock);
+    net_cancel_free(&cancel);
+    net_close(server);
+    dlog("~test_cancel");
+}
+
+void test_stats(void) {
+    ilog("test_stats()");
+    Histogram *h = new Histogram();
+
+    // 1..1000us, plus one slow outlier
+    for (uint64_t i = 1; i <= 1000; i++)
+        h->Record(i);
+    h->Record(250000);
+
+    uint64_t p50 = h->Percentile(50);
+    uint64_t p99 = h->Percentile(99);
+    if (h->Count() != 1001 || h->Max() != 250000)
+        elog("Failed: count=%llu max=%llu", (unsigned long long) h->Count(), (unsigned long long) h->Max());
+
+    // buckets are within ~3%
+    if (p50 < 485 || p50 > 515 || p99 < 960 || p99 > 1020)
+        elog("Failed: p50=%llu p99=%llu", (unsigned long long) p50, (unsigned long long) p99);
+
+    if (h->Percentile(100) != 250000)
+        elog("Failed: p100=%llu", (unsigned long long) h->Percentile(100));
+
+    h->Reset();
+    if (h->Count() != 0 || h->Percentile(50) != 0)
+        elog("Failed: reset");
+
+    delete h;
+
+    SourceCounters counters;
+    counters.Tick(UINT64_C(1000000000));
+    counters.bytes += 500000;
+    counters.packets += 30;
+    counters.frames += 25;
+    counters.Tick(UINT64_C(2000000000));
+    if (counters.bitrate != 4000000 || counters.frame_rate != 25.0f)
+        elog("Failed: bitrate=%llu fps=%.1f", (unsigned long long) counters.bitrate.load(), counters.frame_rate.load());
+
+    char report[1024];
+    counters.stalls++;
+    counters.QueueDepth(3);
+    counters.AudioQueueDepth(4);
+    counters.AudioQueueDepth(2);
+    counters.TapQueued(64 * 1024);
+    counters.Format(report, sizeof(report), UINT64_C(2000000000));
+    if (!strstr(report, "4000 kbps") || !strstr(report, "stalls: 1")
+        || !strstr(report, "video 3 (peak 3), audio 2 (peak 4), taps 64 KB"))
+        elog("Failed: report %s", report);
+
+    // A few frame intervals, within bounds
+    if (SourceCounters::StallTimeout(30.0f) != UINT64_C(300000000)
+        || SourceCounters::StallTimeout(15.0f) != UINT64_C(400000000)
+        || SourceCounters::StallTimeout(2.0f) != UINT64_C(1500000000)
+        || SourceCounters::StallTimeout(0.0f) != UINT64_C(1500000000))
+        elog("Failed: stall timeout %llu at 15 fps", (unsigned long long) SourceCounters::StallTimeout(15.0f));
+
+    dlog("~test_stats");
+}
+
+struct TestDecoder : Decoder {
+    void push_ready_packet(DataPacket* packet) { decodeQueue.add_item(packet); }
+    bool decode_video(struct obs_source_frame2*, DataPacket*, bool*) { return false; }
+    bool decode_audio(struct obs_source_audio*, DataPacket*, bool*) { return false; }
+};
+
+void test_budget(void) {
+    ilog("test_budget()");
+    const size_t limit = packet_budget_limit();
+    SourceCounters counters;
+    TestDecoder *decoder = new TestDecoder();
+    decoder->counters = &counters;
+    packet_budget_set_limit(1024 * 1024);
+
+    DataPacket *p1 = decoder->pull_empty_packet(600 * 1024);
+    DataPacket *p2 = decoder->pull_empty_packet(600 * 1024);
+    if (!packet_budget_exceeded() || !decoder->over_budget() || counters.mem_used != 1200 * 1024)
+        elog("Failed: budget should be exceeded, used=%llu", (unsigned long long) packet_budget_used());
+
+    // Over budget, returned packets get freed except one to reuse
+    decoder->push_empty_packet(p1);
+    decoder->push_empty_packet(p2);
+    p1 = decoder->pull_empty_packet(1000);
+    if (decoder->alloc_count != 1 || packet_budget_exceeded() || decoder->over_budget())
+        elog("Failed: alloc_count=%lu used=%llu", decoder->alloc_count, (unsigned long long) packet_budget_used());
+
+    decoder->push_empty_packet(p1);
+    delete decoder;
+    if (packet_budget_used() != 0 || counters.mem_used != 0 || counters.mem_peak != 1200 * 1024)
+        elog("Failed: used=%llu after delete", (unsigned long long) packet_budget_used());
+
+    packet_budget_set_limit(limit);
+    dlog("~test_budget");
+}
+
+void test_tap(void) {
+    ilog("test_tap()");
+    const uint8_t idr[] = {0, 0, 0, 1, 0x65, 0x88};
+    SourceCounters counters;
+    TestDecoder *decoder = new TestDecoder();
+    decoder->counters = &counters;
+    PacketTap tap(TAP_VIDEO, 1000);
+    TapPacket tp = {TAP_VIDEO, true, false, "h264", NULL};
+
+    // The tap keeps the packet out of the pool until it's done with it
+    DataPacket *p1 = decoder->pull_empty_packet(600);
+    memcpy(p1->data, idr, sizeof(idr));
+    p1->used = 600;
+    tp.packet = p1;
+    if (tap.Push(tp) != 600)
+        elog("Failed: tap queued bytes");
+    decoder->push_empty_packet(p1);
+    if (decoder->recieveQueue.items.size() != 0 || !decoder->idle())
+        elog("Failed: tapped packet went back to the pool");
+
+    // Over the limit: dropped, and video waits for a keyframe after that
+    DataPacket *p2 = decoder->pull_empty_packet(600);
+    p2->used = 600;
+    tp.packet = p2;
+    tap.Push(tp);
+    tp.key = false;
+    tap.Push(tp);
+    decoder->push_empty_packet(p2);
+    if (tap.Dropped() != 2 || decoder->recieveQueue.items.size() != 1)
+        elog("Failed: dropped=%llu", (unsigned long long) tap.Dropped());
+
+    TapPacket out;
+    if (!tap.Next(&out, 100) || out.packet != p1 || tap.Next(&out, 10))
+        elog("Failed: tap queue");
+    packet_unref(p1);
+    if (decoder->recieveQueue.items.size() != 2)
+        elog("Failed: packet not back after unref");
+
+    // Outliving the decoder
+    tp.key = true;
+    tp.packet = decoder->pull_empty_packet(600);
+    ((DataPacket*) tp.packet)->used = 600;
+    tap.Push(tp);
+    decoder->push_empty_packet((DataPacket*) tp.packet);
+    delete decoder;
+    if (packet_budget_used() == 0 || counters.mem_used != 0)
+        elog("Failed: tapped packet freed with the decoder");
+
+    tap.Close();
+    if (!tap.Next(&out, 0) || tap.Next(&out, 0))
+        elog("Failed: closed tap");
+    packet_unref(out.packet);
+    if (packet_budget_used() != 0)
+        elog("Failed: orphaned packet leaked, used=%llu", (unsigned long long) packet_budget_used());
+
+    dlog("~test_tap");
+}
+
+void test_keyframe(void) {
+    ilog("test_keyframe()");
+    const uint8_t idr[] = {0, 0, 0, 1, 0x67, 0x42, 0, 0, 0, 1, 0x68, 0xce, 0, 0, 1, 0x65, 0x88};
+    const uint8_t p_frame[] = {0, 0, 0, 1, 0x41, 0x9a, 0x65, 0, 0, 1};
+
+    if (!h264_is_keyframe(idr, sizeof(idr)))
+        elog("Failed: IDR not found");
+
+    if (h264_is_keyframe(p_frame, sizeof(p_frame)))
+        elog("Failed: P frame taken as keyframe");
+
+    uint8_t params[64];
+    size_t len = h264_parameter_sets(idr, sizeof(idr), params, sizeof(params));
+    if (len != 12 || memcmp(params, idr, 12) != 0)
+        elog("Failed: parameter sets len=%lu", len);
+
+    if (h264_parameter_sets(p_frame, sizeof(p_frame), params, sizeof(params)) != 0
+        || h264_parameter_sets(idr, sizeof(idr), params, 8) != 0)
+        elog("Failed: parameter sets where there should be none");
+
+    // AAC-LC, 44.1 kHz, stereo
+    const uint8_t asc[] = {0x12, 0x10};
+    const uint8_t bad_asc[] = {0x17, 0x90};
+    int sample_rate = 0, channels = 0;
+    if (!aac_config_parse(asc, &sample_rate, &channels) || sample_rate != 44100 || channels != 2)
+        elog("Failed: AAC config %d Hz %d ch", sample_rate, channels);
+
+    if (aac_config_parse(bad_asc, &sample_rate, &channels))
+        elog("Failed: bad AAC sample rate index accepted");
+
+    dlog("~test_keyframe");
+}
+
+struct RecoverDecoder : TestDecoder {
+    int flushes = 0;
+    int restarts = 0;
+    bool flush(void) { flushes++; return true; }
+    bool restart(void) { restarts++; return true; }
+};
+
+void test_recover(void) {
+    ilog("test_recover()");
+    SourceCounters counters;
+    RecoverDecoder decoder;
+    decoder.counters = &counters;
+
+    // A few flushes, then restarts, then give up
+    int ok = 0;
+    for (int i = 0; i < 10; i++)
+        if (decoder.recover()) ok++;
+
+    if (ok != 5 || decoder.flushes != 3 || decoder.restarts != 2
+        || counters.decoder_recoveries != 3 || counters.decoder_restarts != 2)
+        elog("Failed: ok=%d flushes=%d restarts=%d", ok, decoder.flushes, decoder.restarts);
+
+    dlog("~test_recover");
+}
+
+// The codec is rebuilt on the decode thread while the receive thread keeps
+// queueing: the decoder stays ready, so the receive side never sets it up
+// a second time, and the two never run at once
+struct RestartDecoder : TestDecoder {
+    std::atomic<int> setups{0};
+    std::atomic<int> restarts{0};
+    std::atomic<int> busy{0};
+    std::atomic<bool> overlap{false};
+    bool restart(void) {
+        if (setup_lock.try_lock()) {
+            setup_lock.unlock();
+            overlap = true;
+        }
+        if (busy++ || !ready) overlap = true;
+        os_sleep_ms(2);
+        busy--;
+        restarts++;
+        return true;
+    }
+};
+
+static void *restart_queue_run(void *data) {
+    RestartDecoder *decoder = (RestartDecoder*) data;
+    for (int i = 0; i < 200; i++) {
+        if (!decoder->ready) {
+            std::lock_guard<std::mutex> lock(decoder->setup_lock);
+            if (!decoder->ready) {
+                if (decoder->busy++) decoder->overlap = true;
+                decoder->setups++;
+                decoder->ready = true;
+                decoder->busy--;
+            }
+        }
+        decoder->push_ready_packet(decoder->pull_empty_packet(64));
+        os_sleep_ms(1);
+    }
+    return 0;
+}
+
+void test_restart(void) {
+    ilog("test_restart()");
+    RestartDecoder decoder;
+    pthread_t thr;
+    int decoded = 0;
+    pthread_create(&thr, NULL, restart_queue_run, &decoder);
+
+    while (decoded < 200) {
+        DataPacket *packet = decoder.pull_ready_packet();
+        if (!packet) {
+            os_sleep_ms(1);
+            continue;
+        }
+        if (++decoded % 40 == 0 && !decoder.recover())
+            elog("Failed: restart %d refused", decoded / 40);
+        decoder.push_empty_packet(packet);
+    }
+    pthread_join(thr, NULL);
+
+    ilog("setups=%d restarts=%d", decoder.setups.load(), decoder.restarts.load());
+    if (decoder.setups != 1 || decoder.restarts != 5)
+        elog("Failed: expected 1 setup and 5 restarts");
+    if (decoder.overlap)
+        elog("Failed: set up and restarted at the same time");
+
+    dlog("~test_restart");
+}
+
+void test_clock(void) {
+    ilog("test_clock()");
+    ClockRecovery *clock = new ClockRecovery();
+    const uint64_t host0 = UINT64_C(5000000000);
+    const uint64_t pts0 = UINT64_C(123456789);
+    int64_t worst = 0;
+
+    // Phone clock 100 ppm fast, 20ms base delay plus up to 30ms of jitter,
+    // video at 25 fps for two minutes
+    srand(47);
+    for (uint64_t i = 0; i < 25 * 120; i++) {
+        uint64_t pts = pts0 + i * 40000;
+        uint64_t capture = host0 + (uint64_t) ((double) (i * 40000) * (1.0 - 100e-6) * 1000.0);
+        uint64_t arrival = capture + 20000000 + (uint64_t) (rand() % 30) * 1000000;
+        clock->Update(0, pts, arrival);
+
+        if (i > 25 * 60) {
+            // Mapped times should sit at the fastest arrival, i.e. capture + 20ms
+            int64_t err = (int64_t) (clock->Map(pts) - capture) - 20000000;
+            if (err < 0) err = -err;
+            if (err > worst) worst = err;
+        }
+    }
+
+    if (worst > 2000000 || clock->Drift() > -80 || clock->Drift() < -120)
+        elog("Failed: worst=%.2fms drift=%.1fppm", worst / 1e6, clock->Drift());
+
+    if (clock->Jitter() < 1 || clock->Jitter() > 30)
+        elog("Failed: jitter=%.2fms", clock->Jitter());
+
+    // A different timeline starts over
+    clock->Update(0, pts0 + UINT64_C(3600000000), host0 + UINT64_C(200000000000));
+    if (clock->Map(pts0 + UINT64_C(3600000000)) != host0 + UINT64_C(200000000000))
+        elog("Failed: clock should reset");
+
+    delete clock;
+    dlog("~test_clock");
+}
+
+void test_resolution(void) {
+    ilog("test_resolution()");
+    const uint64_t SEC = UINT64_C(1000000000);
+    ResolutionController ctl;
+    ResolutionSample good = {2.0, 60, 60, 0, 16000000, 8.0, 5.0};
+    ResolutionSample slow = {2.0, 60, 40, 20, 16000000, 45.0, 300.0};
+    uint64_t now = 100 * SEC;
+    int r;
+
+    ctl.Start(6, now);
+    if (ctl.Update(now + 2 * SEC, slow) != -1)
+        elog("Failed: changed during the hold period");
+
+    // Two bad windows in a row step down
+    now += 10 * SEC;
+    if (ctl.Update(now, slow) != -1 || (r = ctl.Update(now + 2 * SEC, slow)) != 5)
+        elog("Failed: expected a step down, got %d", ctl.current);
+
+    // Stable for long enough steps back up
+    now += 20 * SEC;
+    ctl.Connected(now);
+    for (r = -1; r == -1 && now < 200 * SEC; now += 2 * SEC)
+        r = ctl.Update(now, good);
+
+    if (r != 6)
+        elog("Failed: expected a step up, got %d", r);
+
+    // Failing right after a step up backs off for longer
+    ctl.Connected(now);
+    now += 8 * SEC;
+    ctl.Update(now, slow);
+    if (ctl.Update(now + 2 * SEC, slow) != 5 || ctl.up_wait != 60 * SEC)
+        elog("Failed: expected back off, up_wait=%llu", (unsigned long long) (ctl.up_wait / SEC));
+
+    dlog("~test_resolution");
+}
+
+static void *proxy_client_run(void *data) {
     int proxy_port = *(int *) data;
     dlog("test_proxy() thread");
     test_net(localhost_ip, proxy_port);
@@ -126,40 +939,178 @@ static void *proxy_run(void *data) {
 
 void test_proxy(int proxy_port) {
     pthread_t thr0,thr1,thr2;
-    pthread_create(&thr0, NULL, proxy_run, &proxy_port);
-    pthread_create(&thr1, NULL, proxy_run, &proxy_port);
-    pthread_create(&thr2, NULL, proxy_run, &proxy_port);
+    pthread_create(&thr0, NULL, proxy_client_run, &proxy_port);
+    pthread_create(&thr1, NULL, proxy_client_run, &proxy_port);
+    pthread_create(&thr2, NULL, proxy_client_run, &proxy_port);
     pthread_join(thr0, NULL);
     pthread_join(thr1, NULL);
     pthread_join(thr2, NULL);
 
-    Sleep(1000);
+    os_sleep_ms(1000);
 
-    pthread_create(&thr0, NULL, proxy_run, &proxy_port);
-    pthread_create(&thr1, NULL, proxy_run, &proxy_port);
-    pthread_create(&thr2, NULL, proxy_run, &proxy_port);
+    pthread_create(&thr0, NULL, proxy_client_run, &proxy_port);
+    pthread_create(&thr1, NULL, proxy_client_run, &proxy_port);
+    pthread_create(&thr2, NULL, proxy_client_run, &proxy_port);
     pthread_join(thr0, NULL);
     pthread_join(thr1, NULL);
     pthread_join(thr2, NULL);
 }
 
+// Stands in for the phone behind the impairment proxy, echoes what it gets
+struct mock_phone {
+    socket_t server;
+    volatile bool running;
+    std::atomic<size_t> received;
+};
+
+static void *mock_phone_run(void *data) {
+    struct mock_phone *phone = (struct mock_phone*) data;
+    uint8_t buf[16384];
+
+    while (phone->running) {
+        if (net_wait_readable(&phone->server, 1, 100) <= 0)
+            continue;
+
+        socket_t client = net_accept(phone->server);
+        if (client == INVALID_SOCKET)
+            continue;
+
+        set_nonblock(client, 0);
+        while (phone->running) {
+            if (net_wait_readable(&client, 1, 100) <= 0)
+                continue;
+
+            ssize_t r = net_recv(client, buf, sizeof(buf));
+            if (r > 0)
+                phone->received += r;
+            if (r <= 0 || net_send_all(client, buf, r) <= 0)
+                break;
+        }
+        net_close(client);
+    }
+    return 0;
+}
+
+// Round trip of len bytes through the proxy, -1 when they don't come back intact
+static int echo_ms(socket_t sock, size_t len) {
+    std::vector<uint8_t> out(len), in(len);
+    for (size_t i = 0; i < len; i++)
+        out[i] = (uint8_t) (i * 7 + len);
+
+    uint64_t start = os_gettime_ns();
+    if (net_send_all(sock, out.data(), len) <= 0)
+        return -1;
+    if (net_recv_all(sock, in.data(), len) != (ssize_t) len || in != out)
+        return -1;
+
+    return (int) ((os_gettime_ns() - start) / 1000000);
+}
+
+// Latency, jitter, a rate cap, a stall, a reset and a drain on close, scripted
+// between a client and a mock phone through the relay
+void test_impair(void) {
+    ilog("test_impair()");
+    struct mock_phone phone;
+    Impairment impair;
+    Proxy proxy(NULL);
+    pthread_t thr;
+    socket_t sock = INVALID_SOCKET;
+    int ms, port;
+    size_t before;
+    uint8_t byte;
+
+    phone.server = net_listen(localhost_ip, 0);
+    phone.running = true;
+    phone.received = 0;
+    if (phone.server == INVALID_SOCKET) {
+        elog("Failed: mock phone listen");
+        return;
+    }
+    pthread_create(&thr, NULL, mock_phone_run, &phone);
+
+    proxy.impair = &impair;
+    strcpy(proxy.remote_host, localhost_ip);
+    port = proxy.Start(DeviceRef(), net_listen_port(phone.server));
+    sock = port ? net_connect(localhost_ip, NULL, port) : INVALID_SOCKET;
+    if (sock == INVALID_SOCKET) {
+        elog("Failed: could not connect through the proxy");
+        goto out;
+    }
+    set_nonblock(sock, 0);
+    set_recv_timeout(sock, 5);
+
+    ms = echo_ms(sock, 64);
+    ilog("clean: %d ms", ms);
+    if (ms < 0) elog("Failed: clean echo");
+
+    // Each way, so the round trip is twice that
+    if (!impair.Set("latency=50 jitter=20 seed=1")) elog("Failed: script rejected");
+    for (int i = 0; i < 5; i++) {
+        ms = echo_ms(sock, 1000 + i);
+        ilog("latency 50 +-20: %d ms", ms);
+        if (ms < 60 || ms > 400) elog("Failed: expected about 100 ms");
+    }
+
+    // 50 KB up and back down at 100 KB/s
+    impair.Set("latency=0 jitter=0 rate=800");
+    ms = echo_ms(sock, 50000);
+    ilog("rate 800 kbps: %d ms", ms);
+    if (ms < 450) elog("Failed: rate not limited");
+
+    impair.Set("rate=0 stall=300");
+    ms = echo_ms(sock, 64);
+    ilog("stall 300: %d ms", ms);
+    if (ms < 280) elog("Failed: stall not applied");
+
+    if (impair.Set("latency=10 bogus=1")) elog("Failed: bad script accepted");
+
+    impair.Set("reset");
+    if (net_recv(sock, &byte, 1) > 0) elog("Failed: connection not reset");
+    net_close(sock);
+
+    // Data still on the link when the client hangs up gets to the phone
+    impair.Set("latency=200");
+    sock = net_connect(localhost_ip, NULL, port);
+    if (sock == INVALID_SOCKET) {
+        elog("Failed: could not reconnect through the proxy");
+        goto out;
+    }
+    set_nonblock(sock, 0);
+    before = phone.received;
+    {
+        uint8_t out[1000] = {0};
+        net_send_all(sock, out, sizeof(out));
+    }
+    net_close(sock);
+    sock = INVALID_SOCKET;
+    os_sleep_ms(600);
+    ilog("drained %zu bytes on close", phone.received - before);
+    if (phone.received - before != 1000) elog("Failed: queued data dropped on close");
+
+out:
+    if (sock != INVALID_SOCKET) net_close(sock);
+    phone.running = false;
+    pthread_join(thr, NULL);
+    net_close(phone.server);
+    dlog("~test_impair");
+}
+
 void test_ios(void) {
     ilog("test_ios()");
     int count = 0;
     int usb_port = 0;
-    Device* dev;
     USBMux iosMgr;
     iosMgr.Reload();
-    iosMgr.ResetIter();
-    while ((dev = iosMgr.NextDevice()) != NULL) {
-        iosMgr.GetModel(dev);
+    iosMgr.WaitReload();
+    DeviceListRef list = iosMgr.Devices();
+    for (auto dev : list->devices) {
+        iosMgr.GetModel(dev.get());
         ilog("dev: serial=%s handle=%d model=%s", dev->serial, dev->handle, dev->model);
         count++;
     }
 
     if (count) {
-        iosMgr.ResetIter();
-        dev = iosMgr.NextDevice();
+        DeviceRef dev = list->devices[0];
         int sock = iosMgr.Connect(dev, 4747, &usb_port);
         if (sock > 0 && usb_port > 0) {
             test_net(localhost_ip, usb_port);
@@ -176,6 +1127,254 @@ void test_ios(void) {
     dlog("~test_ios");
 }
 
+#ifndef _WIN32
+// Stand-in usbmuxd on a unix socket: answers Listen with the attached
+// devices and Connect with a tunnel that greets with "ok"
+struct fake_usbmuxd {
+    socket_t server;
+    socket_t listen_conn;
+    std::atomic<bool> running;
+    int connects;
+};
+
+static void fake_usbmuxd_send(socket_t sock, const char *dict) {
+    char body[1024];
+    int len = snprintf(body, sizeof(body),
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<plist version=\"1.0\">\n<dict>\n%s</dict>\n</plist>\n", dict);
+    uint32_t header[4] = {(uint32_t) (16 + len), 1, 8, 0};
+    net_send_all(sock, header, sizeof(header));
+    net_send_all(sock, body, len);
+}
+
+static void fake_usbmuxd_attach(socket_t sock, int id, const char *udid, const char *type) {
+    char dict[512];
+    snprintf(dict, sizeof(dict),
+        "<key>MessageType</key><string>Attached</string>"
+        "<key>DeviceID</key><integer>%d</integer>"
+        "<key>Properties</key><dict><key>ConnectionType</key><string>%s</string>"
+        "<key>DeviceID</key><integer>%d</integer>"
+        "<key>SerialNumber</key><string>%s</string></dict>\n", id, type, id, udid);
+    fake_usbmuxd_send(sock, dict);
+}
+
+static void *fake_usbmuxd_run(void *data) {
+    struct fake_usbmuxd *d = (struct fake_usbmuxd*) data;
+    char body[2048];
+    uint32_t header[4];
+
+    while (d->running) {
+        if (net_wait_readable(&d->server, 1, 50) <= 0)
+            continue;
+
+        socket_t conn = accept(d->server, NULL, NULL);
+        if (conn == INVALID_SOCKET)
+            continue;
+
+        memset(body, 0, sizeof(body));
+        if (net_recv_all(conn, header, sizeof(header)) != sizeof(header)
+            || header[0] <= 16 || header[0] - 16 >= sizeof(body)
+            || net_recv_all(conn, body, header[0] - 16) != (ssize_t) (header[0] - 16))
+        {
+            net_close(conn);
+            continue;
+        }
+
+        const char *ok = "<key>MessageType</key><string>Result</string><key>Number</key><integer>0</integer>\n";
+        if (strstr(body, "<string>Listen</string>")) {
+            fake_usbmuxd_send(conn, ok);
+            fake_usbmuxd_attach(conn, 7, "00008030-TEST", "USB");
+            fake_usbmuxd_attach(conn, 9, "00008030-WIFI", "Network");
+            d->listen_conn = conn;
+        }
+        else if (strstr(body, "<string>Connect</string>")) {
+            // 4747 in network byte order is 35602
+            if (strstr(body, "<integer>8</integer>") && strstr(body, "<integer>35602</integer>")) {
+                fake_usbmuxd_send(conn, ok);
+                net_send_all(conn, "ok", 2);
+                d->connects++;
+            } else {
+                fake_usbmuxd_send(conn, "<key>MessageType</key><string>Result</string><key>Number</key><integer>3</integer>\n");
+            }
+            os_sleep_ms(100);
+            net_close(conn);
+        }
+        else {
+            net_close(conn);
+        }
+    }
+    return NULL;
+}
+
+static bool wait_device(USBMux *mgr, uint64_t generation, const char *udid, bool present) {
+    for (int i = 0; i < 100; i++) {
+        DeviceListRef list = mgr->Devices();
+        if (list->generation > generation && (mgr->GetDevice(udid) != NULL) == present)
+            return true;
+        os_sleep_ms(20);
+    }
+    return false;
+}
+
+// Devices come and go without a Reload(), following the daemon's events
+void test_usbmux(void) {
+    ilog("test_usbmux()");
+    char path[64], env[80];
+    pthread_t thr;
+    struct fake_usbmuxd d;
+    struct sockaddr_un addr;
+    uint64_t generation;
+    DeviceRef dev;
+    socket_t sock;
+    char greeting[2];
+
+    snprintf(path, sizeof(path), "/tmp/droidcam-test-usbmuxd.%d", (int) getpid());
+    snprintf(env, sizeof(env), "UNIX:%s", path);
+    setenv("USBMUXD_SOCKET_ADDRESS", env, 1);
+    unlink(path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    d.server = socket(AF_UNIX, SOCK_STREAM, 0);
+    d.listen_conn = INVALID_SOCKET;
+    d.running = true;
+    d.connects = 0;
+    if (bind(d.server, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(d.server, 4) < 0) {
+        elog("Failed: fake usbmuxd setup");
+        net_close(d.server);
+        return;
+    }
+    pthread_create(&thr, NULL, fake_usbmuxd_run, &d);
+
+    {
+        std::atomic<int> changes{0};
+        USBMux iosMgr;
+        iosMgr.models_changed = count_changed;
+        iosMgr.models_data = &changes;
+        iosMgr.Reload();
+        iosMgr.WaitReload();
+        dev = iosMgr.GetDevice("00008030-TEST");
+        if (!dev || dev->handle != 7 || iosMgr.Devices()->devices.size() != 1)
+            elog("Failed: attached device not listed");
+
+        generation = iosMgr.Devices()->generation;
+        fake_usbmuxd_send(d.listen_conn, "<key>MessageType</key><string>Detached</string><key>DeviceID</key><integer>7</integer>\n");
+        if (!wait_device(&iosMgr, generation, "00008030-TEST", false))
+            elog("Failed: detach not picked up");
+
+        // The properties hear about it without a Refresh
+        int seen = changes;
+        fake_usbmuxd_attach(d.listen_conn, 9, "00008030-OTHER", "USB");
+        for (int i = 0; i < 50 && changes == seen; i++)
+            os_sleep_ms(10);
+        if (changes == seen)
+            elog("Failed: attach not reported to the source");
+
+        generation = iosMgr.Devices()->generation;
+        fake_usbmuxd_attach(d.listen_conn, 8, "00008030-TEST", "USB");
+        if (!wait_device(&iosMgr, generation, "00008030-TEST", true))
+            elog("Failed: attach not picked up");
+
+        sock = usbmux_connect(8, 4747, NULL);
+        if (sock == INVALID_SOCKET || net_recv_all(sock, greeting, 2) != 2 || memcmp(greeting, "ok", 2) != 0)
+            elog("Failed: usbmux connect");
+        if (sock != INVALID_SOCKET) net_close(sock);
+
+        if (usbmux_connect(7, 4747, NULL) != INVALID_SOCKET || d.connects != 1)
+            elog("Failed: connect to a detached device went through");
+
+        // The daemon going away takes its devices along
+        generation = iosMgr.Devices()->generation;
+        net_close(d.listen_conn);
+        if (!wait_device(&iosMgr, generation, "00008030-TEST", false))
+            elog("Failed: devices kept after the daemon went away");
+    }
+
+    d.running = false;
+    pthread_join(thr, NULL);
+    net_close(d.server);
+    unlink(path);
+    unsetenv("USBMUXD_SOCKET_ADDRESS");
+    dlog("~test_usbmux");
+}
+#endif
+
+// Announce a phone straight to the browser socket and check
+// it shows up in the device list without another Reload()
+void test_mdns(void) {
+    ilog("test_mdns()");
+    char buffer[1024];
+    const char* service = DROIDCAM_SERVICE_NAME;
+    const char* instance = "Pixel._droidcamobs._tcp.local.";
+
+    MDNS mdnsMgr;
+    mdnsMgr.Reload();
+    mdnsMgr.WaitReload();
+    uint64_t generation = mdnsMgr.Devices()->generation;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(MDNS_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    mdns_record_t answer, txt, additional[3];
+    memset(&answer, 0, sizeof(answer));
+    memset(&txt, 0, sizeof(txt));
+    memset(additional, 0, sizeof(additional));
+    answer.name.str = service;
+    answer.name.length = strlen(service);
+    answer.type = MDNS_RECORDTYPE_PTR;
+    answer.data.ptr.name.str = instance;
+    answer.data.ptr.name.length = strlen(instance);
+    txt.name = answer.data.ptr.name;
+    txt.type = MDNS_RECORDTYPE_TXT;
+    txt.data.txt.key.str = "name";
+    txt.data.txt.key.length = 4;
+    txt.data.txt.value.str = "Pixel 4a";
+    txt.data.txt.value.length = 8;
+
+    additional[0].name = answer.data.ptr.name;
+    additional[0].type = MDNS_RECORDTYPE_SRV;
+    additional[0].data.srv.name.str = "pixel.local.";
+    additional[0].data.srv.name.length = 12;
+    additional[0].data.srv.port = 4848;
+    additional[1].name = additional[0].data.srv.name;
+    additional[1].type = MDNS_RECORDTYPE_A;
+    additional[1].data.a.addr.sin_family = AF_INET;
+    additional[1].data.a.addr.sin_addr.s_addr = htonl(0x7f000002);
+    additional[2] = txt;
+    
+    socket_t sock = mdns_socket_open_ipv4(NULL);
+    if (sock < 0 || mdns_query_answer_unicast(sock, &addr, sizeof(addr), buffer, sizeof(buffer), 0,
+        MDNS_RECORDTYPE_PTR, service, strlen(service), answer, NULL, 0, additional, 3) < 0)
+    {
+        elog("Failed: could not send announcement");
+        goto out;
+    }
+
+    for (int i = 0; i < 20; i++) {
+        DeviceRef dev = mdnsMgr.GetDevice(instance);
+        if (dev) {
+            ilog("dev: serial=%s model=%s address=%s", dev->serial, dev->model, dev->address);
+            if (mdnsMgr.Devices()->generation <= generation)
+                elog("Failed: generation did not increment");
+            else if (strstr(dev->model, "Pixel 4a [WIFI] (127.0.0.2)") == NULL)
+                elog("Failed: unexpected model");
+            else if (dev->port != 4848 || strcmp(dev->address, "127.0.0.2") != 0)
+                elog("Failed: SRV/A records not used");
+            goto out;
+        }
+        os_sleep_ms(100);
+    }
+    elog("Failed: announced device not found (port %d busy?)", MDNS_PORT);
+
+out:
+    if (sock >= 0)
+        mdns_socket_close(sock);
+    dlog("~test_mdns");
+}
+
 int main(int argc, char** argv) {
     (void) argc;
     (void) argv;
@@ -184,10 +1383,30 @@ int main(int argc, char** argv) {
     test_exec();
     #ifndef _DISABLE_ADB
     test_adb();
+    #ifndef _WIN32
+    test_forwards();
     #endif
+    #endif
+    test_models();
     #ifdef __APPLE__
     test_ios();
     #endif
+    test_mdns();
+    #ifndef _WIN32
+    test_usbmux();
+    #endif
+    test_connect();
+    test_impair();
+    test_http();
+    test_cancel();
+    test_stats();
+    test_budget();
+    test_keyframe();
+    test_tap();
+    test_recover();
+    test_restart();
+    test_clock();
+    test_resolution();
     test_net("1.1.1.1", 80);
     net_cleanup();
     return 0;
@@ -6,3 +6,5 @@
 #include <stdio.h>
 
 #define blog(log_level, fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+
+typedef struct obs_data obs_data_t;
@@ -0,0 +1,521 @@
+/*
+Copyright (C) 2023 DEV47APPS, github.com/dev47apps
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+
+#ifndef _WIN32
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <unistd.h>
+#endif
+
+#include "plugin.h"
+#include "usbmux.h"
+
+#define USBMUX_VERSION     1
+#define USBMUX_PLIST       8
+#define USBMUX_HEADER_SIZE 16
+#define MAX_MESSAGE        (256 * 1024)
+#define ANSWER_TIMEOUT_MS  3000
+#define RETRY_MS           2000
+
+#ifdef _WIN32
+#define DEFAULT_ADDRESS "127.0.0.1:27015"
+#else
+#define DEFAULT_ADDRESS "UNIX:/var/run/usbmuxd"
+#endif
+
+static const char *PROG_NAME = "droidcam-obs-plugin";
+
+void usbmux_address(char *buf, size_t size) {
+    const char *env = getenv("USBMUXD_SOCKET_ADDRESS");
+    snprintf(buf, size, "%s", env && env[0] ? env : DEFAULT_ADDRESS);
+}
+
+static socket_t usbmux_open(const struct net_cancel *cancel) {
+    char address[256];
+    usbmux_address(address, sizeof(address));
+
+    if (strncmp(address, "UNIX:", 5) == 0 || address[0] == '/') {
+    #ifdef _WIN32
+        elog("usbmux: unix sockets not supported: %s", address);
+        return INVALID_SOCKET;
+    #else
+        const char *path = address[0] == '/' ? address : address + 5;
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path))
+            return INVALID_SOCKET;
+        strcpy(addr.sun_path, path);
+
+        socket_t sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET)
+            return INVALID_SOCKET;
+
+        // A local connect either goes through or fails right away
+        if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+            dlog("usbmux: connect %s: %s", path, strerror(errno));
+            net_close(sock);
+            return INVALID_SOCKET;
+        }
+        return sock;
+    #endif
+    }
+
+    char *colon = strrchr(address, ':');
+    if (!colon)
+        return INVALID_SOCKET;
+
+    *colon = 0;
+    return net_connect(address, NULL, (uint16_t) atoi(colon + 1), cancel);
+}
+
+// MARK: plist
+
+// Just enough of the XML plist format for usbmuxd messages
+struct PlistValue {
+    enum { NONE, DICT, ARRAY, STRING, INTEGER, BOOLEAN } type;
+    std::string str;
+    int64_t num;
+    std::vector<std::string> keys;      // dict keys, one per item
+    std::vector<PlistValue> items;      // dict values or array items
+
+    PlistValue() : type(NONE), num(0) {}
+
+    const PlistValue *Get(const char *key) const {
+        for (size_t i = 0; i < keys.size(); i++)
+            if (keys[i] == key) return &items[i];
+        return NULL;
+    }
+
+    const char *String(const char *key) const {
+        const PlistValue *v = Get(key);
+        return v && v->type == STRING ? v->str.c_str() : "";
+    }
+
+    int64_t Integer(const char *key, int64_t fallback) const {
+        const PlistValue *v = Get(key);
+        return v && v->type == INTEGER ? v->num : fallback;
+    }
+};
+
+static void skip_space(const char *&p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+}
+
+// Text up to the closing tag, entities decoded
+static bool plist_text(const char *&p, const char *end, const char *close, std::string &out) {
+    const char *stop = strstr(p, close);
+    if (!stop || stop > end)
+        return false;
+
+    out.clear();
+    while (p < stop) {
+        if (*p == '&') {
+            static const struct { const char *name; char c; } entities[] = {
+                {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&apos;", '\''},
+            };
+            bool found = false;
+            for (auto &e : entities) {
+                size_t len = strlen(e.name);
+                if ((size_t) (stop - p) >= len && memcmp(p, e.name, len) == 0) {
+                    out += e.c;
+                    p += len;
+                    found = true;
+                    break;
+                }
+            }
+            if (found)
+                continue;
+        }
+        out += *p++;
+    }
+    p = stop + strlen(close);
+    return true;
+}
+
+static bool plist_value(const char *&p, const char *end, PlistValue &out, int depth) {
+    char tag[16];
+    size_t len = 0;
+
+    skip_space(p, end);
+    if (depth > 8 || p >= end || *p != '<')
+        return false;
+
+    for (p++; p < end && *p != '>' && len < sizeof(tag) - 1; p++)
+        tag[len++] = *p;
+    tag[len] = 0;
+    if (p >= end || *p != '>')
+        return false;
+    p++;
+
+    if (strcmp(tag, "dict/") == 0) {
+        out.type = PlistValue::DICT;
+        return true;
+    }
+    if (strcmp(tag, "array/") == 0) {
+        out.type = PlistValue::ARRAY;
+        return true;
+    }
+    if (strcmp(tag, "true/") == 0 || strcmp(tag, "false/") == 0) {
+        out.type = PlistValue::BOOLEAN;
+        out.num = tag[0] == 't';
+        return true;
+    }
+    if (strcmp(tag, "string/") == 0) {
+        out.type = PlistValue::STRING;
+        return true;
+    }
+
+    if (strcmp(tag, "dict") == 0 || strcmp(tag, "array") == 0) {
+        const bool dict = tag[0] == 'd';
+        const char *close = dict ? "</dict>" : "</array>";
+        out.type = dict ? PlistValue::DICT : PlistValue::ARRAY;
+        for (;;) {
+            skip_space(p, end);
+            if ((size_t) (end - p) >= strlen(close) && memcmp(p, close, strlen(close)) == 0) {
+                p += strlen(close);
+                return true;
+            }
+
+            if (dict) {
+                std::string key;
+                if ((size_t) (end - p) < 5 || memcmp(p, "<key>", 5) != 0)
+                    return false;
+                p += 5;
+                if (!plist_text(p, end, "</key>", key))
+                    return false;
+                out.keys.push_back(key);
+            }
+
+            out.items.emplace_back();
+            if (!plist_value(p, end, out.items.back(), depth + 1))
+                return false;
+        }
+    }
+
+    // Simple values, data and dates are kept as text
+    char close[24];
+    snprintf(close, sizeof(close), "</%s>", tag);
+    if (!plist_text(p, end, close, out.str))
+        return false;
+
+    if (strcmp(tag, "integer") == 0) {
+        out.type = PlistValue::INTEGER;
+        out.num = strtoll(out.str.c_str(), NULL, 10);
+    } else {
+        out.type = PlistValue::STRING;
+    }
+    return true;
+}
+
+static bool plist_parse(const char *xml, size_t len, PlistValue &out) {
+    const char *end = xml + len;
+    const char *p = strstr(xml, "<plist");
+    if (!p || !(p = strchr(p, '>')))
+        return false;
+
+    p++;
+    return plist_value(p, end, out, 0);
+}
+
+// MARK: messages
+
+static bool usbmux_send(socket_t sock, uint32_t tag, const char *type, const char *extra) {
+    char body[1024];
+    int len = snprintf(body, sizeof(body),
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+        "<plist version=\"1.0\">\n"
+        "<dict>\n"
+        "\t<key>ClientVersionString</key>\n\t<string>%s</string>\n"
+        "\t<key>MessageType</key>\n\t<string>%s</string>\n"
+        "\t<key>ProgName</key>\n\t<string>%s</string>\n"
+        "\t<key>kLibUSBMuxVersion</key>\n\t<integer>3</integer>\n"
+        "%s"
+        "</dict>\n"
+        "</plist>\n",
+        PROG_NAME, type, PROG_NAME, extra ? extra : "");
+    if (len <= 0 || len >= (int) sizeof(body))
+        return false;
+
+    uint8_t header[USBMUX_HEADER_SIZE];
+    const uint32_t fields[4] = {(uint32_t) (USBMUX_HEADER_SIZE + len), USBMUX_VERSION, USBMUX_PLIST, tag};
+    for (int i = 0; i < 4; i++) {
+        header[i*4 + 0] = (uint8_t) (fields[i]);
+        header[i*4 + 1] = (uint8_t) (fields[i] >> 8);
+        header[i*4 + 2] = (uint8_t) (fields[i] >> 16);
+        header[i*4 + 3] = (uint8_t) (fields[i] >> 24);
+    }
+
+    return net_send_all(sock, header, sizeof(header)) > 0
+        && net_send_all(sock, body, (size_t) len) > 0;
+}
+
+static inline uint32_t read32le(const uint8_t *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static bool usbmux_recv(socket_t sock, const struct net_cancel *cancel, PlistValue &out) {
+    uint8_t header[USBMUX_HEADER_SIZE];
+    if (net_recv_all(sock, header, sizeof(header), cancel) != (ssize_t) sizeof(header))
+        return false;
+
+    uint32_t len = read32le(header);
+    if (len <= USBMUX_HEADER_SIZE || len > MAX_MESSAGE || read32le(&header[8]) != USBMUX_PLIST) {
+        elog("usbmux: unexpected message, length=%u type=%u", len, read32le(&header[8]));
+        return false;
+    }
+
+    len -= USBMUX_HEADER_SIZE;
+    std::vector<char> body(len + 1);
+    if (net_recv_all(sock, body.data(), len, cancel) != (ssize_t) len)
+        return false;
+
+    body[len] = 0;
+    out = PlistValue();
+    if (!plist_parse(body.data(), len, out) || out.type != PlistValue::DICT) {
+        elog("usbmux: could not parse message");
+        return false;
+    }
+    return true;
+}
+
+// Wait for the Result of a request, skipping any events in between
+static int usbmux_result(socket_t sock, const struct net_cancel *cancel) {
+    PlistValue msg;
+    for (;;) {
+        if (net_wait_readable(&sock, 1, ANSWER_TIMEOUT_MS, cancel) <= 0)
+            return -1;
+
+        if (!usbmux_recv(sock, cancel, msg))
+            return -1;
+
+        if (strcmp(msg.String("MessageType"), "Result") == 0)
+            return (int) msg.Integer("Number", -1);
+    }
+}
+
+socket_t usbmux_connect(int device_id, uint16_t port, const struct net_cancel *cancel) {
+    char extra[128];
+    int result;
+    socket_t sock = usbmux_open(cancel);
+    if (sock == INVALID_SOCKET) {
+        elog("usbmux: daemon not reachable");
+        return INVALID_SOCKET;
+    }
+
+    // The port goes in network byte order
+    snprintf(extra, sizeof(extra),
+        "\t<key>DeviceID</key>\n\t<integer>%d</integer>\n"
+        "\t<key>PortNumber</key>\n\t<integer>%d</integer>\n",
+        device_id, (int) (uint16_t) ((port >> 8) | (port << 8)));
+
+    if (!usbmux_send(sock, 1, "Connect", extra)) {
+        elog("usbmux: send(Connect) failed");
+        goto fail;
+    }
+
+    result = usbmux_result(sock, cancel);
+    if (result != 0) {
+        elog("usbmux: connect to device %d port %d failed: %d", device_id, port, result);
+        goto fail;
+    }
+
+    // From here on the socket is the tunnel
+    return sock;
+
+    fail:
+    net_close(sock);
+    return INVALID_SOCKET;
+}
+
+// MARK: listener
+
+void *usbmux_listen_thread(void *data) {
+    ((UsbmuxListener*) data)->Run();
+    return NULL;
+}
+
+UsbmuxListener::UsbmuxListener(callback_t changed, void *data)
+    : changed(changed), data(data), running(false), ready(false), reachable(false)
+{
+}
+
+UsbmuxListener::~UsbmuxListener() {
+    Stop();
+}
+
+bool UsbmuxListener::Start(void) {
+    if (running)
+        return true;
+
+    if (!net_cancel_init(&cancel))
+        return false;
+
+    if (pthread_create(&thr, NULL, usbmux_listen_thread, this) != 0) {
+        elog("usbmux: error creating listen thread");
+        net_cancel_free(&cancel);
+        return false;
+    }
+
+    running = true;
+    return true;
+}
+
+void UsbmuxListener::Stop(void) {
+    if (!running)
+        return;
+
+    net_cancel_fire(&cancel);
+    pthread_join(thr, NULL);
+    net_cancel_free(&cancel);
+    running = false;
+}
+
+bool UsbmuxListener::WaitReady(int timeout_ms, const std::atomic<bool> *cancelled) {
+    std::unique_lock<std::mutex> guard(lock);
+    ready_cv.wait_for(guard, std::chrono::milliseconds(timeout_ms),
+        [this, cancelled] { return ready || (cancelled && *cancelled); });
+    return ready && reachable;
+}
+
+void UsbmuxListener::Wake(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    ready_cv.notify_all();
+}
+
+std::vector<UsbmuxDevice> UsbmuxListener::Devices(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    return devices;
+}
+
+void UsbmuxListener::SetReady(bool ok) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (ready && reachable == ok)
+            return;
+
+        ready = true;
+        reachable = ok;
+    }
+    ready_cv.notify_all();
+}
+
+bool UsbmuxListener::Attached(int id, const char *udid) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &dev : devices) {
+        if (dev.id == id)
+            return false;
+    }
+
+    UsbmuxDevice dev;
+    dev.id = id;
+    snprintf(dev.udid, sizeof(dev.udid), "%s", udid);
+    devices.push_back(dev);
+    ilog("usbmux: attached %s (%d)", dev.udid, id);
+    return true;
+}
+
+bool UsbmuxListener::Detached(int id) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = devices.begin(); it != devices.end(); ++it) {
+        if (it->id == id) {
+            ilog("usbmux: detached %s (%d)", it->udid, id);
+            devices.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+void UsbmuxListener::Run(void) {
+    PlistValue msg;
+    char address[256];
+    usbmux_address(address, sizeof(address));
+    dlog("usbmux: listening via %s", address);
+
+    while (!net_cancelled(&cancel)) {
+        socket_t sock = usbmux_open(&cancel);
+        if (sock == INVALID_SOCKET)
+            goto retry;
+
+        if (!usbmux_send(sock, 0, "Listen", NULL) || usbmux_result(sock, &cancel) != 0) {
+            elog("usbmux: Listen failed");
+            goto retry;
+        }
+
+        // Every attached device is announced right after the Result,
+        // the list counts as complete once the daemon goes quiet
+        for (bool first = true;;) {
+            int r = net_wait_readable(&sock, 1, first ? 250 : -1, &cancel);
+            if (r < 0)
+                break;
+
+            if (r == 0) {
+                first = false;
+                SetReady(true);
+                continue;
+            }
+
+            if (!usbmux_recv(sock, &cancel, msg)) {
+                if (!net_cancelled(&cancel))
+                    ilog("usbmux: daemon connection closed");
+                break;
+            }
+
+            const char *type = msg.String("MessageType");
+            bool update = false;
+            if (strcmp(type, "Attached") == 0) {
+                const PlistValue *props = msg.Get("Properties");
+                // WiFi synced phones show up too, only USB is of use here
+                if (props && strcmp(props->String("ConnectionType"), "USB") == 0)
+                    update = Attached((int) msg.Integer("DeviceID", 0), props->String("SerialNumber"));
+            }
+            else if (strcmp(type, "Detached") == 0) {
+                update = Detached((int) msg.Integer("DeviceID", 0));
+            }
+
+            if (update)
+                changed(data);
+        }
+
+        retry:
+        if (sock != INVALID_SOCKET)
+            net_close(sock);
+
+        // The daemon is gone, and so are its devices
+        bool had_devices;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            had_devices = !devices.empty();
+            devices.clear();
+        }
+        if (had_devices)
+            changed(data);
+
+        SetReady(false);
+        net_cancel_sleep(&cancel, RETRY_MS);
+    }
+}
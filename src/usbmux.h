@@ -0,0 +1,67 @@
+// Copyright (C) 2023 DEV47APPS, github.com/dev47apps
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include <util/threading.h>
+#include "net.h"
+
+// Native client for the usbmuxd plist protocol, instead of the blocking
+// libusbmuxd calls. The daemon is at USBMUXD_SOCKET_ADDRESS when set,
+// "UNIX:/path" or "host:port" like libusbmuxd takes it, otherwise at
+// /var/run/usbmuxd (127.0.0.1:27015 on Windows).
+
+struct UsbmuxDevice {
+    int id;             // DeviceID, changes every time the phone is plugged in
+    char udid[64];
+};
+
+// Where the daemon listens, for logging
+void usbmux_address(char *buf, size_t size);
+
+// Tunnel to port on the device. Returns INVALID_SOCKET if the daemon or
+// the device refused, didn't answer in time or the token fired.
+socket_t usbmux_connect(int device_id, uint16_t port, const struct net_cancel *cancel);
+
+// Keeps a Listen connection to the daemon and the list of attached USB
+// devices up to date, calling changed() from its own thread whenever a
+// device comes or goes. Reconnects when the daemon restarts.
+struct UsbmuxListener {
+    typedef void (*callback_t)(void *data);
+
+    UsbmuxListener(callback_t changed, void *data);
+    ~UsbmuxListener();
+
+    bool Start(void);
+    void Stop(void);
+
+    // Wait for the first answer from the daemon, false on timeout,
+    // when it can't be reached or once *cancelled is set
+    bool WaitReady(int timeout_ms, const std::atomic<bool> *cancelled = NULL);
+
+    // Wake up WaitReady() to check its cancelled flag
+    void Wake(void);
+
+    std::vector<UsbmuxDevice> Devices(void);
+
+private:
+    callback_t changed;
+    void *data;
+    bool running;
+    pthread_t thr;
+    struct net_cancel cancel;
+
+    std::mutex lock;
+    std::condition_variable ready_cv;
+    bool ready;
+    bool reachable;
+    std::vector<UsbmuxDevice> devices;
+
+    friend void *usbmux_listen_thread(void *data);
+    void Run(void);
+    bool Attached(int id, const char *udid);
+    bool Detached(int id);
+    void SetReady(bool reachable);
+};